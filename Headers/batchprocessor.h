@@ -0,0 +1,99 @@
+#ifndef BATCHPROCESSOR_H
+#define BATCHPROCESSOR_H
+
+#include <QString>
+#include <QStringList>
+
+#include "Headers/filterpipeline.h"
+
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+/*
+Runs a chain of filters over image files and writes the results, without any widget.
+The chain is a comma separated list such as "gray,gauss3,sobel,percentile=0.95" (see
+filterHelp()). Consecutive filters that can be streamed are grouped in a FilterPipeline,
+the others (median, local contrast normalization, ...) run on the whole image.
+Several files are processed at once, and every image is itself split in row bands, on
+the shared thread pool.
+*/
+class BatchProcessor
+{
+public:
+    struct Statistics
+    {
+        int nbImages;
+        int nbFailed;
+        qint64 nbPixels;
+        qint64 bytesRead;
+        // Summed over the threads
+        double loadSeconds;
+        double filterSeconds;
+        double saveSeconds;
+        double elapsedSeconds;
+    };
+
+    BatchProcessor();
+
+    // False, with the reason in errorMessage, if the chain has an unknown filter or parameter
+    bool setFilterChain(const QString &chain, QString &errorMessage);
+    static QString filterHelp();
+
+    void setOutputDirectory(const QString &directory);
+    // Format of the written files ("png", "jpg", ...), empty keeps the one of the input
+    void setOutputFormat(const QString &format);
+    // Look for images in the subdirectories of the input directories
+    void setRecursive(const bool recursive);
+    // Images processed at once, 0 means one per thread of the shared pool
+    void setParallelFiles(const int parallelFiles);
+    // Threads used by the filters of one image, 0 means all the threads of the shared pool
+    void setThreadCount(const int threadCount);
+    // Process every image in strips using at most bytes of memory (see StripProcessor), 0 loads
+    // the whole images. The results are then written as PGM / PPM files.
+    void setStripMemoryBudget(const qint64 bytes);
+    // Only a chain of streamed filters can run in strips
+    bool canProcessInStrips() const;
+
+    // Process the files and the images of the directories of inputs, reportError is called
+    // (from any thread, one call at a time) for every file that could not be processed
+    Statistics run(const QStringList &inputs, const function<void(const QString&)> &reportError) const;
+
+private:
+    struct Step
+    {
+        enum Type
+        {
+            Pipeline,
+            MeanBlur,
+            Median,
+            LocalContrastNormalization,
+            Variation
+        };
+
+        Type type;
+        FilterPipeline pipeline;
+        int kernelRadius;
+    };
+
+    struct InputFile
+    {
+        QString path;
+        // Path of the result, relative to the output directory
+        QString outputPath;
+    };
+
+    vector<InputFile> collectFiles(const QStringList &inputs, const function<void(const QString&)> &reportError) const;
+    void applySteps(QImage &image, QImage &buffer) const;
+
+    vector<Step> steps;
+    QString outputDirectory;
+    QString outputFormat;
+    bool recursive;
+    int nbParallelFiles;
+    int nbThreads;
+    qint64 stripMemoryBudget;
+};
+
+#endif // BATCHPROCESSOR_H
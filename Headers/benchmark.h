@@ -0,0 +1,95 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QImage>
+#include <QJsonDocument>
+#include <QString>
+#include <QStringList>
+
+#include <functional>
+#include <vector>
+
+using namespace std;
+
+class ImageProcessing;
+
+/*
+Times every filter of ImageProcessing on synthetic images, for each size, format and
+thread count asked. A measure repeats the filter, after one warm-up run, until it has
+run for minimumSeconds and at least 3 times, and keeps the median time of a run.
+Results are saved as JSON and can be compared with a previous run (baseline).
+*/
+class Benchmark
+{
+public:
+    struct Result
+    {
+        QString kernel;
+        QString format;
+        int width;
+        int height;
+        int threads;
+        int iterations;
+        // Median and fastest run
+        double seconds;
+        double fastestSeconds;
+        // Bytes read from the source and written to the destination per run
+        qint64 bytes;
+
+        double megapixelsPerSecond() const { return (double)width*height / seconds * 1e-6; }
+        double bytesPerSecond() const { return bytes / seconds; }
+        // Kernel, format, size and threads: identifies the result in a baseline
+        QString key() const;
+    };
+
+    Benchmark();
+
+    // Square images of size x size pixels
+    void setSizes(const vector<int> &sizes);
+    void setFormats(const vector<QImage::Format> &formats);
+    // 0 means all the threads of the shared pool
+    void setThreadCounts(const vector<int> &threadCounts);
+    // Only the kernels whose name contains one of the filters, all when empty
+    void setKernelFilters(const QStringList &filters);
+    void setMinimumSeconds(const double seconds);
+
+    static QStringList kernelNames();
+    static QString formatName(const QImage::Format format);
+    // Format_Invalid for an unknown name
+    static QImage::Format formatFromName(const QString &name);
+
+    // progress is called after every measure
+    vector<Result> run(const function<void(const Result&)> &progress) const;
+
+    static QJsonDocument toJson(const vector<Result> &results);
+    static bool fromJson(const QJsonDocument &document, vector<Result> &results, QString &errorMessage);
+
+    /*
+    Compare results with baseline, a result being a regression when its median time is more
+    than tolerance (0.1 for 10%) above the one of the baseline. Returns the number of
+    regressions, report receives one line per result found in both.
+    */
+    static int compare(const vector<Result> &results, const vector<Result> &baseline, const double tolerance,
+                       const function<void(const QString&)> &report);
+
+private:
+    struct Kernel
+    {
+        QString name;
+        function<void(ImageProcessing&, const QImage&, QImage&)> run;
+        // The kernel does not write an image
+        bool readOnly;
+    };
+
+    static vector<Kernel> kernels();
+    static QImage syntheticImage(const int size, const QImage::Format format);
+    Result measure(const Kernel &kernel, const QImage &image, const int threads) const;
+
+    vector<int> sizes;
+    vector<QImage::Format> formats;
+    vector<int> threadCounts;
+    QStringList kernelFilters;
+    double minimumSeconds;
+};
+
+#endif // BENCHMARK_H
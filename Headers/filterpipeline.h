@@ -0,0 +1,108 @@
+#ifndef FILTERPIPELINE_H
+#define FILTERPIPELINE_H
+
+#include <QImage>
+
+#include "Headers/imageview.h"
+#include "Headers/simdkernels.h"
+
+#include <vector>
+
+using namespace std;
+
+/*
+Chain of filters run in a single pass over the image, for instance
+    FilterPipeline().grayscale().gaussianBlur3x3().gradient().percentileThreshold(0.95f).run(image, edges);
+gives the result of convertToGrayScale, gaussianBlur3x3 and gradientThreshold without
+their intermediate images. Rows are streamed from one stage to the next: a stage with a
+(2r+1) rows neighborhood reads a ring of 2r+1 rows of the previous stage, so only a few
+rows per stage are alive and they stay in cache. Point operations (grayscale, fixed
+threshold) have no ring, they are applied to the rows of the previous stage as they are
+produced. Results are the same as the ones of the corresponding ImageProcessing filters.
+*/
+class FilterPipeline
+{
+public:
+    FilterPipeline();
+
+    // Point operations
+    // 1 byte per pixel luma of 4 bytes pixels
+    FilterPipeline& grayscale();
+    // Color bytes < value become 0, the others 255
+    FilterPipeline& threshold(const int value);
+
+    // Neighborhood operations
+    FilterPipeline& meanBlur(const int kernelRadius = 1);
+    FilterPipeline& gaussianBlur3x3();
+    FilterPipeline& gaussianBlur5x5();
+    FilterPipeline& filter(const int kernelRadius, const int kernel[], const float kernelParameter);
+    FilterPipeline& separableFilter(const int kernelRadius, const int rowKernel[], const int columnKernel[], const float kernelParameter);
+    // Sobel gradient magnitude
+    FilterPipeline& gradient(const SimdKernels::GradientMagnitude magnitude = SimdKernels::MagnitudeL2);
+
+    // Last operation: binarize at the value reached by percentageOfPixels of the pixels.
+    // The histogram is counted as the result is written, the result is read once more.
+    FilterPipeline& percentileThreshold(const float percentageOfPixels);
+
+    int stageCount() const;
+    // Rows read above and below a row of the result
+    int halo() const;
+
+    // Number of threads used, 0 means all the threads of the shared pool
+    void setThreadCount(const int threadCount);
+    int threadCount() const;
+
+    // Format_Grayscale8 result after grayscale(), else the format of the image (see ImageView::supportedFormat).
+    // image may be destination itself.
+    void run(const QImage &image, QImage &destination) const;
+
+    // Pieces of run, for images processed in strips (see StripProcessor)
+    QImage::Format resultFormat(const QImage::Format format) const;
+    // Rows [rowStart, rowEnd) of the result of an image of imageHeight rows, without the final
+    // percentile threshold. source holds the rows [sourceRow, sourceRow + source.height) of the
+    // image, at least the rows [rowStart - halo(), rowEnd + halo()) inside the image.
+    // destination row 0 is row rowStart. The histogram of the first byte of the result is
+    // added to histogram if it is not null.
+    void runRows(const ImageView &source, const int sourceRow, const int imageHeight, const MutableImageView &destination,
+                 const int rowStart, const int rowEnd, quint32 histogram[] = nullptr) const;
+    bool hasPercentileThreshold() const;
+    int percentileThresholdValue(const quint32 histogram[], const qint64 nbPixels) const;
+    // First byte < threshold becomes 0, the others 255, for all the color bytes
+    void binarize(const MutableImageView &image, const int threshold) const;
+
+private:
+    struct Stage
+    {
+        enum Type
+        {
+            Grayscale,
+            Threshold,
+            Convolution,
+            SeparableConvolution,
+            Gradient
+        };
+
+        Type type;
+        // 0 for the point operations
+        int kernelRadius;
+        vector<int> kernel;
+        vector<int> rowKernel;
+        vector<int> columnKernel;
+        float kernelParameter;
+        SimdKernels::GradientMagnitude magnitude;
+        int thresholdValue;
+    };
+
+    class RowStream;
+
+    FilterPipeline& addStage(const Stage &stage);
+    void runBand(const ImageView &source, const int sourceRow, const int imageHeight, const MutableImageView &destination,
+                 const int destinationStart, const int rowStart, const int rowEnd, quint32 histogram[]) const;
+
+    vector<Stage> stages;
+    // Negative when there is no final percentile threshold
+    float thresholdPercentage;
+    int nbThreads;
+};
+
+#endif // FILTERPIPELINE_H
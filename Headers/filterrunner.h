@@ -0,0 +1,90 @@
+#ifndef FILTERRUNNER_H
+#define FILTERRUNNER_H
+
+#include "Headers/imageprocessing.h"
+#include "Headers/resultcache.h"
+
+#include <QImage>
+#include <QList>
+#include <QObject>
+#include <QRect>
+#include <QString>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+
+using namespace std;
+
+class QThread;
+
+/*
+Runs the filters of the viewer on worker threads, so the window stays responsive.
+A new request supersedes the one running: the old one is cancelled and its result
+dropped. The signals are delivered in the thread of the runner (the GUI thread) once the
+worker is done, so the result is applied like any other event.
+*/
+class FilterRunner : public QObject
+{
+    Q_OBJECT
+
+public:
+    // Writes the result of source into destination
+    typedef function<void(ImageProcessing&, const QImage&, QImage&)> Filter;
+
+    explicit FilterRunner(QObject *parent = nullptr);
+    // Cancels the requests and waits for their threads
+    ~FilterRunner();
+
+    /*
+    Start filter on source, writing into destination: its buffer is reused when it has the
+    size and format of the result and is not shared, pass it with std::move. source is
+    shared, not copied: the caller must not modify its pixels in place while the filter runs.
+    operation names the filter and its parameters: with a result cache, a result of the same
+    operation on the same pixels is reported without running the filter. Empty for a filter
+    whose results are not kept. Returns the number of the request.
+    */
+    int run(const QString &name, const QString &operation, const QImage &source, QImage destination, const Filter &filter);
+    /*
+    Same as run, for a filter whose result pixels only depend on the source pixels at most
+    halo pixels away: the result is computed by tiles, visibleRect first, each one reported
+    by tileReady as soon as it is done. When the image is shown reduced (scale < 1), the
+    visible part is first filtered at the scale it is shown, as a quick preview.
+    */
+    int runProgressive(const QString &name, const QString &operation, const QImage &source, QImage destination, const Filter &filter,
+                       const int halo, const QRect &visibleRect, const double scale);
+    // Results of the operations and data derived from the images, null for none. cache must outlive the runner.
+    void setResultCache(ResultCache *cache);
+    // Part of the image shown, its tiles are computed before the others
+    void setVisibleRect(const QRect &visibleRect);
+    // Cancel the last request
+    void cancel();
+    bool isRunning() const;
+
+    static const int tileSize = 256;
+
+signals:
+    void progressChanged(int percent);
+    // Result of the part rect of the image, tile is smaller than rect for a reduced preview
+    void tileReady(const QRect &rect, const QImage &tile);
+    void finished(const QString &name, const QImage &result);
+    void cancelled(const QString &name);
+
+private:
+    shared_ptr<FilterControl> startRequest(int &request);
+    void startThread(const function<void()> &work);
+    void reportProgress(const int request, const int percent);
+    void reportTile(const int request, const QRect &rect, const QImage &tile);
+    void reportDone(const int request, const QString &name, QImage result, const bool wasCancelled);
+    QRect currentVisibleRect() const;
+
+    int lastRequest;
+    bool running;
+    ResultCache *resultCache;
+    shared_ptr<FilterControl> lastControl;
+    QList<QThread*> threads;
+    mutable mutex visibleRectMutex;
+    QRect visibleRect;
+};
+
+#endif // FILTERRUNNER_H
@@ -0,0 +1,133 @@
+#ifndef IMAGEBUFFERPOOL_H
+#define IMAGEBUFFERPOOL_H
+
+#include <QImage>
+#include <QtGlobal>
+
+#include <algorithm>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+using namespace std;
+
+/*
+Pool of the buffers of intermediate images and scratch memory.
+Buffers are sorted in size buckets, 4 per power of two so a buffer is at most 25%
+larger than requested, and a released buffer is kept for the next request of its
+bucket (up to maxPooledBytes). Processing frames of the same size again reuses the
+same memory, already mapped, instead of asking the system for fresh pages.
+*/
+class ImageBufferPool
+{
+public:
+    struct Statistics
+    {
+        // Requests served by a pooled buffer, and by a new allocation
+        quint64 hits;
+        quint64 misses;
+        qsizetype bytesInUse;
+        // Maximum of bytesInUse
+        qsizetype highWaterMark;
+        // Released buffers kept for reuse
+        qsizetype bytesPooled;
+    };
+
+    static constexpr qsizetype alignment = 64;
+
+    explicit ImageBufferPool(const qsizetype maxPooledBytes = qsizetype(512)*1024*1024);
+    ~ImageBufferPool();
+    ImageBufferPool(const ImageBufferPool&) = delete;
+    ImageBufferPool& operator=(const ImageBufferPool&) = delete;
+
+    // Pool shared by all the filters
+    static ImageBufferPool& instance();
+
+    // Buffer of at least size bytes, aligned on 64 bytes, its content is undefined
+    uchar* acquire(const qsizetype size);
+    // Give back a buffer of any pool
+    static void release(uchar* buffer);
+
+    // Image whose buffer goes back to the pool when its last copy is destroyed
+    QImage image(const int width, const int height, const QImage::Format format);
+
+    Statistics statistics() const;
+    void resetStatistics();
+    void setMaxPooledBytes(const qsizetype maxPooledBytes);
+    // Free all the pooled buffers
+    void trim();
+
+private:
+    struct BufferHeader
+    {
+        ImageBufferPool* pool;
+        int bucket;
+    };
+
+    static int bucketOf(const qsizetype size);
+    static qsizetype bucketSize(const int bucket);
+    void giveBack(uchar* buffer, const int bucket);
+    void trimTo(const qsizetype maxBytes);
+
+    mutable mutex poolMutex;
+    // freeBuffers[bucket] = released buffers of this bucket, the last one is the most recent
+    vector<vector<uchar*>> freeBuffers;
+    Statistics stats;
+    qsizetype maxPooled;
+};
+
+/*
+Scratch array of trivial values taken from the shared pool and given back when destroyed.
+Unlike a vector, the values are not initialized.
+*/
+template<typename T>
+class PooledBuffer
+{
+    static_assert(is_trivially_copyable<T>::value, "PooledBuffer only holds trivial values");
+
+public:
+    PooledBuffer() : buffer(nullptr), count(0) {}
+    explicit PooledBuffer(const qsizetype size) : PooledBuffer() { resize(size); }
+    ~PooledBuffer() { reset(); }
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+    PooledBuffer(PooledBuffer&& other) : buffer(other.buffer), count(other.count)
+    {
+        other.buffer = nullptr;
+        other.count = 0;
+    }
+
+    // The content is not kept
+    void resize(const qsizetype size)
+    {
+        if(size == count)
+            return;
+        reset();
+        if(size > 0)
+            buffer = reinterpret_cast<T*>(ImageBufferPool::instance().acquire(size*(qsizetype)sizeof(T)));
+        count = size;
+    }
+
+    void reset()
+    {
+        if(buffer != nullptr)
+            ImageBufferPool::release(reinterpret_cast<uchar*>(buffer));
+        buffer = nullptr;
+        count = 0;
+    }
+
+    void fill(const T& value) { std::fill(buffer, buffer + count, value); }
+
+    T* data() { return buffer; }
+    const T* data() const { return buffer; }
+    qsizetype size() const { return count; }
+    bool empty() const { return count == 0; }
+    T& operator[](const qsizetype i) { return buffer[i]; }
+    const T& operator[](const qsizetype i) const { return buffer[i]; }
+
+private:
+    T* buffer;
+    qsizetype count;
+};
+
+#endif // IMAGEBUFFERPOOL_H
@@ -0,0 +1,63 @@
+#ifndef IMAGECANVAS_H
+#define IMAGECANVAS_H
+
+#include "Headers/tilepyramid.h"
+
+#include <QImage>
+#include <QList>
+#include <QPair>
+#include <QRect>
+#include <QWidget>
+
+#include <memory>
+
+using namespace std;
+
+class QPainter;
+class QThread;
+
+/*
+Shows an image stretched to the size of the widget, like a QLabel with scaled contents,
+but paints only the exposed part, from the level of a TilePyramid closest to the zoom.
+The tiles missing are built on a worker thread, a more reduced level or the previous image
+(of the same size) standing in for them meanwhile, so that zooming and scrolling never
+wait for them.
+*/
+class ImageCanvas : public QWidget
+{
+    Q_OBJECT
+
+public:
+    explicit ImageCanvas(QWidget *parent = nullptr);
+    // Waits for the tiles being built
+    ~ImageCanvas();
+
+    void setImage(const QImage &image);
+    // Cache of the reduced tiles, in bytes
+    void setCacheBudget(const qint64 budget);
+    /*
+    Paint patch over rect of the image, scaled to rect, until the next setImage or
+    clearPatches: the tiles of a filter still running.
+    */
+    void drawPatch(const QRect &rect, const QImage &patch);
+    void clearPatches();
+
+    QSize sizeHint() const override;
+
+protected:
+    void paintEvent(QPaintEvent *event) override;
+
+private:
+    bool drawTile(QPainter &painter, const shared_ptr<TilePyramid> &source, const TilePyramid::TileKey &key,
+                  const int firstLevel, const QRectF &target);
+    void requestTiles(const vector<TilePyramid::TileKey> &keys);
+
+    shared_ptr<TilePyramid> pyramid;
+    // Pyramid of the image replaced, shown until the tiles of the new one are built
+    shared_ptr<TilePyramid> previousPyramid;
+    QList<QPair<QRect, QImage>> patches;
+    qint64 cacheBudget;
+    QThread *builder;
+};
+
+#endif // IMAGECANVAS_H
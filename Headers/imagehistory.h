@@ -0,0 +1,107 @@
+#ifndef IMAGEHISTORY_H
+#define IMAGEHISTORY_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QSize>
+#include <QString>
+#include <QTemporaryFile>
+#include <QVector>
+#include <QtGlobal>
+
+#include <memory>
+#include <vector>
+
+using namespace std;
+
+/*
+Undo / redo history of the images of the viewer. Revisions are stored by tiles of
+tileBytes x tileRows bytes of the rows, any format: a tile equal to the one at the same
+place in the revision it replaces is shared with it instead of being copied, so a filter
+changing part of the image only stores that part.
+The current revision keeps the image it was given, shared and never copied (a mapped image
+stays mapped): its tiles are read from that image, and only copied when the next current
+image changes them.
+The tiles of the revisions are kept in memory up to budget bytes. Beyond it, the revisions
+farthest from the current one are compressed to a temporary file of the spill directory,
+or dropped when there is none. The current revision is never dropped, nor spilled while
+it is the current one.
+*/
+class ImageHistory
+{
+public:
+    static constexpr int tileBytes = 1024;
+    static constexpr int tileRows = 64;
+    static constexpr qint64 defaultBudget = qint64(512)*1024*1024;
+
+    explicit ImageHistory(const qint64 budget = defaultBudget);
+
+    // Drop every revision and the spilled ones
+    void clear();
+    // New current revision, the revisions that could be redone are dropped
+    void push(const QImage &image, const QString &label);
+
+    bool canUndo() const;
+    bool canRedo() const;
+    // Label of the revision undo leaves, and of the one redo goes back to
+    QString undoLabel() const;
+    QString redoLabel() const;
+    // Image of the revision before, or after, the current one; null when it cannot be read back
+    QImage undo();
+    QImage redo();
+
+    void setBudget(const qint64 budget);
+    qint64 budget() const;
+    // Empty to drop the revisions over the budget instead, the revisions already spilled are kept
+    void setSpillDirectory(const QString &directory);
+    QString spillDirectory() const;
+
+    int revisionCount() const;
+    // Bytes of the tiles in memory, a tile shared by revisions counted once; the image of the
+    // current revision is not counted
+    qint64 memoryUsed() const;
+    qint64 spilledBytes() const;
+
+private:
+    struct Tile
+    {
+        // Empty once spilled, or while in the current image
+        QByteArray pixels;
+        // Compressed pixels in the spill file, spillOffset is -1 while the tile is in memory
+        qint64 spillOffset;
+        int spillSize;
+        // The pixels are read from currentImage: only the tiles of the current revision are
+        bool inCurrentImage;
+    };
+
+    struct Revision
+    {
+        QString label;
+        QSize size;
+        QImage::Format format;
+        QVector<QRgb> colorTable;
+        // Tiles of a band of tileRows rows
+        int columns;
+        vector<shared_ptr<Tile>> tiles;
+    };
+
+    static Revision makeRevision(const QImage &image, const QString &label);
+    void leaveCurrentImage(const QImage &image, Revision &revision);
+    QImage restore(const Revision &revision);
+    QImage moveTo(const int revision);
+    void enforceBudget();
+    void dropRevision(const int index);
+    bool spill(Revision &revision);
+
+    vector<Revision> revisions;
+    // -1 when empty
+    int current;
+    QImage currentImage;
+    qint64 maxBytes;
+    // Kept up to date by the copies, spills and drops of tiles, see memoryUsed
+    qint64 bytesInMemory;
+    QString spillPath;
+    unique_ptr<QTemporaryFile> spillFile;
+};
+
+#endif // IMAGEHISTORY_H
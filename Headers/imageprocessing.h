@@ -1,18 +1,23 @@
 #ifndef IMAGEPROCESSING_H
 #define IMAGEPROCESSING_H
 
-#include <QMainWindow>
-#include <QLabel>
-#include <QScrollArea>
-#include <QDialog>
-#include <QFileDialog>
 #include <QImage>
 #include <QRgb>
 #include <QList>
 
+#include "Headers/simdkernels.h"
+#include "Headers/imageview.h"
+
+#include <atomic>
 #include <thread>
 #include <functional>
+#include <memory>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <numeric>
+#include <climits>
 
 using namespace std;
 /*
@@ -24,6 +29,55 @@ typedef struct HistogramValues
     int min;
 } histogramValues;
 */
+// Counts of every value of the 4 bytes of the pixels and of their luma
+struct ImageHistograms
+{
+    enum Channel
+    {
+        Red,
+        Green,
+        Blue,
+        Alpha,
+        Luma,
+        NbChannels
+    };
+
+    quint32 counts[NbChannels][256];
+};
+
+/*
+Cancellation and progress of the filters of an ImageProcessing, shared with the thread
+that runs them. Once cancelled, the bands not started yet are skipped and the filter
+returns early, leaving its destination partly written.
+*/
+class FilterControl
+{
+public:
+    FilterControl() : cancelled(false), lastPercent(-1) {}
+
+    void cancel() { cancelled = true; }
+    bool isCancelled() const { return cancelled.load(memory_order_relaxed); }
+
+    // Called by the threads of the filters with the percentage of the rows done by the
+    // current pass (a filter may read the image more than once), when it changes
+    function<void(int)> progress;
+
+    void reportRows(const int rowsDone, const int rowsTotal)
+    {
+        const int percent = rowsTotal > 0 ? (int)((qint64)rowsDone*100 / rowsTotal) : 100;
+        const int previous = lastPercent.exchange(percent);
+        if(percent != previous && progress)
+            progress(percent);
+    }
+
+private:
+    atomic<bool> cancelled;
+    atomic<int> lastPercent;
+};
+
+class ResultCache;
+class IntegralImage;
+
 class ImageProcessing
 {
 
@@ -37,34 +91,123 @@ private:
     void setAsCurrentImage(QImage *image);
 
 public:
+    /*
+    Every filter writes into a caller provided destination, whose buffer is kept when it
+    already has the size and format of the result: filtering frames of the same size into
+    the same QImage does not allocate. The source may be destination itself (in place).
+    Format_Grayscale8 images are processed with 1 byte per pixel and give Format_Grayscale8
+    results, 32 bits images with 4; the other formats are converted once on entry (see
+    ImageView::supportedFormat).
+    The versions taking raw pixels read rows aligned like the ones of a QImage of format,
+    the versions returning a new QImage are kept for convenience, the caller owns the result.
+    */
+    // Format_Grayscale8 result, or the format of the image with R = G = B when keepFormat is set
+    void convertToGrayScale(const QImage &image, QImage &destination, const bool keepFormat = false);
+    void convertToGrayScale(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination);
     QImage* convertToGrayScale(const  uchar* imageData, const int width, const int height, const QImage::Format format);
     // Blur
-    QImage* meanBlur(const  uchar* imageData, const int width, const int height, const QImage::Format format);
+    // Mean of the (2r+1)x(2r+1) window, from a summed-area table for large radii; null
+    // destination beyond IntegralImage::maxRadius
+    void meanBlur(const QImage &image, QImage &destination, const int kernelRadius = 1);
+    void meanBlur(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination, const int kernelRadius = 1);
+    QImage* meanBlur(const  uchar* imageData, const int width, const int height, const QImage::Format format, const int kernelRadius = 1);
+    void gaussianBlur3x3(const QImage &image, QImage &destination);
+    void gaussianBlur3x3(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination);
     QImage* gaussianBlur3x3(const  uchar* imageData, const int width, const int height, const QImage::Format format);
+    void gaussianBlur5x5(const QImage &image, QImage &destination);
+    void gaussianBlur5x5(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination);
     QImage* gaussianBlur5x5(const  uchar* imageData, const int width, const int height, const QImage::Format format);
-    QImage* medianFilter(const uchar* imageData, const int width, const int height, QImage::Format format);
+    static constexpr int minMedianRadius = 1;
+    static constexpr int maxMedianRadius = 50;
+    void medianFilter(const QImage &image, QImage &destination, const int kernelRadius = 1);
+    void medianFilter(const uchar* imageData, const int width, const int height, QImage::Format format, QImage &destination, const int kernelRadius = 1);
+    QImage* medianFilter(const uchar* imageData, const int width, const int height, QImage::Format format, const int kernelRadius = 1);
+    // Null destination beyond IntegralImage::maxRadius, like meanBlur
+    void localContrastNormalization(const QImage &image, QImage &destination, const int kernelRadius);
+    void localContrastNormalization(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination, const int kernelRadius);
+    QImage* localContrastNormalization(const uchar* imageData, const int width, const int height, const QImage::Format format, const int kernelRadius);
     // variation of intensity to maintain edges visible
+    void variationFilter(const QImage &image, QImage &destination);
+    void variationFilter(const uchar* imageData, const int width, const int height, QImage::Format format, QImage &destination);
     QImage* variationFilter(const uchar* imageData, const int width, const int height, QImage::Format format);
     // Histogram
+    // All the histograms of the image in a single pass, the raw pixels versions read 4 bytes per pixel
+    void computeHistograms(const QImage &image, ImageHistograms &histograms);
+    void computeHistograms(const uchar* imageData, const int width, const int height, ImageHistograms &histograms);
+    static void fillHistograms(const ImageView &image, const int rowStart, const int rowEnd, ImageHistograms &histograms);
+    // Adds the red histogram of the image to grayHistogram
+    void computeHistogram(const QImage &image, std::vector<float> *grayHistogram);
     void computeHistogram(const uchar* imageData, const int width, const int height, std::vector<float> *grayHistogram);
-    static void fillHistogram(const uchar* imageData, const int sectionStart,const int sectionEnd, std::vector< std::vector<float> *> * grayHistograms, const int threadId);
 
+    void cumulativeHistogram(const QImage &image, std::vector<float> *grayHistogram);
     void cumulativeHistogram(const uchar* imageData, const int width, const int height,std::vector<float> *grayHistogram);
     //Edge detection
-    QImage* gradientThreshold(const  uchar* imageData,const int width, const int height,const QImage::Format format);
-    QImage* gradientFilter(const  uchar* imageData,const int width, const int height,const QImage::Format format);
+    // Gradient binarized at the magnitude reached by percentageOfPixels of the pixels
+    void gradientThreshold(const QImage &image, QImage &destination, const float percentageOfPixels = 0.95f);
+    void gradientThreshold(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination,
+                           const float percentageOfPixels = 0.95f);
+    QImage* gradientThreshold(const  uchar* imageData,const int width, const int height,const QImage::Format format,
+                              const float percentageOfPixels = 0.95f);
+    // Same, as a Format_Grayscale8 mask of 0 and 255
+    void gradientThresholdMask(const QImage &image, QImage &destination, const float percentageOfPixels = 0.95f);
+    void gradientThresholdMask(const uchar* imageData, const int width, const int height, QImage &destination, const float percentageOfPixels = 0.95f);
+    QImage* gradientThresholdMask(const uchar* imageData, const int width, const int height, const float percentageOfPixels = 0.95f);
+    int gradientHistogramThreshold(const ImageView &source, const MutableImageView &destination, const float percentageOfPixels);
+    static int histogramThreshold(const quint32 histogram[], const qint64 nbPixels, const float percentageOfPixels);
+    // Sobel gradient magnitude of each color channel, optionally with the gradient orientation (Format_Grayscale8)
+    void gradientFilter(const QImage &image, QImage &destination, const SimdKernels::GradientMagnitude magnitude = SimdKernels::MagnitudeL2,
+                        QImage* orientation = nullptr);
+    void gradientFilter(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination,
+                        const SimdKernels::GradientMagnitude magnitude = SimdKernels::MagnitudeL2, QImage* orientation = nullptr);
+    QImage* gradientFilter(const  uchar* imageData,const int width, const int height,const QImage::Format format,
+                           const SimdKernels::GradientMagnitude magnitude = SimdKernels::MagnitudeL2, QImage* orientation = nullptr);
+    void horizontalSobelGradientFilter(const QImage &image, QImage &destination);
+    void horizontalSobelGradientFilter(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination);
     QImage* horizontalSobelGradientFilter(const  uchar* imageData, const int width, const int height, const QImage::Format format);
+    void verticalSobelGradientFilter(const QImage &image, QImage &destination);
+    void verticalSobelGradientFilter(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination);
     QImage* verticalSobelGradientFilter(const  uchar* imageData, const int width, const int height, const QImage::Format format);
-    QImage* applyFilter(const uchar *image, const int width, const int height, const QImage::Format format, const int kernelRadius, const int kernel[], const float kernelParameter,
-                                              QColor (*convolution)(const uchar *,const int, const int,
-                                                                   const int , const int[], const float ,const int ,
-                                                                   const int ,const int ));
-
-    static QColor applyConvolution(const uchar *image,const int width, const int height,
-                                                   const int kernelRadius, const int kernel[], const float kernelParameter,const int kernelWidth,
-                                                   const int x,const int y);
+    void applyFilter(const QImage &image, QImage &destination, const int kernelRadius, const int kernel[], const float kernelParameter);
+    void applyFilter(const uchar *image, const int width, const int height, const QImage::Format format, QImage &destination,
+                     const int kernelRadius, const int kernel[], const float kernelParameter);
+    QImage* applyFilter(const uchar *image, const int width, const int height, const QImage::Format format, const int kernelRadius, const int kernel[], const float kernelParameter);
+
+    void applySeparableFilter(const QImage &image, QImage &destination, const int kernelRadius,
+                              const int rowKernel[], const int columnKernel[], const float kernelParameter);
+    void applySeparableFilter(const uchar *image, const int width, const int height, const QImage::Format format, QImage &destination, const int kernelRadius,
+                              const int rowKernel[], const int columnKernel[], const float kernelParameter);
+    QImage* applySeparableFilter(const uchar *image, const int width, const int height, const QImage::Format format, const int kernelRadius,
+                                 const int rowKernel[], const int columnKernel[], const float kernelParameter);
+
+    static bool isSeparable(const int kernel[], const int kernelWidth, int rowKernel[], int columnKernel[]);
+    // Processing engines, they compute the rows [rowStart, rowEnd) of the destination, of the same size and channels as the source
+    static void applyConvolution(const ImageView &source, const MutableImageView &destination, const int kernelRadius,
+                                 const int kernel[], const float kernelParameter, const int rowStart, const int rowEnd);
+    static void applyMedian(const ImageView &source, const MutableImageView &destination, const int kernelRadius, const int rowStart, const int rowEnd);
+    static void applyGradient(const ImageView &source, const MutableImageView &destination, const SimdKernels::GradientMagnitude magnitude,
+                              uchar *orientation, const qsizetype orientationStride, const int rowStart, const int rowEnd);
+    // The destination may also have 1 channel for a 4 channels source
+    static void applyGradientHistogram(const ImageView &source, const MutableImageView &destination, const SimdKernels::GradientMagnitude magnitude,
+                                       quint32 histogram[], const int rowStart, const int rowEnd);
+    static void applySeparableConvolution(const ImageView &source, const MutableImageView &destination, const int kernelRadius,
+                                          const int rowKernel[], const int columnKernel[], const float kernelParameter,
+                                          const int rowStart, const int rowEnd);
+
+    // Number of threads used by the filters, 0 means all the threads of the shared pool
+    void setThreadCount(const int threadCount);
+    int threadCount() const;
+    // Cancellation and progress of the next filters, null for none. control must outlive them.
+    void setFilterControl(FilterControl* control);
+    // Histograms and summed-area tables of the images read by the next filters, kept by content, null for none. cache must outlive them.
+    void setResultCache(ResultCache* cache);
+    void forEachRowBand(const int height, const int halo, const function<void(int, int)>& rowFunction) const;
 private:
+    shared_ptr<const IntegralImage> integralImageOf(const QImage &image, const ImageView &source, const bool withSquares) const;
+
     QImage* currentImage;
+    int nbThreads;
+    FilterControl* filterControl;
+    ResultCache* resultCache;
 
 };
 #endif // IMAGEPROCESSING_H
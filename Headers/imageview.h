@@ -0,0 +1,107 @@
+#ifndef IMAGEVIEW_H
+#define IMAGEVIEW_H
+
+#include <QImage>
+#include <QtGlobal>
+
+/*
+Pixels of an image seen as height rows of width pixels of channels bytes, the rows
+being stride bytes apart. The filters work on 1 byte per pixel (Format_Grayscale8)
+and 4 bytes per pixel (32 bits formats, byte 3 being alpha); images of the other
+formats are converted once at the boundary, see ImageView::supportedFormat.
+*/
+struct ImageView
+{
+    const uchar* data;
+    int width;
+    int height;
+    qsizetype stride;
+    int channels;
+
+    ImageView()
+        : data(nullptr), width(0), height(0), stride(0), channels(0)
+    {
+    }
+
+    ImageView(const uchar* data, const int width, const int height, const qsizetype stride, const int channels)
+        : data(data), width(width), height(height), stride(stride), channels(channels)
+    {
+    }
+
+    // Image of a supported format
+    explicit ImageView(const QImage &image)
+        : data(image.constBits()), width(image.width()), height(image.height()), stride(image.bytesPerLine()),
+          channels(channelsOf(image.format()))
+    {
+    }
+
+    const uchar* row(const int y) const { return data + y*stride; }
+    qsizetype rowBytes() const { return (qsizetype)width*channels; }
+    bool isNull() const { return data == nullptr || width <= 0 || height <= 0; }
+
+    // Bytes per pixel of the formats processed directly, 0 for the others
+    static int channelsOf(const QImage::Format format)
+    {
+        switch(format)
+        {
+        case QImage::Format_Grayscale8:
+            return 1;
+        case QImage::Format_RGB32:
+        case QImage::Format_ARGB32:
+        case QImage::Format_ARGB32_Premultiplied:
+        case QImage::Format_RGBX8888:
+        case QImage::Format_RGBA8888:
+        case QImage::Format_RGBA8888_Premultiplied:
+            return 4;
+        default:
+            return 0;
+        }
+    }
+
+    // Format the images of format are converted to before processing
+    static QImage::Format supportedFormat(const QImage::Format format, const bool isGrayscale)
+    {
+        if(channelsOf(format) != 0)
+            return format;
+        return isGrayscale ? QImage::Format_Grayscale8 : QImage::Format_ARGB32;
+    }
+
+    // Rows aligned on 32 bits, like the images allocated by QImage
+    static qsizetype defaultStride(const int width, const int channels)
+    {
+        return ((qsizetype)width*channels + 3) / 4 * 4;
+    }
+};
+
+struct MutableImageView
+{
+    uchar* data;
+    int width;
+    int height;
+    qsizetype stride;
+    int channels;
+
+    MutableImageView()
+        : data(nullptr), width(0), height(0), stride(0), channels(0)
+    {
+    }
+
+    MutableImageView(uchar* data, const int width, const int height, const qsizetype stride, const int channels)
+        : data(data), width(width), height(height), stride(stride), channels(channels)
+    {
+    }
+
+    // Detaches the image
+    explicit MutableImageView(QImage &image)
+        : data(image.bits()), width(image.width()), height(image.height()), stride(image.bytesPerLine()),
+          channels(ImageView::channelsOf(image.format()))
+    {
+    }
+
+    uchar* row(const int y) const { return data + y*stride; }
+    qsizetype rowBytes() const { return (qsizetype)width*channels; }
+
+    operator ImageView() const { return ImageView(data, width, height, stride, channels); }
+};
+
+#endif // IMAGEVIEW_H
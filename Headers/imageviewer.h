@@ -1,12 +1,17 @@
 #ifndef IMAGEVIEWER_H
 #define IMAGEVIEWER_H
+#include "filterrunner.h"
+#include "imagecanvas.h"
+#include "imagehistory.h"
 #include "imageprocessing.h"
+#include "resultcache.h"
+#include "profiler.h"
 
 #include <QMainWindow>
 
 #include <QScrollBar>
-#include <QLabel>
 #include <QScrollArea>
+#include <QProgressBar>
 #include <QPrinter>
 #include <QBarSet>
 #include <QBarSeries>
@@ -39,18 +44,33 @@ private slots:
     void print();
     void copy();
     void paste();
+    void undo();
+    void redo();
+    void setHistoryBudget();
+    void setHistorySpill(const bool enable);
+    void setResultCacheBudget();
     void zoomIn();
     void zoomOut();
     void normalSize();
     void fitToWindow();
+    void setProfiling(const bool enable);
+    void saveTrace();
+    void cancelFilter();
+    void filterProgress(int percent);
+    void filterTileReady(const QRect &rect, const QImage &tile);
+    void updateVisibleRect();
+    void filterFinished(const QString &message, const QImage &result);
+    void filterCancelled();
     //
     void grayscale();
     // Blur
     void meanBlur();
+    void boxBlur();
     void gaussianBlur3x3();
     void gaussianBlur5x5();
     void medianFilter();
     void variationFilter();
+    void localContrastNormalization();
     // Histogram
     void showHistogram();
     void showCumulativeHistogram();
@@ -68,14 +88,28 @@ private:
     void updateActions();
     bool saveFile(const QString &fileName);
     void setImage(const QImage &newImage);
+    void replaceImage(const QImage &newImage);
+    void applyFilter(const QString &message, const QString &operation, const int halo, const FilterRunner::Filter &filter);
+    QRect visibleImageRect() const;
+    double displayScale() const;
+    QString profileMessage(const vector<Profiler::Event> &events) const;
     void scaleImage(double factor);
     void adjustScrollBar(QScrollBar *scrollBar, double factor);
 
     QImage image;
-    QLabel *imageLabel;
+    // Destination of the filters, reused from one filter to the next
+    QImage filteredImage;
+    ImageHistory history;
+    ImageCanvas *imageCanvas;
     QScrollArea *scrollArea;
     double scaleFactor;
     ImageProcessing *imageProcessor;
+    FilterRunner *filterRunner;
+    QProgressBar *progressBar;
+    // First profiling event of the filter running
+    int firstProfileEvent;
+    // The label shows tiles of a filter still running
+    bool tilesShown;
 
 #ifndef QT_NO_PRINTER
     QPrinter printer;
@@ -84,10 +118,16 @@ private:
     QAction *saveAsAct;
     QAction *printAct;
     QAction *copyAct;
+    QAction *undoAct;
+    QAction *redoAct;
     QAction *zoomInAct;
     QAction *zoomOutAct;
     QAction *normalSizeAct;
     QAction *fitToWindowAct;
+    QAction *profilingAct;
+    QAction *saveTraceAct;
+    QAction *cancelFilterAct;
+    QAction *progressiveAct;
     QMenu *filtersMenu;
     QMenu *imageMenu;
     QMenu *edgeDetectionMenu;
@@ -0,0 +1,65 @@
+#ifndef INTEGRALIMAGE_H
+#define INTEGRALIMAGE_H
+
+#include <QtGlobal>
+
+#include "Headers/imagebufferpool.h"
+#include "Headers/imageview.h"
+
+using namespace std;
+
+/*
+Summed-area table of the color channels of an image: the 3 first bytes of a 4 bytes per
+pixel image, or the single byte of a grayscale one.
+Entry (x, y) holds the sums of the pixels [0, x) x [0, y), the channels of an entry
+are interleaved and rows are stored one after the other, so a window sum reads 4
+entries. Sums are 64 bits and wrap around: a window sum is exact as long as it
+fits in 64 bits, which bounds the window size (maxRadius) far beyond the images.
+*/
+class IntegralImage
+{
+public:
+    // Maximum number of channels, see channelCount()
+    static constexpr int nbChannels = 3;
+    // (2r+1)^2 * 255^2 must fit in 64 bits
+    static constexpr int maxRadius = 1 << 23;
+
+    IntegralImage();
+
+    // Build the tables on the shared thread pool, squares are only needed for variances
+    void build(const ImageView &image, const bool withSquares, const int nbThreads);
+
+    int width() const;
+    int height() const;
+    int channelCount() const;
+    bool hasSquares() const;
+    // Memory of the tables
+    qint64 sizeInBytes() const;
+
+    // Sums of each channel over [x0, x1) x [y0, y1)
+    void sum(const int x0, const int y0, const int x1, const int y1, quint64 sums[nbChannels]) const;
+    void squareSum(const int x0, const int y0, const int x1, const int y1, quint64 sums[nbChannels]) const;
+
+    // Sums over the (2r+1) x (2r+1) window centered on (x, y), with the image borders
+    // replicated like the other filters do
+    void windowSum(const int x, const int y, const int radius, quint64 sums[nbChannels]) const;
+    void windowSquareSum(const int x, const int y, const int radius, quint64 sums[nbChannels]) const;
+
+    // Mean and variance of each channel over the same window
+    void windowStatistics(const int x, const int y, const int radius, float mean[nbChannels], float variance[nbChannels]) const;
+
+private:
+    void rectangleSum(const PooledBuffer<quint64>& table, const int x0, const int y0, const int x1, const int y1, quint64 sums[nbChannels]) const;
+    void clampedWindowSum(const PooledBuffer<quint64>& table, const int x, const int y, const int radius, quint64 sums[nbChannels]) const;
+    static void buildTable(const ImageView &image, const int channels, const bool squares,
+                           PooledBuffer<quint64>& table, const int nbThreads);
+
+    int tableWidth;
+    int tableHeight;
+    int tableChannels;
+    // Tables from the buffer pool, a new build of the same size reuses them
+    PooledBuffer<quint64> sums;
+    PooledBuffer<quint64> squareSums;
+};
+
+#endif // INTEGRALIMAGE_H
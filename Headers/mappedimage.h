@@ -0,0 +1,91 @@
+#ifndef MAPPEDIMAGE_H
+#define MAPPEDIMAGE_H
+
+#include <QFile>
+#include <QImage>
+#include <QString>
+#include <QVector>
+
+#include "Headers/imageview.h"
+
+#include <memory>
+
+using namespace std;
+
+/*
+Uncompressed image file used through a memory mapping: a 64 bytes header (dimensions,
+format, stride), the color table of the indexed and mono formats, then the rows, each one
+starting on a 64 bytes boundary.
+Opening a file neither decodes nor copies the pixels, the system pages them in as they
+are read. A file made by create() is written by writing its pixels, the filters can use
+its image() or mutableView() as destination.
+The header is in the byte order of the machine that wrote it.
+*/
+class MappedImage
+{
+public:
+    // Suffix of the files, without the dot
+    static const char* const suffix;
+
+    MappedImage();
+    ~MappedImage();
+    MappedImage(const MappedImage&) = delete;
+    MappedImage& operator=(const MappedImage&) = delete;
+
+    // True if the file starts with the header of a mapped image
+    static bool isMappedImage(const QString &path);
+
+    bool open(const QString &path, const bool writable = false);
+    // New file of width x height pixels of format, mapped for writing; up to 256 colors
+    bool create(const QString &path, const int width, const int height, const QImage::Format format,
+                const QVector<QRgb> &colorTable = QVector<QRgb>());
+    // The mapping stays valid as long as an image() made from it exists
+    void close();
+
+    // Image of the file opened, null image on failure
+    static QImage load(const QString &path, QString &errorMessage);
+    // One copy of the rows into a new mapped file, no encoding
+    static bool save(const QImage &image, const QString &path, QString &errorMessage);
+
+    bool isOpen() const { return mapping != nullptr; }
+    bool isWritable() const { return writable; }
+    int width() const { return imageWidth; }
+    int height() const { return imageHeight; }
+    QImage::Format format() const { return imageFormat; }
+    qsizetype stride() const { return imageStride; }
+    QVector<QRgb> colorTable() const { return colors; }
+    QString errorString() const { return error; }
+
+    /*
+    Image sharing the mapped pixels, which stay mapped until the image and all its copies
+    are destroyed. The image of a file opened read only is copied when modified, the one of
+    a writable file writes the file.
+    */
+    QImage image() const;
+    // Pixels of a format processed by the filters (see ImageView::channelsOf), null otherwise
+    ImageView view() const;
+    MutableImageView mutableView() const;
+
+private:
+    struct Mapping
+    {
+        QFile file;
+        uchar* address;
+
+        ~Mapping();
+    };
+
+    bool map(const qint64 size);
+
+    shared_ptr<Mapping> mapping;
+    uchar* pixels;
+    bool writable;
+    int imageWidth;
+    int imageHeight;
+    QImage::Format imageFormat;
+    qsizetype imageStride;
+    QVector<QRgb> colors;
+    QString error;
+};
+
+#endif // MAPPEDIMAGE_H
@@ -0,0 +1,138 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <QJsonDocument>
+#include <QString>
+#include <QtGlobal>
+
+#include <atomic>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/*
+Timers of the filters, pipeline stages, row bands, strips and file reads and writes.
+Profiling is off by default and a timer then only reads a flag. Once enabled, every timer
+records the wall time, the CPU time of its thread and the pixels it processed; the events
+are kept in memory, up to maxEvents, to be summed up or saved as a Chrome trace
+(chrome://tracing, ui.perfetto.dev). Building with IMAGEPROCESSING_NO_PROFILING removes
+the timers.
+*/
+class Profiler
+{
+public:
+    struct Event
+    {
+        // String literals
+        const char* category;
+        const char* name;
+        // Since the start of the process
+        qint64 startNanoseconds;
+        qint64 wallNanoseconds;
+        qint64 cpuNanoseconds;
+        // 0 when the timer does not count pixels (row bands)
+        qint64 pixels;
+        // Small number given to every thread in the order they record their first event
+        int thread;
+        // Wall time of the parts of the event (the stages of a pipeline band), when they run
+        // interleaved and are timed apart: an estimate of the split, without CPU time
+        vector<pair<const char*, qint64>> parts;
+    };
+
+    // All the events of one name
+    struct Entry
+    {
+        QString category;
+        QString name;
+        int count;
+        double wallSeconds;
+        double cpuSeconds;
+        qint64 pixels;
+        // Summed from the parts of events: the wall time is an estimate and there is no CPU time
+        bool estimated;
+
+        double megapixelsPerSecond() const { return wallSeconds > 0.0 ? pixels / wallSeconds * 1e-6 : 0.0; }
+    };
+
+    // A set of events taken as a whole, the outermost events of every thread only
+    struct Totals
+    {
+        double wallSeconds;
+        double cpuSeconds;
+        qint64 pixels;
+        int threads;
+        // Time the threads spent in events over threads * wallSeconds
+        double utilization;
+    };
+
+    class ScopedTimer
+    {
+    public:
+        ScopedTimer(const char* category, const char* name, const qint64 pixels = 0);
+        ~ScopedTimer();
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+
+    private:
+        const char* category;
+        const char* name;
+        qint64 pixels;
+        qint64 start;
+        qint64 cpuStart;
+        bool active;
+    };
+
+    static const int maxEvents = 1 << 18;
+
+    static Profiler& instance();
+
+    static bool isEnabled()
+    {
+#ifdef IMAGEPROCESSING_NO_PROFILING
+        return false;
+#else
+        return enabled.load(memory_order_relaxed);
+#endif
+    }
+    static void setEnabled(const bool enable);
+
+    static qint64 nanoseconds();
+    static qint64 threadCpuNanoseconds();
+    static int threadIndex();
+
+    void record(const Event &event);
+    void clear();
+    int eventCount() const;
+    // Events recorded once maxEvents were reached are dropped
+    int droppedCount() const;
+    // Events from the first one, in the order they ended
+    vector<Event> events(const int first = 0) const;
+
+    static vector<Entry> summary(const vector<Event> &events);
+    static Totals totals(const vector<Event> &events);
+    static QJsonDocument chromeTrace(const vector<Event> &events);
+    bool saveChromeTrace(const QString &path, QString &errorMessage) const;
+
+private:
+    Profiler();
+
+    static atomic<bool> enabled;
+
+    mutable mutex eventsMutex;
+    vector<Event> recorded;
+    int nbDropped;
+};
+
+#define PROFILE_CONCATENATE_(a, b) a##b
+#define PROFILE_CONCATENATE(a, b) PROFILE_CONCATENATE_(a, b)
+#ifdef IMAGEPROCESSING_NO_PROFILING
+#define PROFILE_SCOPE(category, name, pixels)
+#else
+// Times the rest of the enclosing block
+#define PROFILE_SCOPE(category, name, pixels) \
+    const Profiler::ScopedTimer PROFILE_CONCATENATE(profileScope, __LINE__)(category, name, pixels)
+#endif
+
+#endif // PROFILER_H
@@ -0,0 +1,103 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <QImage>
+#include <QString>
+#include <QtGlobal>
+
+#include "Headers/imageprocessing.h"
+#include "Headers/integralimage.h"
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+using namespace std;
+
+/*
+Results of the filters, and the data they derive from an image (histograms, summed-area
+tables), kept by the hash of the content of the image they read and by the operation, its
+name and parameters (e.g. "median 3"): filtering an image with the same pixels again, or
+asking for its histograms again, is a lookup.
+The hash of an image is remembered for its QImage::cacheKey(), which changes whenever its
+pixels are written through the QImage, so an unchanged image is only read once. Pixels
+written by other means while the QImage lives (raw pointers kept across calls) are not seen.
+Results are kept up to budget bytes, the least recently used dropped first. Histograms are
+small and kept apart, the last maxHistograms of them, so that large results never push
+them out. The functions can be called from any thread.
+*/
+class ResultCache
+{
+public:
+    // 128 bits hash of the size, format, color table and pixels of an image
+    struct Hash
+    {
+        quint64 low;
+        quint64 high;
+
+        bool operator==(const Hash &other) const { return low == other.low && high == other.high; }
+        bool operator<(const Hash &other) const { return high != other.high ? high < other.high : low < other.low; }
+    };
+
+    static constexpr qint64 defaultBudget = qint64(256)*1024*1024;
+    static constexpr int maxHistograms = 256;
+
+    explicit ResultCache(const qint64 budget = defaultBudget);
+    // Cache shared by the filters of the application
+    static ResultCache& instance();
+
+    // Hash of image, computed once per cacheKey
+    Hash contentHash(const QImage &image);
+    // Always reads the pixels, on the shared thread pool
+    static Hash hashImage(const QImage &image);
+
+    // Result of operation on an image of hash input, null when it is not kept
+    QImage image(const Hash &input, const QString &operation);
+    // A result larger than the whole budget is not kept
+    void insertImage(const Hash &input, const QString &operation, const QImage &result);
+    shared_ptr<const ImageHistograms> histograms(const Hash &input);
+    void insertHistograms(const Hash &input, const ImageHistograms &histograms);
+    // A table with the squares also stands for one without
+    shared_ptr<const IntegralImage> integralImage(const Hash &input, const bool withSquares);
+    void insertIntegralImage(const Hash &input, const shared_ptr<const IntegralImage> &integralImage);
+
+    void clear();
+    void setBudget(const qint64 budget);
+    qint64 budget() const;
+    // Bytes of the results and tables kept
+    qint64 memoryUsed() const;
+
+private:
+    typedef pair<Hash, QString> Key;
+
+    struct Entry
+    {
+        QImage image;
+        shared_ptr<const IntegralImage> integralImage;
+        shared_ptr<const ImageHistograms> histograms;
+        qint64 bytes;
+    };
+
+    // Entries by use, the most recent first
+    struct Lru
+    {
+        list<pair<Key, Entry>> entries;
+        map<Key, list<pair<Key, Entry>>::iterator> index;
+        qint64 bytes = 0;
+    };
+
+    static const Entry* find(Lru &lru, const Key &key);
+    static void insert(Lru &lru, const Key &key, const Entry &entry);
+    static void trim(Lru &lru, const qint64 maxBytes, const size_t maxEntries);
+
+    mutable mutex cacheMutex;
+    Lru results;
+    Lru histogramResults;
+    // Hashes of the last images seen, by cacheKey, and their keys the oldest first
+    map<qint64, Hash> hashes;
+    list<qint64> hashedKeys;
+    qint64 maxBytes;
+};
+
+#endif // RESULTCACHE_H
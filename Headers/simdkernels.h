@@ -0,0 +1,58 @@
+#ifndef SIMDKERNELS_H
+#define SIMDKERNELS_H
+
+#include <QtGlobal>
+
+/*
+Vectorized pixel kernels with runtime instruction set dispatch.
+Every kernel has a scalar version giving exactly the same results, the best
+version supported by the CPU is selected on first use.
+*/
+class SimdKernels
+{
+public:
+    enum InstructionSet
+    {
+        Scalar,
+        SSE2,
+        AVX2
+    };
+
+    // Luma weights in 1.14 fixed point (0.299, 0.587, 0.114), they sum to 1 << lumaShift
+    static constexpr int lumaShift = 14;
+    static constexpr int lumaWeight0 = 4899;
+    static constexpr int lumaWeight1 = 9617;
+    static constexpr int lumaWeight2 = 1868;
+
+    // Sobel gradient magnitude: exact sqrt(Gx^2 + Gy^2), |Gx| + |Gy|, or a square root table
+    enum GradientMagnitude
+    {
+        MagnitudeL2,
+        MagnitudeL1,
+        MagnitudeLut
+    };
+
+    static InstructionSet instructionSet();
+    // Force a (supported) instruction set, for testing and benchmarking
+    static void setInstructionSet(InstructionSet instructionSet);
+    static InstructionSet detectInstructionSet();
+
+    // 4 bytes per pixel: bytes 0..2 = luma of bytes 0..2, byte 3 (alpha) is copied
+    static void grayscale(const uchar* source, uchar* destination, const int pixelCount);
+    // 4 bytes per pixel to 1: luma of bytes 0..2
+    static void luma(const uchar* source, uchar* destination, const int pixelCount);
+
+    // Sobel gradient of one row of 4 or 1 bytes per pixel, every byte being a separate lane.
+    // above, row and below are padded rows starting one pixel before the image (see
+    // ImageProcessing::applyGradient). Color bytes get magnitude / 4 saturated to 255,
+    // alpha is opaque.
+    static void sobelRow(const uchar* above, const uchar* row, const uchar* below, uchar* destination, const int width,
+                         const GradientMagnitude magnitude, const int bytesPerPixel = 4);
+
+    static int luma(const uchar* pixel)
+    {
+        return (lumaWeight0 * pixel[0] + lumaWeight1 * pixel[1] + lumaWeight2 * pixel[2]) >> lumaShift;
+    }
+};
+
+#endif // SIMDKERNELS_H
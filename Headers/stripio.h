@@ -0,0 +1,156 @@
+#ifndef STRIPIO_H
+#define STRIPIO_H
+
+#include <QFile>
+#include <QImage>
+#include <QString>
+
+#include "Headers/imageview.h"
+#include "Headers/mappedimage.h"
+
+#include <limits>
+#include <memory>
+
+using namespace std;
+
+/*
+Reads an image a few rows at a time, for images too large to be loaded at once.
+Rows are given in a format processed directly by the filters (Format_Grayscale8 or a
+32 bits format, see ImageView::supportedFormat).
+*/
+class StripReader
+{
+public:
+    virtual ~StripReader() {}
+
+    // Reader of the file: mapped images are read in place, binary PGM / PPM files row by
+    // row, the other formats through QImageReader
+    static unique_ptr<StripReader> create(const QString &path);
+
+    virtual bool open(const QString &path) = 0;
+    // Bytes of decoded rows the reader may keep besides the strips, unlimited by default
+    void setMemoryBudget(const qint64 bytes) { budget = bytes; }
+    // Read the rows [y, y + rows.height) of the image into rows
+    virtual bool readRows(const int y, const MutableImageView &rows) = 0;
+    // Whole image when it can be read in place without copying the strips, null otherwise
+    virtual ImageView mappedView() const { return ImageView(); }
+
+    int width() const { return imageWidth; }
+    int height() const { return imageHeight; }
+    QImage::Format format() const { return imageFormat; }
+    QString errorString() const { return error; }
+
+protected:
+    StripReader() : imageWidth(0), imageHeight(0), imageFormat(QImage::Format_Invalid), budget(numeric_limits<qint64>::max()) {}
+
+    int imageWidth;
+    int imageHeight;
+    QImage::Format imageFormat;
+    qint64 budget;
+    QString error;
+};
+
+// Binary PGM (Format_Grayscale8 rows) and PPM (Format_RGB32 rows) with 8 bits samples
+class PnmStripReader : public StripReader
+{
+public:
+    bool open(const QString &path) override;
+    bool readRows(const int y, const MutableImageView &rows) override;
+
+private:
+    QFile file;
+    qint64 dataOffset;
+    int fileChannels;
+};
+
+/*
+Formats read by QImageReader, from the file kept open. When the format can read a part of
+the image (ClipRect), the rows are decoded by chunks as high as the memory budget allows:
+Qt has no sequential decoding and most formats decode the rows above the clip again, so
+the larger the chunks the fewer the decodes. The other formats (PNG, and TIFF with the
+usual plugins) are decoded whole, once, and fail when the image is over the budget.
+*/
+class QImageStripReader : public StripReader
+{
+public:
+    QImageStripReader() : clipRectSupported(false), decodedFirst(0) {}
+
+    bool open(const QString &path) override;
+    bool readRows(const int y, const MutableImageView &rows) override;
+
+private:
+    bool decode(const int y, const int rows);
+    bool overBudget(const qint64 bytes);
+
+    QFile file;
+    QByteArray fileFormat;
+    bool clipRectSupported;
+    // Rows [decodedFirst, decodedFirst + decoded.height()) of the image
+    QImage decoded;
+    int decodedFirst;
+};
+
+// Mapped images (see MappedImage), converted by strip when the format is not a supported one
+class MappedStripReader : public StripReader
+{
+public:
+    bool open(const QString &path) override;
+    bool readRows(const int y, const MutableImageView &rows) override;
+    ImageView mappedView() const override;
+
+private:
+    MappedImage file;
+};
+
+// Writes an image a few rows at a time, from the first row to the last
+class StripWriter
+{
+public:
+    virtual ~StripWriter() {}
+
+    // Mapped image for a path with the MappedImage suffix, binary PGM / PPM otherwise
+    static unique_ptr<StripWriter> create(const QString &path);
+
+    virtual bool open(const QString &path, const int width, const int height, const QImage::Format format) = 0;
+    // Rows following the ones already written
+    virtual bool writeRows(const ImageView &rows) = 0;
+    // Rows [y, y + height) of the file, to be written in place instead of calling writeRows,
+    // null view when the file can not be written in place
+    virtual MutableImageView mappedRows(const int, const int) { return MutableImageView(); }
+    virtual bool close() = 0;
+
+    QString errorString() const { return error; }
+
+protected:
+    QString error;
+};
+
+// Binary PGM for 1 byte per pixel images, binary PPM (alpha dropped) for the others
+class PnmStripWriter : public StripWriter
+{
+public:
+    bool open(const QString &path, const int width, const int height, const QImage::Format format) override;
+    bool writeRows(const ImageView &rows) override;
+    bool close() override;
+
+private:
+    QFile file;
+    QImage::Format imageFormat;
+};
+
+class MappedStripWriter : public StripWriter
+{
+public:
+    MappedStripWriter() : nextRow(0) {}
+
+    bool open(const QString &path, const int width, const int height, const QImage::Format format) override;
+    bool writeRows(const ImageView &rows) override;
+    MutableImageView mappedRows(const int y, const int height) override;
+    bool close() override;
+
+private:
+    MappedImage file;
+    int nextRow;
+};
+
+#endif // STRIPIO_H
@@ -0,0 +1,47 @@
+#ifndef STRIPPROCESSOR_H
+#define STRIPPROCESSOR_H
+
+#include <QSize>
+#include <QString>
+
+#include "Headers/filterpipeline.h"
+#include "Headers/stripio.h"
+
+/*
+Runs a FilterPipeline over an image larger than the memory, in horizontal strips: the
+source is read a strip at a time, the halo rows read by the pipeline above and below a
+strip are carried over from the previous strip instead of being read again, and every
+strip of the result is written as soon as it is computed. Strips are as high as the
+memory budget allows. A final percentile threshold needs the histogram of the whole
+result, the pipeline then runs twice: once to count it, once to write the result.
+*/
+class StripProcessor
+{
+public:
+    explicit StripProcessor(const FilterPipeline &pipeline);
+
+    // Bytes used by the source and result strips (the pipeline itself only keeps a few rows);
+    // a reader decoding with QImageReader may keep as many decoded rows besides
+    void setMemoryBudget(const qint64 bytes);
+    qint64 memoryBudget() const;
+    // Rows of the result per strip for an image of width pixels
+    int stripHeight(const int width, const QImage::Format sourceFormat) const;
+
+    // The result is written as a binary PGM or PPM file
+    bool process(const QString &inputPath, const QString &outputPath);
+    // reader and writer are open, writer for an image of format pipeline.resultFormat(reader.format())
+    bool process(StripReader &reader, StripWriter &writer);
+    QString errorString() const;
+    // Size of the last image processed
+    QSize imageSize() const;
+
+private:
+    bool runPass(StripReader &reader, StripWriter* writer, quint32 histogram[], const int threshold);
+
+    FilterPipeline pipeline;
+    qint64 budget;
+    QSize size;
+    QString error;
+};
+
+#endif // STRIPPROCESSOR_H
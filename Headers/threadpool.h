@@ -0,0 +1,79 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/*
+Persistent work-stealing thread pool.
+Every worker owns a deque: it pops its own tasks from the back and steals from the
+front of the other deques when it runs out of work. Tasks submitted from outside the
+pool go to a shared queue. A thread waiting for a group of tasks runs queued tasks
+instead of blocking, so tasks can themselves submit and wait for tasks (nested
+parallelism) without starving the pool.
+*/
+class ThreadPool
+{
+public:
+    // Counts the unfinished tasks of a parallelFor call
+    class TaskGroup
+    {
+    public:
+        TaskGroup() : pending(0) {}
+    private:
+        friend class ThreadPool;
+        atomic<int> pending;
+        mutex doneMutex;
+        condition_variable done;
+    };
+
+    explicit ThreadPool(const int nbWorkers);
+    ~ThreadPool();
+
+    // Process wide pool, one worker per core besides the calling thread
+    static ThreadPool& instance();
+
+    // Number of threads working on a parallelFor: the workers and the caller
+    int threadCount() const;
+
+    void submit(TaskGroup& group, const function<void()>& task);
+    void wait(TaskGroup& group);
+    // Run task(i) for i in [0, count) and return when they are all done
+    void parallelFor(const int count, const function<void(int)>& task);
+
+private:
+    struct Task
+    {
+        function<void()> run;
+        TaskGroup* group;
+    };
+
+    struct WorkQueue
+    {
+        mutex queueMutex;
+        deque<Task> tasks;
+    };
+
+    void workerLoop(const int workerIndex);
+    bool popTask(const int workerIndex, Task& task);
+    void runTask(Task& task);
+
+    vector<unique_ptr<WorkQueue>> workerQueues;
+    WorkQueue sharedQueue;
+    vector<thread> workers;
+
+    atomic<int> queuedTasks;
+    bool stopping;
+    mutex sleepMutex;
+    condition_variable workAvailable;
+};
+
+#endif // THREADPOOL_H
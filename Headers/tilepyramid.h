@@ -0,0 +1,105 @@
+#ifndef TILEPYRAMID_H
+#define TILEPYRAMID_H
+
+#include "Headers/imageview.h"
+
+#include <QImage>
+#include <QRect>
+#include <QSize>
+#include <QtGlobal>
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+/*
+Reduced copies of an image for display. Level k is the image reduced 2^k times, each of
+its pixels the mean of a 2^k x 2^k block, down to the first level that fits in one tile;
+level 0 is the image itself. The levels are cut in tiles of tileSize pixels, built when
+asked, in parallel, and kept in a cache of budget bytes: the least recently used tiles are
+dropped first and built again when needed. The budget should hold the tiles of a screen
+at least.
+*/
+class TilePyramid
+{
+public:
+    struct TileKey
+    {
+        int level;
+        // Column and row of the tile in its level
+        int x;
+        int y;
+
+        bool operator<(const TileKey &other) const
+        {
+            if(level != other.level)
+                return level < other.level;
+            if(y != other.y)
+                return y < other.y;
+            return x < other.x;
+        }
+    };
+
+    static const int tileSize = 256;
+    static constexpr qint64 defaultBudget = qint64(256)*1024*1024;
+
+    // image is converted when it is not of a format of ImageView
+    explicit TilePyramid(const QImage &image, const qint64 budget = defaultBudget);
+
+    const QImage& image() const;
+    int levelCount() const;
+    QSize levelSize(const int level) const;
+    // Level to show the image at scale: the most reduced one still at least as large as shown
+    int levelFor(const double scale) const;
+    // Tiles of level over rect, in pixels of the level
+    vector<TileKey> tilesIn(const int level, const QRect &rect) const;
+    // Pixels of the level covered by the tile
+    QRect tileRect(const TileKey &key) const;
+
+    /*
+    Tile of the cache, null when it is not built. The tiles of level 0 are views of the
+    image, they must not outlive the pyramid.
+    */
+    QImage tile(const TileKey &key);
+    bool isCached(const TileKey &key) const;
+    // Build the tiles of keys not in the cache, tiles and rows of tiles in parallel
+    void build(const vector<TileKey> &keys);
+
+    void setBudget(const qint64 budget);
+    qint64 cachedBytes() const;
+
+private:
+    // Tile being built: the mean of the factor x factor blocks of source from origin
+    struct Job
+    {
+        TileKey key;
+        QImage tile;
+        // Holds the pixels of source when they are not the image
+        QImage merged;
+        ImageView source;
+        MutableImageView destination;
+        int factor;
+        QPoint origin;
+    };
+
+    // Cached tile of a level above 0, made the most recently used
+    QImage cachedTile(const TileKey &key);
+    Job prepareJob(const TileKey &key);
+    static void reduceRows(const Job &job, const int rowStart, const int rowEnd);
+    void insert(const TileKey &key, const QImage &tile);
+
+    QImage sourceImage;
+    int nbLevels;
+
+    mutable mutex cacheMutex;
+    // Most recently used first
+    list<pair<TileKey, QImage>> recentTiles;
+    map<TileKey, list<pair<TileKey, QImage>>::iterator> cachedTiles;
+    qint64 nbCachedBytes;
+    qint64 maxBytes;
+};
+
+#endif // TILEPYRAMID_H
@@ -2,20 +2,28 @@ QT       += core gui printsupport
 
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets charts
 
-CONFIG += c++11
+CONFIG += c++17
 
 # You can make your code fail to compile if it uses deprecated APIs.
 # In order to do so, uncomment the following line.
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
+include(ImageProcessingCore.pri)
+
 SOURCES += \
+    Sources/filterrunner.cpp \
+    Sources/imagecanvas.cpp \
+    Sources/imagehistory.cpp \
     Sources/imageviewer.cpp \
     Sources/main.cpp \
-    Sources/imageprocessing.cpp
+    Sources/tilepyramid.cpp
 
 HEADERS += \
-    Headers/imageprocessing.h \
-    Headers/imageviewer.h
+    Headers/filterrunner.h \
+    Headers/imagecanvas.h \
+    Headers/imagehistory.h \
+    Headers/imageviewer.h \
+    Headers/tilepyramid.h
 
 FORMS += \
     Forms/imageprocessing.ui
@@ -0,0 +1,13 @@
+# Builds the viewer, the command line tool, the benchmark and the tests
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    viewer \
+    cli \
+    bench \
+    tests
+
+viewer.file = ImageProcessing.pro
+cli.file = ImageProcessingCli.pro
+bench.file = ImageProcessingBench.pro
+tests.file = ImageProcessingTests.pro
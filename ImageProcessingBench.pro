@@ -0,0 +1,17 @@
+# Benchmark of the filters on synthetic images, no widgets
+QT       += core gui
+QT       -= widgets
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+TARGET = imageprocessing-bench
+
+include(ImageProcessingCore.pri)
+
+SOURCES += \
+    Sources/benchmark.cpp \
+    Sources/benchmain.cpp
+
+HEADERS += \
+    Headers/benchmark.h
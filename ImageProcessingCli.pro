@@ -0,0 +1,22 @@
+# Command line batch processing, no widgets: runs on headless servers
+QT       += core gui
+QT       -= widgets
+
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+TARGET = imageprocessing-cli
+
+include(ImageProcessingCore.pri)
+
+SOURCES += \
+    Sources/batchprocessor.cpp \
+    Sources/climain.cpp
+
+HEADERS += \
+    Headers/batchprocessor.h
+
+# Default rules for deployment.
+qnx: target.path = /tmp/$${TARGET}/bin
+else: unix:!android: target.path = /opt/$${TARGET}/bin
+!isEmpty(target.path): INSTALLS += target
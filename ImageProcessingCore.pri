@@ -0,0 +1,35 @@
+# Filters shared by the viewer and the command line tool, they only need QtCore and QtGui
+
+CONFIG += c++17
+
+# Removes the profiling timers (see Headers/profiler.h)
+#DEFINES += IMAGEPROCESSING_NO_PROFILING
+
+INCLUDEPATH += $$PWD
+
+SOURCES += \
+    $$PWD/Sources/imageprocessing.cpp \
+    $$PWD/Sources/filterpipeline.cpp \
+    $$PWD/Sources/imagebufferpool.cpp \
+    $$PWD/Sources/integralimage.cpp \
+    $$PWD/Sources/mappedimage.cpp \
+    $$PWD/Sources/profiler.cpp \
+    $$PWD/Sources/resultcache.cpp \
+    $$PWD/Sources/simdkernels.cpp \
+    $$PWD/Sources/stripio.cpp \
+    $$PWD/Sources/stripprocessor.cpp \
+    $$PWD/Sources/threadpool.cpp
+
+HEADERS += \
+    $$PWD/Headers/filterpipeline.h \
+    $$PWD/Headers/imagebufferpool.h \
+    $$PWD/Headers/imageprocessing.h \
+    $$PWD/Headers/imageview.h \
+    $$PWD/Headers/integralimage.h \
+    $$PWD/Headers/mappedimage.h \
+    $$PWD/Headers/profiler.h \
+    $$PWD/Headers/resultcache.h \
+    $$PWD/Headers/simdkernels.h \
+    $$PWD/Headers/stripio.h \
+    $$PWD/Headers/stripprocessor.h \
+    $$PWD/Headers/threadpool.h
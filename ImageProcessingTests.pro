@@ -0,0 +1,17 @@
+# Differential test of the filters against their reference implementations, run by make check
+QT       += core gui
+QT       -= widgets
+
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+TARGET = imageprocessing-tests
+
+include(ImageProcessingCore.pri)
+
+SOURCES += \
+    Tests/referencefilters.cpp \
+    Tests/differentialtest.cpp
+
+HEADERS += \
+    Tests/referencefilters.h
@@ -0,0 +1,386 @@
+#include "Headers/batchprocessor.h"
+#include "Headers/imageprocessing.h"
+#include "Headers/integralimage.h"
+#include "Headers/mappedimage.h"
+#include "Headers/profiler.h"
+#include "Headers/stripprocessor.h"
+#include "Headers/threadpool.h"
+
+#include <QDir>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+BatchProcessor::BatchProcessor()
+    : recursive(false)
+    , nbParallelFiles(0)
+    , nbThreads(0)
+    , stripMemoryBudget(0)
+{
+}
+
+QString BatchProcessor::filterHelp()
+{
+    return QStringLiteral(
+        "  gray             1 byte per pixel grayscale\n"
+        "  mean[=r]         mean of the (2r+1)x(2r+1) window (r = 1)\n"
+        "  gauss3, gauss5   gaussian blur\n"
+        "  median[=r]       median of the (2r+1)x(2r+1) window (r = 1)\n"
+        "  lcn[=r]          local contrast normalization (r = 7)\n"
+        "  variation        variation filter\n"
+        "  sobel            Sobel gradient magnitude\n"
+        "  sobelx, sobely   horizontal and vertical Sobel filters\n"
+        "  threshold=v      values < v become 0, the others 255\n"
+        "  percentile[=p]   binarize at the value reached by p of the pixels (p = 0.95)\n");
+}
+
+bool BatchProcessor::setFilterChain(const QString &chain, QString &errorMessage)
+{
+    vector<Step> chainSteps;
+    // Streamed filters are added to the pipeline of the last step
+    auto pipeline = [&]() -> FilterPipeline&
+    {
+        if(chainSteps.empty() || chainSteps.back().type != Step::Pipeline)
+        {
+            Step step;
+            step.type = Step::Pipeline;
+            step.kernelRadius = 0;
+            chainSteps.push_back(step);
+        }
+        chainSteps.back().pipeline.setThreadCount(nbThreads);
+        return chainSteps.back().pipeline;
+    };
+    auto wholeImage = [&](const Step::Type type, const int kernelRadius)
+    {
+        Step step;
+        step.type = type;
+        step.kernelRadius = kernelRadius;
+        chainSteps.push_back(step);
+    };
+
+    const QStringList filters = chain.split(',', Qt::SkipEmptyParts);
+    if(filters.isEmpty())
+    {
+        errorMessage = QStringLiteral("empty filter chain");
+        return false;
+    }
+    for(const QString &filter : filters)
+    {
+        const QString name = filter.section('=', 0, 0).trimmed().toLower();
+        const QString value = filter.section('=', 1).trimmed();
+        bool valid = true;
+        const int radius = value.isEmpty() ? -1 : value.toInt(&valid);
+        if(!valid && name != "percentile")
+        {
+            errorMessage = QStringLiteral("invalid parameter of %1: %2").arg(name, value);
+            return false;
+        }
+        if((name == "mean" || name == "lcn") && radius > IntegralImage::maxRadius)
+        {
+            errorMessage = QStringLiteral("radius of %1 larger than %2: %3").arg(name).arg(IntegralImage::maxRadius).arg(value);
+            return false;
+        }
+
+        if(name == "gray")
+            pipeline().grayscale();
+        else if(name == "mean" && radius <= 2)
+            pipeline().meanBlur(max(radius, 1));
+        else if(name == "mean")
+            wholeImage(Step::MeanBlur, radius);
+        else if(name == "gauss3")
+            pipeline().gaussianBlur3x3();
+        else if(name == "gauss5")
+            pipeline().gaussianBlur5x5();
+        else if(name == "median")
+            wholeImage(Step::Median, radius < 0 ? 1 : radius);
+        else if(name == "lcn")
+            wholeImage(Step::LocalContrastNormalization, radius < 0 ? 7 : radius);
+        else if(name == "variation")
+            wholeImage(Step::Variation, 0);
+        else if(name == "sobel")
+            pipeline().gradient();
+        else if(name == "sobelx" || name == "sobely")
+        {
+            const int horizontal[9] ={-1,0,1,
+                                      -2,0,2,
+                                      -1,0,1};
+            const int vertical[9] ={-1,-2,-1,
+                                     0,0,0,
+                                     1,2,1};
+            pipeline().filter(1, name == "sobelx" ? horizontal : vertical, 4);
+        }
+        else if(name == "threshold")
+        {
+            if(radius < 0)
+            {
+                errorMessage = QStringLiteral("threshold needs a value");
+                return false;
+            }
+            pipeline().threshold(radius);
+        }
+        else if(name == "percentile")
+        {
+            const float percentage = value.isEmpty() ? 0.95f : value.toFloat(&valid);
+            if(!valid || percentage < 0.0f || percentage > 1.0f)
+            {
+                errorMessage = QStringLiteral("invalid percentage: %1").arg(value);
+                return false;
+            }
+            pipeline().percentileThreshold(percentage);
+            // Nothing can be streamed after the threshold, the next filters start a new step
+            wholeImage(Step::Pipeline, 0);
+        }
+        else
+        {
+            errorMessage = QStringLiteral("unknown filter: %1").arg(filter);
+            return false;
+        }
+    }
+
+    // Drop the empty pipelines left by the percentiles
+    chainSteps.erase(remove_if(chainSteps.begin(), chainSteps.end(), [](const Step &step)
+    {
+        return step.type == Step::Pipeline && step.pipeline.stageCount() == 0;
+    }), chainSteps.end());
+    steps = chainSteps;
+    return true;
+}
+
+void BatchProcessor::setOutputDirectory(const QString &directory)
+{
+    outputDirectory = directory;
+}
+
+void BatchProcessor::setOutputFormat(const QString &format)
+{
+    outputFormat = format.toLower();
+}
+
+void BatchProcessor::setRecursive(const bool recursive)
+{
+    this->recursive = recursive;
+}
+
+void BatchProcessor::setParallelFiles(const int parallelFiles)
+{
+    nbParallelFiles = max(parallelFiles, 0);
+}
+
+void BatchProcessor::setThreadCount(const int threadCount)
+{
+    nbThreads = max(threadCount, 0);
+    for(Step &step : steps)
+    {
+        step.pipeline.setThreadCount(nbThreads);
+    }
+}
+
+void BatchProcessor::setStripMemoryBudget(const qint64 bytes)
+{
+    stripMemoryBudget = max<qint64>(bytes, 0);
+}
+
+bool BatchProcessor::canProcessInStrips() const
+{
+    return steps.size() == 1 && steps.front().type == Step::Pipeline;
+}
+
+vector<BatchProcessor::InputFile> BatchProcessor::collectFiles(const QStringList &inputs, const function<void(const QString&)> &reportError) const
+{
+    QStringList nameFilters;
+    for(const QByteArray &format : QImageReader::supportedImageFormats())
+    {
+        nameFilters << "*." + QString::fromLatin1(format);
+    }
+    nameFilters << "*." + QString::fromLatin1(MappedImage::suffix);
+
+    vector<InputFile> files;
+    for(const QString &input : inputs)
+    {
+        const QFileInfo info(input);
+        if(info.isFile())
+        {
+            files.push_back({input, info.fileName()});
+        }
+        else if(info.isDir())
+        {
+            const QDir directory(input);
+            QDirIterator it(input, nameFilters, QDir::Files, recursive ? QDirIterator::Subdirectories : QDirIterator::NoIteratorFlags);
+            while(it.hasNext())
+            {
+                const QString path = it.next();
+                files.push_back({path, directory.relativeFilePath(path)});
+            }
+        }
+        else
+        {
+            reportError(QStringLiteral("%1: no such file or directory").arg(input));
+        }
+    }
+    return files;
+}
+
+// The result is left in image, buffer is the destination of the steps
+void BatchProcessor::applySteps(QImage &image, QImage &buffer) const
+{
+    ImageProcessing processing;
+    processing.setThreadCount(nbThreads);
+    for(const Step &step : steps)
+    {
+        switch(step.type)
+        {
+        case Step::Pipeline:
+            step.pipeline.run(image, buffer);
+            break;
+        case Step::MeanBlur:
+            processing.meanBlur(image, buffer, step.kernelRadius);
+            break;
+        case Step::Median:
+            processing.medianFilter(image, buffer, step.kernelRadius);
+            break;
+        case Step::LocalContrastNormalization:
+            processing.localContrastNormalization(image, buffer, step.kernelRadius);
+            break;
+        case Step::Variation:
+            processing.variationFilter(image, buffer);
+            break;
+        }
+        image.swap(buffer);
+    }
+}
+
+/*
+Every worker takes the next file of the list until there is none left, so slow files do
+not hold the others back. The filters of a file run their row bands on the same pool.
+*/
+BatchProcessor::Statistics BatchProcessor::run(const QStringList &inputs, const function<void(const QString&)> &reportError) const
+{
+    QElapsedTimer elapsed;
+    elapsed.start();
+
+    mutex reportMutex;
+    auto report = [&](const QString &message)
+    {
+        lock_guard<mutex> lock(reportMutex);
+        reportError(message);
+    };
+
+    const vector<InputFile> files = collectFiles(inputs, report);
+    Statistics statistics = {};
+    atomic<int> nextFile(0);
+    const int nbWorkers = min<int>(nbParallelFiles > 0 ? nbParallelFiles : ThreadPool::instance().threadCount(), files.size());
+
+    ThreadPool::instance().parallelFor(nbWorkers, [&](const int)
+    {
+        Statistics workerStatistics = {};
+        QImage image;
+        QImage buffer;
+        QElapsedTimer timer;
+        for(int i = nextFile++; i < (int)files.size(); i = nextFile++)
+        {
+            const InputFile &file = files[i];
+
+            if(stripMemoryBudget > 0)
+            {
+                // Reading, filtering and writing are interleaved, it all counts as filter time
+                timer.start();
+                const QString suffix = outputFormat == QLatin1String(MappedImage::suffix) ? outputFormat : QStringLiteral("pnm");
+                QString outputPath = QDir(outputDirectory).filePath(file.outputPath);
+                outputPath = QFileInfo(outputPath).path() + "/" + QFileInfo(outputPath).completeBaseName() + "." + suffix;
+                QDir().mkpath(QFileInfo(outputPath).path());
+                StripProcessor stripProcessor(steps.front().pipeline);
+                stripProcessor.setMemoryBudget(stripMemoryBudget);
+                if(!stripProcessor.process(file.path, outputPath))
+                {
+                    report(stripProcessor.errorString());
+                    workerStatistics.nbFailed++;
+                    continue;
+                }
+                workerStatistics.filterSeconds += timer.nsecsElapsed() * 1e-9;
+                workerStatistics.bytesRead += QFileInfo(file.path).size();
+                workerStatistics.nbImages++;
+                workerStatistics.nbPixels += (qint64)stripProcessor.imageSize().width()*stripProcessor.imageSize().height();
+                continue;
+            }
+
+            timer.start();
+            QString errorMessage;
+            bool loaded;
+            {
+                PROFILE_SCOPE("io", "load", 0);
+                if(MappedImage::isMappedImage(file.path))
+                {
+                    image = MappedImage::load(file.path, errorMessage);
+                    loaded = !image.isNull();
+                }
+                else
+                {
+                    QImageReader reader(file.path);
+                    loaded = reader.read(&image);
+                    errorMessage = reader.errorString();
+                }
+            }
+            if(!loaded)
+            {
+                report(QStringLiteral("%1: %2").arg(file.path, errorMessage));
+                workerStatistics.nbFailed++;
+                continue;
+            }
+            workerStatistics.loadSeconds += timer.nsecsElapsed() * 1e-9;
+            workerStatistics.bytesRead += QFileInfo(file.path).size();
+
+            timer.start();
+            applySteps(image, buffer);
+            workerStatistics.filterSeconds += timer.nsecsElapsed() * 1e-9;
+
+            timer.start();
+            QString outputPath = QDir(outputDirectory).filePath(file.outputPath);
+            if(!outputFormat.isEmpty())
+                outputPath = QFileInfo(outputPath).path() + "/" + QFileInfo(outputPath).completeBaseName() + "." + outputFormat;
+            QDir().mkpath(QFileInfo(outputPath).path());
+            bool saved;
+            {
+                PROFILE_SCOPE("io", "save", (qint64)image.width()*image.height());
+                if(QFileInfo(outputPath).suffix() == QLatin1String(MappedImage::suffix))
+                {
+                    saved = MappedImage::save(image, outputPath, errorMessage);
+                }
+                else
+                {
+                    QImageWriter writer(outputPath);
+                    saved = writer.write(image);
+                    errorMessage = writer.errorString();
+                }
+            }
+            if(!saved)
+            {
+                report(QStringLiteral("%1: %2").arg(outputPath, errorMessage));
+                workerStatistics.nbFailed++;
+                continue;
+            }
+            workerStatistics.saveSeconds += timer.nsecsElapsed() * 1e-9;
+
+            workerStatistics.nbImages++;
+            workerStatistics.nbPixels += (qint64)image.width()*image.height();
+        }
+
+        lock_guard<mutex> lock(reportMutex);
+        statistics.nbImages += workerStatistics.nbImages;
+        statistics.nbFailed += workerStatistics.nbFailed;
+        statistics.nbPixels += workerStatistics.nbPixels;
+        statistics.bytesRead += workerStatistics.bytesRead;
+        statistics.loadSeconds += workerStatistics.loadSeconds;
+        statistics.filterSeconds += workerStatistics.filterSeconds;
+        statistics.saveSeconds += workerStatistics.saveSeconds;
+    });
+
+    statistics.elapsedSeconds = elapsed.nsecsElapsed() * 1e-9;
+    return statistics;
+}
@@ -0,0 +1,134 @@
+#include "Headers/benchmark.h"
+
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QFile>
+
+#include <cstdio>
+
+// Comma separated integers, false if one of them is not a positive integer (or 0 when allowZero)
+static bool parseIntegers(const QString &text, const bool allowZero, vector<int> &values)
+{
+    values.clear();
+    for(const QString &item : text.split(',', Qt::SkipEmptyParts))
+    {
+        bool ok;
+        const int value = item.toInt(&ok);
+        if(!ok || value < (allowZero ? 0 : 1))
+            return false;
+        values.push_back(value);
+    }
+    return !values.empty();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("imageprocessing-bench");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Time the image processing filters on synthetic images.\n\nKernels: "
+                                     + Benchmark::kernelNames().join(", "));
+    parser.addHelpOption();
+    const QCommandLineOption sizesOption({"s", "sizes"}, "Comma separated sizes of the square images, 256 to 8192 by default.", "sizes");
+    const QCommandLineOption formatsOption({"f", "formats"}, "Comma separated formats among gray8, argb32, rgb32, rgba8888, rgb888; "
+                                           "gray8,argb32,rgb888 by default.", "formats");
+    const QCommandLineOption threadsOption({"t", "threads"}, "Comma separated thread counts, 0 for all the threads; 1,0 by default.", "counts");
+    const QCommandLineOption kernelsOption({"k", "kernels"}, "Only the kernels whose name contains one of these comma separated words.", "words");
+    const QCommandLineOption timeOption("min-time", "Minimum time of a measure in seconds, 0.2 by default.", "seconds", "0.2");
+    const QCommandLineOption jsonOption("json", "Write the results to this JSON file.", "file");
+    const QCommandLineOption baselineOption({"b", "baseline"}, "Compare the results with this JSON file of a previous run.", "file");
+    const QCommandLineOption toleranceOption("tolerance", "Slowdown, in percent, above which a result is a regression; 10 by default.", "percent", "10");
+    parser.addOptions({sizesOption, formatsOption, threadsOption, kernelsOption, timeOption, jsonOption, baselineOption, toleranceOption});
+    parser.process(a);
+
+    Benchmark benchmark;
+    vector<int> values;
+    if(parser.isSet(sizesOption))
+    {
+        if(!parseIntegers(parser.value(sizesOption), false, values))
+        {
+            fprintf(stderr, "Invalid sizes %s\n", qPrintable(parser.value(sizesOption)));
+            return 1;
+        }
+        benchmark.setSizes(values);
+    }
+    if(parser.isSet(threadsOption))
+    {
+        if(!parseIntegers(parser.value(threadsOption), true, values))
+        {
+            fprintf(stderr, "Invalid thread counts %s\n", qPrintable(parser.value(threadsOption)));
+            return 1;
+        }
+        benchmark.setThreadCounts(values);
+    }
+    if(parser.isSet(formatsOption))
+    {
+        vector<QImage::Format> formats;
+        for(const QString &name : parser.value(formatsOption).split(',', Qt::SkipEmptyParts))
+        {
+            const QImage::Format format = Benchmark::formatFromName(name);
+            if(format == QImage::Format_Invalid)
+            {
+                fprintf(stderr, "Unknown format %s\n", qPrintable(name));
+                return 1;
+            }
+            formats.push_back(format);
+        }
+        benchmark.setFormats(formats);
+    }
+    if(parser.isSet(kernelsOption))
+        benchmark.setKernelFilters(parser.value(kernelsOption).split(',', Qt::SkipEmptyParts));
+    benchmark.setMinimumSeconds(parser.value(timeOption).toDouble());
+
+    // Read the baseline first, not to find out it is missing after the whole run
+    vector<Benchmark::Result> baseline;
+    if(parser.isSet(baselineOption))
+    {
+        QFile file(parser.value(baselineOption));
+        QString errorMessage;
+        if(!file.open(QIODevice::ReadOnly))
+        {
+            fprintf(stderr, "%s: %s\n", qPrintable(file.fileName()), qPrintable(file.errorString()));
+            return 1;
+        }
+        if(!Benchmark::fromJson(QJsonDocument::fromJson(file.readAll()), baseline, errorMessage))
+        {
+            fprintf(stderr, "%s: %s\n", qPrintable(file.fileName()), qPrintable(errorMessage));
+            return 1;
+        }
+    }
+
+    printf("%-24s %-9s %11s %7s %11s %11s %10s\n", "kernel", "format", "size", "threads", "median ms", "Mpixels/s", "GB/s");
+    const vector<Benchmark::Result> results = benchmark.run([](const Benchmark::Result &result)
+    {
+        printf("%-24s %-9s %5dx%-5d %7d %11.3f %11.1f %10.2f\n", qPrintable(result.kernel), qPrintable(result.format),
+               result.width, result.height, result.threads, result.seconds * 1e3, result.megapixelsPerSecond(),
+               result.bytesPerSecond() * 1e-9);
+        fflush(stdout);
+    });
+
+    if(parser.isSet(jsonOption))
+    {
+        QFile file(parser.value(jsonOption));
+        if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(Benchmark::toJson(results).toJson()) < 0)
+        {
+            fprintf(stderr, "%s: %s\n", qPrintable(file.fileName()), qPrintable(file.errorString()));
+            return 1;
+        }
+    }
+
+    if(parser.isSet(baselineOption))
+    {
+        printf("\nCompared with %s:\n", qPrintable(parser.value(baselineOption)));
+        const int nbRegressions = Benchmark::compare(results, baseline, parser.value(toleranceOption).toDouble() / 100.0, [](const QString &line)
+        {
+            printf("%s\n", qPrintable(line));
+        });
+        printf("%d regression(s)\n", nbRegressions);
+        // Scripts can stop on regressions
+        return nbRegressions == 0 ? 0 : 3;
+    }
+    return 0;
+}
@@ -0,0 +1,337 @@
+#include "Headers/benchmark.h"
+#include "Headers/filterpipeline.h"
+#include "Headers/imageprocessing.h"
+
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QSysInfo>
+#include <QThread>
+
+#include <algorithm>
+#include <map>
+
+QString Benchmark::Result::key() const
+{
+    return QStringLiteral("%1 %2 %3x%4 t%5").arg(kernel, format).arg(width).arg(height).arg(threads);
+}
+
+Benchmark::Benchmark()
+    : sizes{256, 512, 1024, 2048, 4096, 8192}
+    , formats{QImage::Format_Grayscale8, QImage::Format_ARGB32, QImage::Format_RGB888}
+    , threadCounts{1, 0}
+    , minimumSeconds(0.2)
+{
+}
+
+void Benchmark::setSizes(const vector<int> &sizes)
+{
+    this->sizes = sizes;
+}
+
+void Benchmark::setFormats(const vector<QImage::Format> &formats)
+{
+    this->formats = formats;
+}
+
+void Benchmark::setThreadCounts(const vector<int> &threadCounts)
+{
+    this->threadCounts = threadCounts;
+}
+
+void Benchmark::setKernelFilters(const QStringList &filters)
+{
+    kernelFilters = filters;
+}
+
+void Benchmark::setMinimumSeconds(const double seconds)
+{
+    minimumSeconds = max(seconds, 0.0);
+}
+
+static const struct
+{
+    QImage::Format format;
+    const char* name;
+}
+formatNames[] =
+{
+    {QImage::Format_Grayscale8, "gray8"},
+    {QImage::Format_ARGB32, "argb32"},
+    {QImage::Format_RGB32, "rgb32"},
+    {QImage::Format_RGBA8888, "rgba8888"},
+    {QImage::Format_RGB888, "rgb888"}
+};
+
+QString Benchmark::formatName(const QImage::Format format)
+{
+    for(const auto &entry : formatNames)
+    {
+        if(entry.format == format)
+            return QString::fromLatin1(entry.name);
+    }
+    return QString::number(format);
+}
+
+QImage::Format Benchmark::formatFromName(const QString &name)
+{
+    for(const auto &entry : formatNames)
+    {
+        if(name == QLatin1String(entry.name))
+            return entry.format;
+    }
+    return QImage::Format_Invalid;
+}
+
+/*
+Every public filter of ImageProcessing, through its QImage overload (the raw pointer
+overloads only wrap the data), plus a FilterPipeline chain. Filters with a radius are
+timed with a small and a large one, which take different paths.
+*/
+vector<Benchmark::Kernel> Benchmark::kernels()
+{
+    static const int sharpen[9] = { 0, -1,  0,
+                                   -1,  5, -1,
+                                    0, -1,  0};
+    static const int laplacian5x5[25] = {0,  0, -1,  0,  0,
+                                         0, -1, -2, -1,  0,
+                                        -1, -2, 17, -2, -1,
+                                         0, -1, -2, -1,  0,
+                                         0,  0, -1,  0,  0};
+    static const int binomial7[7] = {1, 6, 15, 20, 15, 6, 1};
+
+    return
+    {
+        {"grayscale", [](ImageProcessing &p, const QImage &s, QImage &d) { p.convertToGrayScale(s, d); }, false},
+        {"mean_r1", [](ImageProcessing &p, const QImage &s, QImage &d) { p.meanBlur(s, d, 1); }, false},
+        {"mean_r8", [](ImageProcessing &p, const QImage &s, QImage &d) { p.meanBlur(s, d, 8); }, false},
+        {"gauss3x3", [](ImageProcessing &p, const QImage &s, QImage &d) { p.gaussianBlur3x3(s, d); }, false},
+        {"gauss5x5", [](ImageProcessing &p, const QImage &s, QImage &d) { p.gaussianBlur5x5(s, d); }, false},
+        {"median_r1", [](ImageProcessing &p, const QImage &s, QImage &d) { p.medianFilter(s, d, 1); }, false},
+        {"median_r3", [](ImageProcessing &p, const QImage &s, QImage &d) { p.medianFilter(s, d, 3); }, false},
+        {"lcn_r8", [](ImageProcessing &p, const QImage &s, QImage &d) { p.localContrastNormalization(s, d, 8); }, false},
+        {"variation", [](ImageProcessing &p, const QImage &s, QImage &d) { p.variationFilter(s, d); }, false},
+        {"histograms", [](ImageProcessing &p, const QImage &s, QImage &)
+         {
+             ImageHistograms histograms;
+             p.computeHistograms(s, histograms);
+         }, true},
+        {"histogram", [](ImageProcessing &p, const QImage &s, QImage &)
+         {
+             vector<float> histogram(256, 0.0f);
+             p.computeHistogram(s, &histogram);
+         }, true},
+        {"cumulative_histogram", [](ImageProcessing &p, const QImage &s, QImage &)
+         {
+             vector<float> histogram(256, 0.0f);
+             p.cumulativeHistogram(s, &histogram);
+         }, true},
+        {"gradient_threshold", [](ImageProcessing &p, const QImage &s, QImage &d) { p.gradientThreshold(s, d); }, false},
+        {"gradient_threshold_mask", [](ImageProcessing &p, const QImage &s, QImage &d) { p.gradientThresholdMask(s, d); }, false},
+        {"gradient_l2", [](ImageProcessing &p, const QImage &s, QImage &d) { p.gradientFilter(s, d); }, false},
+        {"gradient_l1", [](ImageProcessing &p, const QImage &s, QImage &d) { p.gradientFilter(s, d, SimdKernels::MagnitudeL1); }, false},
+        {"sobel_x", [](ImageProcessing &p, const QImage &s, QImage &d) { p.horizontalSobelGradientFilter(s, d); }, false},
+        {"sobel_y", [](ImageProcessing &p, const QImage &s, QImage &d) { p.verticalSobelGradientFilter(s, d); }, false},
+        {"filter_3x3", [](ImageProcessing &p, const QImage &s, QImage &d) { p.applyFilter(s, d, 1, sharpen, 1.0f); }, false},
+        {"filter_5x5", [](ImageProcessing &p, const QImage &s, QImage &d) { p.applyFilter(s, d, 2, laplacian5x5, 1.0f); }, false},
+        {"separable_7x7", [](ImageProcessing &p, const QImage &s, QImage &d) { p.applySeparableFilter(s, d, 3, binomial7, binomial7, 4096.0f); }, false},
+        {"pipeline_edges", [](ImageProcessing &p, const QImage &s, QImage &d)
+         {
+             FilterPipeline pipeline;
+             pipeline.grayscale().gaussianBlur3x3().gradient().percentileThreshold(0.95f);
+             pipeline.setThreadCount(p.threadCount());
+             pipeline.run(s, d);
+         }, false}
+    };
+}
+
+QStringList Benchmark::kernelNames()
+{
+    QStringList names;
+    for(const Kernel &kernel : kernels())
+    {
+        names << kernel.name;
+    }
+    return names;
+}
+
+// Smooth shapes with some noise, so that the data dependent filters (median) see realistic values
+QImage Benchmark::syntheticImage(const int size, const QImage::Format format)
+{
+    QImage image(size, size, QImage::Format_ARGB32);
+    quint32 random = 0x12345678;
+    for(int y=0; y<size; y++)
+    {
+        QRgb* line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for(int x=0; x<size; x++)
+        {
+            random = random*1664525u + 1013904223u;
+            const int noise = (int)(random >> 27) - 16;
+            const int r = (x*255/size + noise) & 0xff;
+            const int g = (y*255/size - noise) & 0xff;
+            const int b = ((x ^ y) & 0x40 ? 200 : 40) + noise;
+            line[x] = qRgba(r, g, qBound(0, b, 255), 255);
+        }
+    }
+    return image.convertToFormat(format);
+}
+
+Benchmark::Result Benchmark::measure(const Kernel &kernel, const QImage &image, const int threads) const
+{
+    ImageProcessing processing;
+    processing.setThreadCount(threads);
+    QImage destination;
+    // The first run allocates the destination and warms the caches
+    kernel.run(processing, image, destination);
+
+    vector<double> times;
+    double total = 0.0;
+    QElapsedTimer timer;
+    while(times.size() < 3 || total < minimumSeconds)
+    {
+        timer.start();
+        kernel.run(processing, image, destination);
+        const double seconds = max(timer.nsecsElapsed() * 1e-9, 1e-9);
+        times.push_back(seconds);
+        total += seconds;
+    }
+    sort(times.begin(), times.end());
+
+    Result result;
+    result.kernel = kernel.name;
+    result.format = formatName(image.format());
+    result.width = image.width();
+    result.height = image.height();
+    result.threads = processing.threadCount();
+    result.iterations = (int)times.size();
+    result.seconds = times[times.size()/2];
+    result.fastestSeconds = times.front();
+    result.bytes = image.sizeInBytes() + (kernel.readOnly ? 0 : destination.sizeInBytes());
+    return result;
+}
+
+vector<Benchmark::Result> Benchmark::run(const function<void(const Result&)> &progress) const
+{
+    vector<Kernel> selected;
+    for(const Kernel &kernel : kernels())
+    {
+        bool match = kernelFilters.isEmpty();
+        for(const QString &filter : kernelFilters)
+        {
+            match = match || kernel.name.contains(filter);
+        }
+        if(match)
+            selected.push_back(kernel);
+    }
+
+    vector<Result> results;
+    for(const int size : sizes)
+    {
+        for(const QImage::Format format : formats)
+        {
+            const QImage image = syntheticImage(size, format);
+            for(const Kernel &kernel : selected)
+            {
+                for(const int threads : threadCounts)
+                {
+                    results.push_back(measure(kernel, image, threads));
+                    progress(results.back());
+                }
+            }
+        }
+    }
+    return results;
+}
+
+QJsonDocument Benchmark::toJson(const vector<Result> &results)
+{
+    QJsonArray array;
+    for(const Result &result : results)
+    {
+        QJsonObject object;
+        object["kernel"] = result.kernel;
+        object["format"] = result.format;
+        object["width"] = result.width;
+        object["height"] = result.height;
+        object["threads"] = result.threads;
+        object["iterations"] = result.iterations;
+        object["seconds"] = result.seconds;
+        object["fastest_seconds"] = result.fastestSeconds;
+        object["bytes"] = (double)result.bytes;
+        object["megapixels_per_second"] = result.megapixelsPerSecond();
+        object["bytes_per_second"] = result.bytesPerSecond();
+        array.append(object);
+    }
+
+    QJsonObject machine;
+    machine["cpu"] = QSysInfo::currentCpuArchitecture();
+    machine["os"] = QSysInfo::prettyProductName();
+    machine["ideal_threads"] = QThread::idealThreadCount();
+    QJsonObject root;
+    root["machine"] = machine;
+    root["results"] = array;
+    return QJsonDocument(root);
+}
+
+bool Benchmark::fromJson(const QJsonDocument &document, vector<Result> &results, QString &errorMessage)
+{
+    if(!document.isObject() || !document.object().value("results").isArray())
+    {
+        errorMessage = QStringLiteral("not a benchmark result file");
+        return false;
+    }
+    results.clear();
+    const QJsonArray array = document.object().value("results").toArray();
+    for(const QJsonValue &value : array)
+    {
+        const QJsonObject object = value.toObject();
+        Result result;
+        result.kernel = object["kernel"].toString();
+        result.format = object["format"].toString();
+        result.width = object["width"].toInt();
+        result.height = object["height"].toInt();
+        result.threads = object["threads"].toInt();
+        result.iterations = object["iterations"].toInt();
+        result.seconds = object["seconds"].toDouble();
+        result.fastestSeconds = object["fastest_seconds"].toDouble();
+        result.bytes = (qint64)object["bytes"].toDouble();
+        if(result.kernel.isEmpty() || result.seconds <= 0.0)
+        {
+            errorMessage = QStringLiteral("invalid result %1").arg(results.size());
+            return false;
+        }
+        results.push_back(result);
+    }
+    return true;
+}
+
+int Benchmark::compare(const vector<Result> &results, const vector<Result> &baseline, const double tolerance,
+                       const function<void(const QString&)> &report)
+{
+    map<QString, const Result*> baselineResults;
+    for(const Result &result : baseline)
+    {
+        baselineResults[result.key()] = &result;
+    }
+
+    int nbRegressions = 0;
+    for(const Result &result : results)
+    {
+        const auto found = baselineResults.find(result.key());
+        if(found == baselineResults.end())
+            continue;
+        // Above 1 when slower than the baseline
+        const double ratio = result.seconds / found->second->seconds;
+        const bool regression = ratio > 1.0 + tolerance;
+        nbRegressions += regression ? 1 : 0;
+        const QString sign = ratio >= 1.0 ? QStringLiteral("+") : QString();
+        report(QStringLiteral("%1  %2 ms -> %3 ms  %4%5%")
+               .arg(result.key(), -40)
+               .arg(found->second->seconds * 1e3, 0, 'f', 3)
+               .arg(result.seconds * 1e3, 0, 'f', 3)
+               .arg(sign)
+               .arg((ratio - 1.0) * 100.0, 0, 'f', 1)
+               + (regression ? QStringLiteral("  REGRESSION") : QString()));
+    }
+    return nbRegressions;
+}
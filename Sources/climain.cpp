@@ -0,0 +1,105 @@
+#include "Headers/batchprocessor.h"
+#include "Headers/profiler.h"
+
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+
+#include <algorithm>
+#include <cstdio>
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("imageprocessing-cli");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Apply a chain of filters to image files.\n\nFilters:\n" + BatchProcessor::filterHelp());
+    parser.addHelpOption();
+    const QCommandLineOption filtersOption({"f", "filters"}, "Comma separated filter chain, e.g. gray,gauss3,sobel,percentile=0.95.", "chain");
+    const QCommandLineOption outputOption({"o", "output"}, "Directory of the results.", "directory");
+    const QCommandLineOption formatOption("format", "Format of the results (png, jpg, ipraw for uncompressed mapped files, ...), the one of the input by default.", "format");
+    const QCommandLineOption recursiveOption({"r", "recursive"}, "Look for images in the subdirectories of the input directories.");
+    const QCommandLineOption jobsOption({"j", "jobs"}, "Images processed at once, one per thread by default.", "count", "0");
+    const QCommandLineOption threadsOption({"t", "threads"}, "Threads used by the filters of one image, all by default.", "count", "0");
+    const QCommandLineOption stripsOption({"s", "strips"}, "Process the images in strips, with at most this memory per image. "
+                                          "Only streamed filters (no median, lcn, variation, mean with r > 2), results written as PGM / PPM.", "MB");
+    const QCommandLineOption profileOption("profile", "Print the time spent in every filter, pipeline stage, strip and file read or write.");
+    const QCommandLineOption traceOption("trace", "Save the timers as a Chrome trace (chrome://tracing, ui.perfetto.dev).", "file");
+    parser.addOptions({filtersOption, outputOption, formatOption, recursiveOption, jobsOption, threadsOption, stripsOption,
+                       profileOption, traceOption});
+    parser.addPositionalArgument("inputs", "Image files or directories.", "inputs...");
+    parser.process(a);
+
+    if(!parser.isSet(filtersOption) || !parser.isSet(outputOption) || parser.positionalArguments().isEmpty())
+    {
+        fprintf(stderr, "%s\n", qPrintable(parser.helpText()));
+        return 1;
+    }
+
+    BatchProcessor processor;
+    QString errorMessage;
+    if(!processor.setFilterChain(parser.value(filtersOption), errorMessage))
+    {
+        fprintf(stderr, "%s\n", qPrintable(errorMessage));
+        return 1;
+    }
+    processor.setOutputDirectory(parser.value(outputOption));
+    processor.setOutputFormat(parser.value(formatOption));
+    processor.setRecursive(parser.isSet(recursiveOption));
+    processor.setParallelFiles(parser.value(jobsOption).toInt());
+    processor.setThreadCount(parser.value(threadsOption).toInt());
+    if(parser.isSet(stripsOption))
+    {
+        if(!processor.canProcessInStrips())
+        {
+            fprintf(stderr, "This filter chain can not be processed in strips\n");
+            return 1;
+        }
+        processor.setStripMemoryBudget(max<qint64>(parser.value(stripsOption).toLongLong(), 1) * 1024 * 1024);
+    }
+
+    Profiler::setEnabled(parser.isSet(profileOption) || parser.isSet(traceOption));
+
+    const BatchProcessor::Statistics statistics = processor.run(parser.positionalArguments(), [](const QString &message)
+    {
+        fprintf(stderr, "%s\n", qPrintable(message));
+    });
+
+    const double seconds = max(statistics.elapsedSeconds, 1e-9);
+    const double threadSeconds = max(statistics.loadSeconds + statistics.filterSeconds + statistics.saveSeconds, 1e-9);
+    printf("%d images processed, %d failed, in %.2f s\n", statistics.nbImages, statistics.nbFailed, statistics.elapsedSeconds);
+    printf("%.1f images/s, %.1f Mpixels/s, %.1f MB/s read\n", statistics.nbImages / seconds, statistics.nbPixels / seconds * 1e-6,
+           statistics.bytesRead / seconds * 1e-6);
+    printf("thread time: load %.0f%%, filters %.0f%%, save %.0f%%\n", 100.0 * statistics.loadSeconds / threadSeconds,
+           100.0 * statistics.filterSeconds / threadSeconds, 100.0 * statistics.saveSeconds / threadSeconds);
+
+    if(parser.isSet(profileOption))
+    {
+        const vector<Profiler::Event> events = Profiler::instance().events();
+        const Profiler::Totals totals = Profiler::totals(events);
+        printf("\n%-8s %-30s %8s %12s %12s %10s\n", "category", "timer", "count", "wall ms", "cpu ms", "Mpixels/s");
+        for(const Profiler::Entry &entry : Profiler::summary(events))
+        {
+            // The stages of a pipeline are timed apart within its bands: estimated wall time, no CPU time
+            if(entry.estimated)
+                printf("%-8s %-30s %8d %12.2f %12s %10.1f\n", qPrintable(entry.category), qPrintable(entry.name + " (estimate)"),
+                       entry.count, entry.wallSeconds * 1e3, "-", entry.megapixelsPerSecond());
+            else
+                printf("%-8s %-30s %8d %12.2f %12.2f %10.1f\n", qPrintable(entry.category), qPrintable(entry.name), entry.count,
+                       entry.wallSeconds * 1e3, entry.cpuSeconds * 1e3, entry.megapixelsPerSecond());
+        }
+        printf("%d threads, %.0f%% busy", totals.threads, 100.0 * totals.utilization);
+        if(Profiler::instance().droppedCount() > 0)
+            printf(", %d events dropped", Profiler::instance().droppedCount());
+        printf("\n");
+    }
+    if(parser.isSet(traceOption))
+    {
+        QString traceError;
+        if(!Profiler::instance().saveChromeTrace(parser.value(traceOption), traceError))
+            fprintf(stderr, "%s: %s\n", qPrintable(parser.value(traceOption)), qPrintable(traceError));
+    }
+
+    return statistics.nbFailed == 0 ? 0 : 2;
+}
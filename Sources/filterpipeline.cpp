@@ -0,0 +1,582 @@
+#include "Headers/filterpipeline.h"
+#include "Headers/imagebufferpool.h"
+#include "Headers/imageprocessing.h"
+#include "Headers/profiler.h"
+#include "Headers/threadpool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+/*
+Rows of one stage of a band: the source rows followed by its point operations, or a
+neighborhood operation followed by its point operations.
+The rows read by the next stage are kept in a ring of 2r+1 rows, r being the radius of
+the next stage, padded with r replicated pixels on each side so that the next stage
+never has to clamp x.
+When profiling, a stage adds up the time it spends on its own rows (not the ones of its
+input), its point operations included.
+*/
+class FilterPipeline::RowStream
+{
+public:
+    // source holds the rows [sourceRow, sourceRow + source.height) of an image of height rows
+    RowStream(const ImageView &source, const int sourceRow, const int height)
+        : source(source), sourceRow(sourceRow), input(nullptr), neighborhood(nullptr),
+          width(source.width), height(height), channels(source.channels),
+          padding(0), ringSize(0), lastRow(-1), timed(false), nanoseconds(0)
+    {
+    }
+
+    RowStream(RowStream* input, const Stage* neighborhood)
+        : sourceRow(0), input(input), neighborhood(neighborhood),
+          width(input->width), height(input->height), channels(input->channels),
+          padding(0), ringSize(0), lastRow(-1), timed(false), nanoseconds(0)
+    {
+        input->padding = neighborhood->kernelRadius;
+        input->ringSize = 2*neighborhood->kernelRadius + 1;
+    }
+
+    void addPointStage(const Stage* stage)
+    {
+        pointStages.push_back(stage);
+        if(stage->type == Stage::Grayscale)
+            channels = 1;
+    }
+
+    int radius() const
+    {
+        return neighborhood != nullptr ? neighborhood->kernelRadius : 0;
+    }
+
+    // Name of the first stage, null for the source rows alone
+    const char* name() const
+    {
+        if(neighborhood != nullptr)
+            return stageName(neighborhood->type);
+        return pointStages.empty() ? nullptr : stageName(pointStages.front()->type);
+    }
+
+    void setTimed(const bool enable)
+    {
+        timed = enable;
+        nanoseconds = 0;
+    }
+
+    qint64 elapsedNanoseconds() const
+    {
+        return nanoseconds;
+    }
+
+    // Allocate the buffers, the first row produced will be firstRow
+    void start(const int firstRow)
+    {
+        const int inputChannels = input != nullptr ? input->channels : source.channels;
+        const int r = radius();
+        lastRow = firstRow - 1;
+        rows.resize(2*r + 1);
+        rowA.resize(width*4);
+        rowB.resize(width*4);
+        if(neighborhood != nullptr && neighborhood->type != Stage::Gradient)
+        {
+            accumulator.resize(width*inputChannels);
+            if(neighborhood->type == Stage::SeparableConvolution)
+                columnSums.resize((width + 2*r)*inputChannels);
+        }
+        if(ringSize > 0)
+            ring.resize(ringSize*paddedRowBytes());
+    }
+
+    // Padded row y, produced and still in the ring, starting padding pixels before the image
+    const uchar* row(const int y) const
+    {
+        return ring.data() + (y % ringSize)*paddedRowBytes();
+    }
+
+    void advanceTo(const int y)
+    {
+        while(lastRow < y)
+        {
+            lastRow++;
+            storePadded(produce(lastRow), ring.data() + (lastRow % ringSize)*paddedRowBytes());
+        }
+    }
+
+    // Row y of the last stage, written straight to the destination
+    void writeRow(const int y, uchar* destinationRow)
+    {
+        memcpy(destinationRow, produce(y), width*channels);
+    }
+
+private:
+    qsizetype paddedRowBytes() const
+    {
+        return (qsizetype)(width + 2*padding)*channels;
+    }
+
+    static const char* stageName(const Stage::Type type)
+    {
+        switch(type)
+        {
+        case Stage::Grayscale:
+            return "grayscale";
+        case Stage::Threshold:
+            return "threshold";
+        case Stage::Convolution:
+            return "convolution";
+        case Stage::SeparableConvolution:
+            return "separable convolution";
+        default:
+            return "gradient";
+        }
+    }
+
+    // Row y of the stage, unpadded
+    const uchar* produce(const int y)
+    {
+        const uchar* values;
+        int valueChannels;
+        qint64 start = 0;
+        if(neighborhood == nullptr)
+        {
+            if(timed)
+                start = Profiler::nanoseconds();
+            values = source.row(y - sourceRow);
+            valueChannels = source.channels;
+        }
+        else
+        {
+            const int r = neighborhood->kernelRadius;
+            input->advanceTo(min(y + r, height-1));
+            if(timed)
+                start = Profiler::nanoseconds();
+            for(int k=0; k<=2*r; k++)
+            {
+                rows[k] = input->row(min(max(y - r + k, 0), height-1));
+            }
+            valueChannels = input->channels;
+            applyNeighborhood(valueChannels, rowA.data());
+            values = rowA.data();
+        }
+
+        for(const Stage* stage : pointStages)
+        {
+            uchar* result = values == rowA.data() ? rowB.data() : rowA.data();
+            if(stage->type == Stage::Grayscale)
+            {
+                if(valueChannels == 1)
+                    continue;
+                SimdKernels::luma(values, result, width);
+                valueChannels = 1;
+            }
+            else
+            {
+                applyThreshold(values, valueChannels, stage->thresholdValue, result);
+            }
+            values = result;
+        }
+        if(timed)
+            nanoseconds += Profiler::nanoseconds() - start;
+        return values;
+    }
+
+    void applyNeighborhood(const int inputChannels, uchar* destinationRow)
+    {
+        const int r = neighborhood->kernelRadius;
+        const int kernelWidth = 2*r + 1;
+        const int rowBytes = width*inputChannels;
+
+        if(neighborhood->type == Stage::Gradient)
+        {
+            SimdKernels::sobelRow(rows[0], rows[1], rows[2], destinationRow, width, neighborhood->magnitude, inputChannels);
+            return;
+        }
+
+        int* acc = accumulator.data();
+        std::fill(acc, acc + rowBytes, 0);
+        if(neighborhood->type == Stage::SeparableConvolution)
+        {
+            // Vertical pass over the padded rows, then horizontal pass: same sums as the other order
+            const int paddedBytes = (width + 2*r)*inputChannels;
+            int* sums = columnSums.data();
+            std::fill(sums, sums + paddedBytes, 0);
+            for(int ky=0; ky<kernelWidth; ky++)
+            {
+                const int h = neighborhood->columnKernel[ky];
+                if(h == 0)
+                    continue;
+                const uchar* tap = rows[ky];
+                for(int i=0; i<paddedBytes; i++)
+                {
+                    sums[i] += h * tap[i];
+                }
+            }
+            for(int kx=0; kx<kernelWidth; kx++)
+            {
+                const int h = neighborhood->rowKernel[kx];
+                if(h == 0)
+                    continue;
+                const int* tap = sums + kx*inputChannels;
+                for(int i=0; i<rowBytes; i++)
+                {
+                    acc[i] += h * tap[i];
+                }
+            }
+        }
+        else
+        {
+            for(int ky=0; ky<kernelWidth; ky++)
+            {
+                for(int kx=0; kx<kernelWidth; kx++)
+                {
+                    const int h = neighborhood->kernel[kx + ky*kernelWidth];
+                    if(h == 0)
+                        continue;
+                    const uchar* tap = rows[ky] + kx*inputChannels;
+                    for(int i=0; i<rowBytes; i++)
+                    {
+                        acc[i] += h * tap[i];
+                    }
+                }
+            }
+        }
+
+        // |sum| / kernelParameter saturated to 255, alpha is opaque
+        const float kernelParameter = neighborhood->kernelParameter;
+        for(int i=0; i<rowBytes; i++)
+        {
+            destinationRow[i] = fminf(abs(acc[i]) / kernelParameter, 255.0f);
+        }
+        if(inputChannels == 4)
+        {
+            for(int i=3; i<rowBytes; i+=4)
+            {
+                destinationRow[i] = 255;
+            }
+        }
+    }
+
+    void applyThreshold(const uchar* values, const int valueChannels, const int threshold, uchar* result) const
+    {
+        const int rowBytes = width*valueChannels;
+        for(int i=0; i<rowBytes; i++)
+        {
+            result[i] = values[i] < threshold ? 0 : 255;
+        }
+        if(valueChannels == 4)
+        {
+            for(int i=3; i<rowBytes; i+=4)
+            {
+                result[i] = 255;
+            }
+        }
+    }
+
+    void storePadded(const uchar* values, uchar* paddedRow) const
+    {
+        const int rowBytes = width*channels;
+        for(int x=0; x<padding; x++)
+        {
+            memcpy(paddedRow + x*channels, values, channels);
+            memcpy(paddedRow + (padding + width + x)*channels, values + rowBytes - channels, channels);
+        }
+        memcpy(paddedRow + padding*channels, values, rowBytes);
+    }
+
+    ImageView source;
+    int sourceRow;
+    RowStream* input;
+    const Stage* neighborhood;
+    vector<const Stage*> pointStages;
+    int width;
+    int height;
+    // Channels of the rows produced
+    int channels;
+    // Radius of the next stage, and rows it reads (0 for the last stage)
+    int padding;
+    int ringSize;
+    int lastRow;
+    bool timed;
+    qint64 nanoseconds;
+
+    PooledBuffer<uchar> ring;
+    PooledBuffer<uchar> rowA;
+    PooledBuffer<uchar> rowB;
+    PooledBuffer<int> accumulator;
+    PooledBuffer<int> columnSums;
+    vector<const uchar*> rows;
+};
+
+FilterPipeline::FilterPipeline()
+    : thresholdPercentage(-1.0f)
+    , nbThreads(0)
+{
+}
+
+FilterPipeline& FilterPipeline::addStage(const Stage &stage)
+{
+    stages.push_back(stage);
+    return *this;
+}
+
+FilterPipeline& FilterPipeline::grayscale()
+{
+    Stage stage = {};
+    stage.type = Stage::Grayscale;
+    return addStage(stage);
+}
+
+FilterPipeline& FilterPipeline::threshold(const int value)
+{
+    Stage stage = {};
+    stage.type = Stage::Threshold;
+    stage.thresholdValue = value;
+    return addStage(stage);
+}
+
+FilterPipeline& FilterPipeline::meanBlur(const int kernelRadius)
+{
+    const int radius = max(kernelRadius, 1);
+    const vector<int> kernel(2*radius + 1, 1);
+    return separableFilter(radius, kernel.data(), kernel.data(), (2*radius+1)*(2*radius+1));
+}
+
+FilterPipeline& FilterPipeline::gaussianBlur3x3()
+{
+    const int kernel[3] ={1,2,1};
+    return separableFilter(1, kernel, kernel, 16.0f);
+}
+
+FilterPipeline& FilterPipeline::gaussianBlur5x5()
+{
+    const int kernel[5] ={1,4,6,4,1};
+    return separableFilter(2, kernel, kernel, 246.0f);
+}
+
+FilterPipeline& FilterPipeline::filter(const int kernelRadius, const int kernel[], const float kernelParameter)
+{
+    const int kernelWidth = 2*kernelRadius + 1;
+    vector<int> rowKernel(kernelWidth);
+    vector<int> columnKernel(kernelWidth);
+    if(ImageProcessing::isSeparable(kernel, kernelWidth, rowKernel.data(), columnKernel.data()))
+    {
+        return separableFilter(kernelRadius, rowKernel.data(), columnKernel.data(), kernelParameter);
+    }
+
+    Stage stage = {};
+    stage.type = Stage::Convolution;
+    stage.kernelRadius = kernelRadius;
+    stage.kernel.assign(kernel, kernel + kernelWidth*kernelWidth);
+    stage.kernelParameter = kernelParameter;
+    return addStage(stage);
+}
+
+FilterPipeline& FilterPipeline::separableFilter(const int kernelRadius, const int rowKernel[], const int columnKernel[], const float kernelParameter)
+{
+    const int kernelWidth = 2*kernelRadius + 1;
+    Stage stage = {};
+    stage.type = Stage::SeparableConvolution;
+    stage.kernelRadius = kernelRadius;
+    stage.rowKernel.assign(rowKernel, rowKernel + kernelWidth);
+    stage.columnKernel.assign(columnKernel, columnKernel + kernelWidth);
+    stage.kernelParameter = kernelParameter;
+    return addStage(stage);
+}
+
+FilterPipeline& FilterPipeline::gradient(const SimdKernels::GradientMagnitude magnitude)
+{
+    Stage stage = {};
+    stage.type = Stage::Gradient;
+    stage.kernelRadius = 1;
+    stage.magnitude = magnitude;
+    return addStage(stage);
+}
+
+FilterPipeline& FilterPipeline::percentileThreshold(const float percentageOfPixels)
+{
+    thresholdPercentage = percentageOfPixels;
+    return *this;
+}
+
+int FilterPipeline::stageCount() const
+{
+    return (int)stages.size() + (thresholdPercentage >= 0.0f ? 1 : 0);
+}
+
+int FilterPipeline::halo() const
+{
+    int rows = 0;
+    for(const Stage &stage : stages)
+    {
+        rows += stage.kernelRadius;
+    }
+    return rows;
+}
+
+void FilterPipeline::setThreadCount(const int threadCount)
+{
+    nbThreads = max(threadCount, 0);
+}
+
+int FilterPipeline::threadCount() const
+{
+    return nbThreads > 0 ? nbThreads : ThreadPool::instance().threadCount();
+}
+
+/*
+Compute the rows [rowStart, rowEnd) of the result, see runRows. Every stage starts as many
+rows above rowStart as the stages after it read above their rows, so the bands give the
+same result as a single one.
+The stages of a band run interleaved row by row: when profiling, the band gets a single
+event with its measured wall and CPU times, and the sums of the times of each stage as its
+parts. The split is an estimate: the stages are timed apart, without their CPU time.
+*/
+void FilterPipeline::runBand(const ImageView &source, const int sourceRow, const int imageHeight, const MutableImageView &destination,
+                             const int destinationStart, const int rowStart, const int rowEnd, quint32 histogram[]) const
+{
+    vector<RowStream> streams;
+    streams.reserve(stages.size() + 1);
+    streams.emplace_back(source, sourceRow, imageHeight);
+    for(const Stage &stage : stages)
+    {
+        if(stage.type == Stage::Grayscale || stage.type == Stage::Threshold)
+            streams.back().addPointStage(&stage);
+        else
+            streams.emplace_back(&streams.back(), &stage);
+    }
+
+    const bool timed = Profiler::isEnabled();
+    const qint64 bandStart = timed ? Profiler::nanoseconds() : 0;
+    const qint64 cpuStart = timed ? Profiler::threadCpuNanoseconds() : 0;
+    int firstRow = rowStart;
+    for(int s=(int)streams.size()-1; s>=0; s--)
+    {
+        streams[s].start(firstRow);
+        streams[s].setTimed(timed);
+        firstRow = max(firstRow - streams[s].radius(), 0);
+    }
+
+    RowStream &last = streams.back();
+    for(int y=rowStart; y<rowEnd; y++)
+    {
+        uchar* destinationRow = destination.row(y - destinationStart);
+        last.writeRow(y, destinationRow);
+        if(histogram != nullptr)
+        {
+            for(int x=0; x<destination.width; x++)
+            {
+                histogram[destinationRow[destination.channels*x]]++;
+            }
+        }
+    }
+
+    if(!timed)
+        return;
+    Profiler::Event event{"pipeline", "band", bandStart, Profiler::nanoseconds() - bandStart, Profiler::threadCpuNanoseconds() - cpuStart,
+                          (qint64)(rowEnd - rowStart)*destination.width, Profiler::threadIndex(), {}};
+    for(const RowStream &stream : streams)
+    {
+        if(stream.name() != nullptr)
+            event.parts.push_back({stream.name(), stream.elapsedNanoseconds()});
+    }
+    Profiler::instance().record(event);
+}
+
+QImage::Format FilterPipeline::resultFormat(const QImage::Format format) const
+{
+    for(const Stage &stage : stages)
+    {
+        if(stage.type == Stage::Grayscale)
+            return QImage::Format_Grayscale8;
+    }
+    return format;
+}
+
+bool FilterPipeline::hasPercentileThreshold() const
+{
+    return thresholdPercentage >= 0.0f;
+}
+
+int FilterPipeline::percentileThresholdValue(const quint32 histogram[], const qint64 nbPixels) const
+{
+    return ImageProcessing::histogramThreshold(histogram, nbPixels, thresholdPercentage);
+}
+
+void FilterPipeline::runRows(const ImageView &source, const int sourceRow, const int imageHeight, const MutableImageView &destination,
+                             const int rowStart, const int rowEnd, quint32 histogram[]) const
+{
+    ImageProcessing processing;
+    processing.setThreadCount(threadCount());
+    mutex histogramMutex;
+    processing.forEachRowBand(rowEnd - rowStart, halo(), [&](const int bandStart, const int bandEnd)
+    {
+        quint32 bandHistogram[256] = {};
+        runBand(source, sourceRow, imageHeight, destination, rowStart, rowStart + bandStart, rowStart + bandEnd,
+                histogram != nullptr ? bandHistogram : nullptr);
+        if(histogram == nullptr)
+            return;
+        lock_guard<mutex> lock(histogramMutex);
+        for(int j=0; j<256; j++)
+        {
+            histogram[j] += bandHistogram[j];
+        }
+    });
+}
+
+void FilterPipeline::binarize(const MutableImageView &image, const int threshold) const
+{
+    ImageProcessing processing;
+    processing.setThreadCount(threadCount());
+    processing.forEachRowBand(image.height, 0, [&](const int rowStart, const int rowEnd)
+    {
+        for(int y=rowStart; y<rowEnd; y++)
+        {
+            uchar* row = image.row(y);
+            if(image.channels == 1)
+            {
+                for(int x=0; x<image.width; x++)
+                {
+                    row[x] = row[x] < threshold ? 0 : 255;
+                }
+                continue;
+            }
+            for(int i=0; i<image.width*4; i+=4)
+            {
+                const uchar value = row[i] < threshold ? 0 : 255;
+                row[i] = value;
+                row[i+1] = value;
+                row[i+2] = value;
+                row[i+3] = 255;
+            }
+        }
+    });
+}
+
+void FilterPipeline::run(const QImage &image, QImage &destination) const
+{
+    PROFILE_SCOPE("filter", "pipeline", (qint64)image.width()*image.height());
+    // Held by value: destination may be image itself and be reallocated to another format
+    QImage input = image;
+    if(ImageView::channelsOf(input.format()) == 0)
+    {
+        input = image.convertToFormat(ImageView::supportedFormat(image.format(), image.isGrayscale()));
+    }
+    const ImageView source(input);
+
+    const QImage::Format format = resultFormat(input.format());
+    if(destination.size() != input.size() || destination.format() != format)
+    {
+        destination = ImageBufferPool::instance().image(source.width, source.height, format);
+    }
+    // A destination sharing the buffer of image is detached here, the bands never write the rows they read
+    const MutableImageView result(destination);
+
+    if(!hasPercentileThreshold())
+    {
+        runRows(source, 0, source.height, result, 0, source.height);
+        return;
+    }
+    quint32 histogram[256] = {};
+    runRows(source, 0, source.height, result, 0, source.height, histogram);
+    binarize(result, percentileThresholdValue(histogram, (qint64)source.width*source.height));
+}
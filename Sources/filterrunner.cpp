@@ -0,0 +1,287 @@
+#include "Headers/filterrunner.h"
+#include "Headers/imagebufferpool.h"
+
+#include <QThread>
+#include <QtMath>
+
+#include <climits>
+#include <cstring>
+
+FilterRunner::FilterRunner(QObject *parent)
+    : QObject(parent)
+    , lastRequest(0)
+    , running(false)
+    , resultCache(nullptr)
+{
+}
+
+FilterRunner::~FilterRunner()
+{
+    if(lastControl)
+        lastControl->cancel();
+    // The threads of the superseded requests are already cancelled
+    for(QThread *thread : threads)
+    {
+        thread->wait();
+        delete thread;
+    }
+}
+
+// Cancel the request running and start a new one, its progress is reported per band of rows
+shared_ptr<FilterControl> FilterRunner::startRequest(int &request)
+{
+    if(lastControl)
+        lastControl->cancel();
+    request = ++lastRequest;
+    running = true;
+
+    shared_ptr<FilterControl> control = make_shared<FilterControl>();
+    control->progress = [this, request](const int percent)
+    {
+        reportProgress(request, percent);
+    };
+    lastControl = control;
+    return control;
+}
+
+void FilterRunner::startThread(const function<void()> &work)
+{
+    QThread *thread = QThread::create(work);
+    connect(thread, &QThread::finished, this, [this, thread]()
+    {
+        threads.removeOne(thread);
+        thread->deleteLater();
+    });
+    threads.append(thread);
+    thread->start();
+}
+
+void FilterRunner::setResultCache(ResultCache *cache)
+{
+    resultCache = cache;
+}
+
+// Result of operation on source kept by cache, null when there is none; input is set to the hash of source
+static QImage cachedResult(ResultCache *cache, const QString &operation, const QImage &source, ResultCache::Hash &input)
+{
+    if(cache == nullptr || operation.isEmpty())
+        return QImage();
+    input = cache->contentHash(source);
+    return cache->image(input, operation);
+}
+
+static void keepResult(ResultCache *cache, const QString &operation, const ResultCache::Hash &input, const QImage &result)
+{
+    if(cache != nullptr && !operation.isEmpty())
+        cache->insertImage(input, operation, result);
+}
+
+int FilterRunner::run(const QString &name, const QString &operation, const QImage &source, QImage destination, const Filter &filter)
+{
+    int request;
+    const shared_ptr<FilterControl> control = startRequest(request);
+
+    // destination is moved, not shared, so that the filter can write into its buffer without copying it
+    startThread([this, request, name, operation, source, result = std::move(destination), filter, control, cache = resultCache]() mutable
+    {
+        ResultCache::Hash input;
+        const QImage cached = cachedResult(cache, operation, source, input);
+        if(!cached.isNull())
+        {
+            reportDone(request, name, cached, control->isCancelled());
+            return;
+        }
+
+        ImageProcessing processing;
+        processing.setFilterControl(control.get());
+        processing.setResultCache(cache);
+        if(!control->isCancelled())
+            filter(processing, source, result);
+        if(!control->isCancelled())
+            keepResult(cache, operation, input, result);
+        reportDone(request, name, std::move(result), control->isCancelled());
+    });
+    return request;
+}
+
+// Pixels rect of image, sharing its memory when the format and the alignment QImage asks for allow it
+static QImage imageRegion(const QImage &image, const QRect &rect)
+{
+    if(image.depth() < 8 || image.colorCount() > 0)
+        return image.copy(rect);
+    const uchar* first = image.constBits() + rect.y()*image.bytesPerLine() + rect.x()*(image.depth()/8);
+    if((quintptr)first % 4 != 0)
+        return image.copy(rect);
+    return QImage(first, rect.width(), rect.height(), image.bytesPerLine(), image.format());
+}
+
+/*
+Tiles are taken one at a time, the next one being the tile of the visible part nearest to
+its center, or else the first tile left in raster order, so scrolling or zooming changes
+the order of the tiles left. Each tile is filtered with its halo, which is dropped. The
+filter itself runs the rows of a tile on all the threads.
+Only the whole result is kept by the result cache: the tiles are not given to it.
+*/
+int FilterRunner::runProgressive(const QString &name, const QString &operation, const QImage &source, QImage destination, const Filter &filter,
+                                 const int halo, const QRect &shownRect, const double scale)
+{
+    int request;
+    const shared_ptr<FilterControl> control = startRequest(request);
+    // Tiles report their own progress
+    control->progress = nullptr;
+    setVisibleRect(shownRect);
+
+    startThread([this, request, name, operation, source, result = std::move(destination), filter, control, halo, scale,
+                 cache = resultCache]() mutable
+    {
+        ResultCache::Hash input;
+        const QImage cached = cachedResult(cache, operation, source, input);
+        if(!cached.isNull())
+        {
+            reportDone(request, name, cached, control->isCancelled());
+            return;
+        }
+
+        ImageProcessing processing;
+        processing.setFilterControl(control.get());
+        const QRect imageRect = source.rect();
+
+        const QRect shown = currentVisibleRect() & imageRect;
+        if(scale < 1.0 && !shown.isEmpty())
+        {
+            const QSize reducedSize = QSize(qCeil(shown.width()*scale), qCeil(shown.height()*scale)).expandedTo(QSize(1, 1));
+            const QImage reduced = imageRegion(source, shown).scaled(reducedSize, Qt::IgnoreAspectRatio, Qt::FastTransformation);
+            QImage preview;
+            filter(processing, reduced, preview);
+            if(!control->isCancelled())
+                reportTile(request, shown, preview);
+        }
+
+        const int size = max(int(tileSize), 8*halo);
+        const int nbColumns = (imageRect.width() + size - 1) / size;
+        const int nbRows = (imageRect.height() + size - 1) / size;
+        const int nbTiles = nbColumns*nbRows;
+        vector<bool> done(nbTiles, false);
+        int nbDone = 0;
+        int firstLeft = 0;
+        bool allocated = false;
+        while(nbDone < nbTiles && !control->isCancelled())
+        {
+            int next = -1;
+            const QRect visible = currentVisibleRect() & imageRect;
+            if(!visible.isEmpty())
+            {
+                const QPoint center = visible.center();
+                qint64 nearest = LLONG_MAX;
+                for(int ty=visible.top()/size; ty<=visible.bottom()/size; ty++)
+                {
+                    for(int tx=visible.left()/size; tx<=visible.right()/size; tx++)
+                    {
+                        if(done[ty*nbColumns + tx])
+                            continue;
+                        const qint64 dx = tx*size + size/2 - center.x();
+                        const qint64 dy = ty*size + size/2 - center.y();
+                        if(dx*dx + dy*dy < nearest)
+                        {
+                            nearest = dx*dx + dy*dy;
+                            next = ty*nbColumns + tx;
+                        }
+                    }
+                }
+            }
+            if(next < 0)
+            {
+                while(done[firstLeft])
+                    firstLeft++;
+                next = firstLeft;
+            }
+
+            const QRect tile = QRect((next % nbColumns)*size, (next / nbColumns)*size, size, size) & imageRect;
+            const QRect input = tile.adjusted(-halo, -halo, halo, halo) & imageRect;
+            QImage tileResult;
+            filter(processing, imageRegion(source, input), tileResult);
+            if(control->isCancelled())
+                break;
+
+            if(!allocated)
+            {
+                if(result.size() != source.size() || result.format() != tileResult.format())
+                    result = ImageBufferPool::instance().image(source.width(), source.height(), tileResult.format());
+                allocated = true;
+            }
+            const int bytesPerPixel = result.depth() / 8;
+            const QPoint offset = tile.topLeft() - input.topLeft();
+            for(int y=0; y<tile.height(); y++)
+            {
+                memcpy(result.scanLine(tile.y() + y) + tile.x()*bytesPerPixel,
+                       tileResult.constScanLine(offset.y() + y) + offset.x()*bytesPerPixel, tile.width()*bytesPerPixel);
+            }
+            done[next] = true;
+            nbDone++;
+            reportTile(request, tile, result.copy(tile));
+            reportProgress(request, nbDone*100 / nbTiles);
+        }
+        if(!control->isCancelled())
+            keepResult(cache, operation, input, result);
+        reportDone(request, name, std::move(result), control->isCancelled());
+    });
+    return request;
+}
+
+void FilterRunner::setVisibleRect(const QRect &rect)
+{
+    lock_guard<mutex> lock(visibleRectMutex);
+    visibleRect = rect;
+}
+
+QRect FilterRunner::currentVisibleRect() const
+{
+    lock_guard<mutex> lock(visibleRectMutex);
+    return visibleRect;
+}
+
+void FilterRunner::cancel()
+{
+    if(lastControl)
+        lastControl->cancel();
+}
+
+bool FilterRunner::isRunning() const
+{
+    return running;
+}
+
+// The report functions are called by the workers, the signals are emitted in the thread of the runner
+void FilterRunner::reportProgress(const int request, const int percent)
+{
+    QMetaObject::invokeMethod(this, [this, request, percent]()
+    {
+        if(request == lastRequest)
+            emit progressChanged(percent);
+    }, Qt::QueuedConnection);
+}
+
+void FilterRunner::reportTile(const int request, const QRect &rect, const QImage &tile)
+{
+    QMetaObject::invokeMethod(this, [this, request, rect, tile]()
+    {
+        if(request == lastRequest && running)
+            emit tileReady(rect, tile);
+    }, Qt::QueuedConnection);
+}
+
+// Results of the superseded requests are dropped, only the last one is reported
+void FilterRunner::reportDone(const int request, const QString &name, QImage result, const bool wasCancelled)
+{
+    QMetaObject::invokeMethod(this, [this, request, name, result = std::move(result), wasCancelled]()
+    {
+        if(request != lastRequest)
+            return;
+        running = false;
+        lastControl.reset();
+        if(wasCancelled)
+            emit cancelled(name);
+        else
+            emit finished(name, result);
+    }, Qt::QueuedConnection);
+}
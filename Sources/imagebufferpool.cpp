@@ -0,0 +1,163 @@
+#include "Headers/imagebufferpool.h"
+
+#include <new>
+
+// Buckets below 4 KiB are not used, small buffers all go to the 4 KiB one
+static constexpr int minBucketShift = 11;
+
+ImageBufferPool::ImageBufferPool(const qsizetype maxPooledBytes)
+    : stats{0, 0, 0, 0, 0}
+    , maxPooled(maxPooledBytes)
+{
+}
+
+ImageBufferPool::~ImageBufferPool()
+{
+    trim();
+}
+
+/*
+The shared pool is never destroyed: images taken from it may still be released by
+static objects at exit.
+*/
+ImageBufferPool& ImageBufferPool::instance()
+{
+    static ImageBufferPool* pool = new ImageBufferPool();
+    return *pool;
+}
+
+/*
+Bucket of a size between 2^p and 2^(p+1): the first of 2^p + k*2^(p-2), k = 1..4,
+that is large enough.
+*/
+int ImageBufferPool::bucketOf(const qsizetype size)
+{
+    const quint64 n = max<qsizetype>(size, qsizetype(1) << (minBucketShift + 1));
+    int p = 63;
+    while(((n - 1) >> p) == 0)
+    {
+        p--;
+    }
+    const quint64 step = quint64(1) << (p - 2);
+    const int k = (int)((n - (quint64(1) << p) + step - 1) / step);
+    return (p - minBucketShift)*4 + k - 1;
+}
+
+qsizetype ImageBufferPool::bucketSize(const int bucket)
+{
+    const int p = bucket/4 + minBucketShift;
+    const int k = bucket%4 + 1;
+    return (qsizetype(1) << p) + k*(qsizetype(1) << (p - 2));
+}
+
+/*
+Every buffer starts with a header (in its own 64 bytes, to keep the data aligned)
+telling the pool and the bucket it belongs to.
+*/
+uchar* ImageBufferPool::acquire(const qsizetype size)
+{
+    const int bucket = bucketOf(size);
+    const qsizetype bytes = bucketSize(bucket);
+    {
+        lock_guard<mutex> lock(poolMutex);
+        stats.bytesInUse += bytes;
+        stats.highWaterMark = max(stats.highWaterMark, stats.bytesInUse);
+        if(bucket < (int)freeBuffers.size() && !freeBuffers[bucket].empty())
+        {
+            uchar* buffer = freeBuffers[bucket].back();
+            freeBuffers[bucket].pop_back();
+            stats.bytesPooled -= bytes;
+            stats.hits++;
+            return buffer;
+        }
+        stats.misses++;
+    }
+
+    uchar* block = static_cast<uchar*>(::operator new(alignment + bytes, align_val_t(alignment)));
+    BufferHeader* header = reinterpret_cast<BufferHeader*>(block);
+    header->pool = this;
+    header->bucket = bucket;
+    return block + alignment;
+}
+
+void ImageBufferPool::release(uchar* buffer)
+{
+    if(buffer == nullptr)
+        return;
+    const BufferHeader* header = reinterpret_cast<const BufferHeader*>(buffer - alignment);
+    header->pool->giveBack(buffer, header->bucket);
+}
+
+void ImageBufferPool::giveBack(uchar* buffer, const int bucket)
+{
+    const qsizetype bytes = bucketSize(bucket);
+    lock_guard<mutex> lock(poolMutex);
+    stats.bytesInUse -= bytes;
+    if(stats.bytesPooled + bytes > maxPooled)
+    {
+        ::operator delete(buffer - alignment, align_val_t(alignment));
+        return;
+    }
+    if(bucket >= (int)freeBuffers.size())
+        freeBuffers.resize(bucket + 1);
+    freeBuffers[bucket].push_back(buffer);
+    stats.bytesPooled += bytes;
+}
+
+static void releaseImageBuffer(void* buffer)
+{
+    ImageBufferPool::release(static_cast<uchar*>(buffer));
+}
+
+QImage ImageBufferPool::image(const int width, const int height, const QImage::Format format)
+{
+    if(width <= 0 || height <= 0)
+        return QImage();
+
+    // Same 32 bits aligned rows as the images allocated by QImage
+    const qsizetype bytesPerLine = ((qsizetype)width*QImage::toPixelFormat(format).bitsPerPixel() + 31) / 32 * 4;
+    uchar* buffer = acquire(bytesPerLine*height);
+    return QImage(buffer, width, height, bytesPerLine, format, releaseImageBuffer, buffer);
+}
+
+ImageBufferPool::Statistics ImageBufferPool::statistics() const
+{
+    lock_guard<mutex> lock(poolMutex);
+    return stats;
+}
+
+void ImageBufferPool::resetStatistics()
+{
+    lock_guard<mutex> lock(poolMutex);
+    stats.hits = 0;
+    stats.misses = 0;
+    stats.highWaterMark = stats.bytesInUse;
+}
+
+void ImageBufferPool::setMaxPooledBytes(const qsizetype maxPooledBytes)
+{
+    lock_guard<mutex> lock(poolMutex);
+    maxPooled = maxPooledBytes;
+    trimTo(maxPooled);
+}
+
+void ImageBufferPool::trim()
+{
+    lock_guard<mutex> lock(poolMutex);
+    trimTo(0);
+}
+
+// Free pooled buffers, largest first, until at most maxBytes are kept (poolMutex held)
+void ImageBufferPool::trimTo(const qsizetype maxBytes)
+{
+    for(int bucket=(int)freeBuffers.size()-1; bucket>=0 && stats.bytesPooled > maxBytes; bucket--)
+    {
+        vector<uchar*>& buffers = freeBuffers[bucket];
+        while(!buffers.empty() && stats.bytesPooled > maxBytes)
+        {
+            ::operator delete(buffers.back() - alignment, align_val_t(alignment));
+            buffers.pop_back();
+            stats.bytesPooled -= bucketSize(bucket);
+        }
+    }
+}
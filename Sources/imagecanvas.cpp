@@ -0,0 +1,153 @@
+#include "Headers/imagecanvas.h"
+
+#include <QPaintEvent>
+#include <QPainter>
+#include <QThread>
+#include <QtMath>
+
+ImageCanvas::ImageCanvas(QWidget *parent)
+    : QWidget(parent)
+    , cacheBudget(TilePyramid::defaultBudget)
+    , builder(nullptr)
+{
+}
+
+ImageCanvas::~ImageCanvas()
+{
+    if(builder)
+    {
+        builder->wait();
+        delete builder;
+    }
+}
+
+void ImageCanvas::setImage(const QImage &image)
+{
+    // The tiles of an image of the same size stand in for the new ones, a filtered image replacing its source
+    if(pyramid && pyramid->image().size() == image.size())
+        previousPyramid = pyramid;
+    else
+        previousPyramid.reset();
+    pyramid = image.isNull() ? nullptr : make_shared<TilePyramid>(image, cacheBudget);
+    patches.clear();
+    update();
+}
+
+void ImageCanvas::setCacheBudget(const qint64 budget)
+{
+    cacheBudget = budget;
+    if(pyramid)
+        pyramid->setBudget(budget);
+}
+
+void ImageCanvas::drawPatch(const QRect &rect, const QImage &patch)
+{
+    patches.append(qMakePair(rect, patch));
+    if(pyramid)
+    {
+        const double scaleX = width() / (double)pyramid->image().width();
+        const double scaleY = height() / (double)pyramid->image().height();
+        update(QRectF(rect.x()*scaleX, rect.y()*scaleY, rect.width()*scaleX, rect.height()*scaleY).toAlignedRect());
+    }
+}
+
+void ImageCanvas::clearPatches()
+{
+    patches.clear();
+    update();
+}
+
+QSize ImageCanvas::sizeHint() const
+{
+    return pyramid ? pyramid->image().size() : QSize();
+}
+
+/*
+Only the tiles of the exposed rect are drawn, from the level whose pixels are the closest
+to the pixels of the screen, at least as fine.
+*/
+void ImageCanvas::paintEvent(QPaintEvent *event)
+{
+    QPainter painter(this);
+    painter.fillRect(event->rect(), palette().brush(backgroundRole()));
+    if(!pyramid)
+        return;
+
+    const QSize imageSize = pyramid->image().size();
+    const double scaleX = width() / (double)imageSize.width();
+    const double scaleY = height() / (double)imageSize.height();
+    const int level = pyramid->levelFor(min(scaleX, scaleY));
+    const int factor = 1 << level;
+    // Reduced tiles are smoothed, enlarged pixels stay sharp
+    painter.setRenderHint(QPainter::SmoothPixmapTransform, min(scaleX, scaleY) < 1.0);
+
+    const QRect exposed = event->rect();
+    const QRect levelRect(QPoint(qFloor(exposed.left() / (scaleX*factor)), qFloor(exposed.top() / (scaleY*factor))),
+                          QPoint(qFloor((exposed.right() + 1) / (scaleX*factor)), qFloor((exposed.bottom() + 1) / (scaleY*factor))));
+    vector<TilePyramid::TileKey> missing;
+    for(const TilePyramid::TileKey &key : pyramid->tilesIn(level, levelRect))
+    {
+        const QRect rect = pyramid->tileRect(key);
+        const QRectF target(rect.x()*factor*scaleX, rect.y()*factor*scaleY, rect.width()*factor*scaleX, rect.height()*factor*scaleY);
+        const QImage tile = pyramid->tile(key);
+        if(!tile.isNull())
+        {
+            painter.drawImage(target, tile);
+            continue;
+        }
+        missing.push_back(key);
+        if(!drawTile(painter, pyramid, key, level + 1, target) && previousPyramid)
+            drawTile(painter, previousPyramid, key, level, target);
+    }
+    if(missing.empty())
+        previousPyramid.reset();
+    else
+        requestTiles(missing);
+
+    for(const QPair<QRect, QImage> &patch : patches)
+    {
+        const QRectF target(patch.first.x()*scaleX, patch.first.y()*scaleY, patch.first.width()*scaleX, patch.first.height()*scaleY);
+        if(target.intersects(exposed))
+            painter.drawImage(target, patch.second);
+    }
+}
+
+// Draw the part of the first tile of source covering key, from firstLevel up, enlarged to target
+bool ImageCanvas::drawTile(QPainter &painter, const shared_ptr<TilePyramid> &source, const TilePyramid::TileKey &key,
+                           const int firstLevel, const QRectF &target)
+{
+    const QRect rect = source->tileRect(key);
+    for(int level=firstLevel; level<source->levelCount(); level++)
+    {
+        const int shift = level - key.level;
+        const TilePyramid::TileKey covering{level, key.x >> shift, key.y >> shift};
+        const QImage tile = source->tile(covering);
+        if(tile.isNull())
+            continue;
+        const QRect coveringRect = source->tileRect(covering);
+        const double factor = 1 << shift;
+        painter.drawImage(target, tile, QRectF(rect.x() / factor - coveringRect.x(), rect.y() / factor - coveringRect.y(),
+                                               rect.width() / factor, rect.height() / factor));
+        return true;
+    }
+    return false;
+}
+
+// One batch of tiles at a time: the paint that follows it asks for the tiles still missing
+void ImageCanvas::requestTiles(const vector<TilePyramid::TileKey> &keys)
+{
+    if(builder)
+        return;
+    const shared_ptr<TilePyramid> source = pyramid;
+    builder = QThread::create([source, keys]()
+    {
+        source->build(keys);
+    });
+    connect(builder, &QThread::finished, this, [this]()
+    {
+        builder->deleteLater();
+        builder = nullptr;
+        update();
+    });
+    builder->start();
+}
@@ -0,0 +1,379 @@
+#include "Headers/imagehistory.h"
+#include "Headers/threadpool.h"
+
+#include <QDir>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+
+// Bytes x rows of the tile index of an image of rowBytes x height bytes cut in columns
+static void tileArea(const int index, const int columns, const qsizetype rowBytes, const int height,
+                     qsizetype &x, int &y, int &width, int &nbRows)
+{
+    x = qsizetype(index % columns) * ImageHistory::tileBytes;
+    y = (index / columns) * ImageHistory::tileRows;
+    width = min<qsizetype>(ImageHistory::tileBytes, rowBytes - x);
+    nbRows = min(ImageHistory::tileRows, height - y);
+}
+
+static qsizetype rowBytesOf(const QImage &image)
+{
+    return ((qsizetype)image.width()*image.depth() + 7) / 8;
+}
+
+ImageHistory::ImageHistory(const qint64 budget)
+    : current(-1)
+    , maxBytes(budget)
+    , bytesInMemory(0)
+{
+}
+
+void ImageHistory::clear()
+{
+    revisions.clear();
+    current = -1;
+    currentImage = QImage();
+    bytesInMemory = 0;
+    spillFile.reset();
+}
+
+void ImageHistory::push(const QImage &image, const QString &label)
+{
+    while((int)revisions.size() > current + 1)
+    {
+        dropRevision((int)revisions.size() - 1);
+    }
+    Revision revision = makeRevision(image, label);
+    if(current >= 0)
+        leaveCurrentImage(image, revision);
+    revisions.push_back(std::move(revision));
+    current = (int)revisions.size() - 1;
+    currentImage = image;
+    enforceBudget();
+}
+
+// Every tile in the image
+ImageHistory::Revision ImageHistory::makeRevision(const QImage &image, const QString &label)
+{
+    Revision revision;
+    revision.label = label;
+    revision.size = image.size();
+    revision.format = image.format();
+    revision.colorTable = image.colorTable();
+    revision.columns = max<qsizetype>(1, (rowBytesOf(image) + tileBytes - 1) / tileBytes);
+    const int nbBands = (image.height() + tileRows - 1) / tileRows;
+    revision.tiles.resize((size_t)revision.columns * nbBands);
+    for(shared_ptr<Tile> &tile : revision.tiles)
+    {
+        tile = make_shared<Tile>(Tile{QByteArray(), -1, 0, true});
+    }
+    return revision;
+}
+
+/*
+Before image, of revision, becomes the current image: the tiles of the current revision
+that image changes are copied from currentImage, in parallel. Comparing a tile with the one
+replacing it costs a read of both, less than the copy it saves. An unchanged tile is shared
+with a new revision, or takes the pixels stored for the tile of revision; the tiles of
+revision are then all read from image.
+*/
+void ImageHistory::leaveCurrentImage(const QImage &image, Revision &revision)
+{
+    const Revision &previous = revisions[current];
+    const bool comparable = previous.size == revision.size && previous.format == revision.format;
+    const qsizetype rowBytes = rowBytesOf(currentImage);
+    atomic<qint64> copiedBytes(0);
+    ThreadPool::instance().parallelFor(previous.tiles.size(), [&](const int i)
+    {
+        const shared_ptr<Tile> &tile = previous.tiles[i];
+        qsizetype x;
+        int y, width, nbRows;
+        tileArea(i, previous.columns, rowBytes, currentImage.height(), x, y, width, nbRows);
+
+        if(comparable)
+        {
+            shared_ptr<Tile> &next = revision.tiles[i];
+            if(next == tile)
+                return;
+            bool equal = true;
+            for(int row=0; row<nbRows && equal; row++)
+            {
+                equal = memcmp(image.constScanLine(y + row) + x, currentImage.constScanLine(y + row) + x, width) == 0;
+            }
+            if(equal && next->inCurrentImage)
+            {
+                next = tile;
+                return;
+            }
+            if(equal)
+            {
+                tile->pixels = next->pixels;
+                tile->spillOffset = next->spillOffset;
+                tile->spillSize = next->spillSize;
+                tile->inCurrentImage = false;
+                *next = Tile{QByteArray(), -1, 0, true};
+                return;
+            }
+        }
+
+        tile->pixels = QByteArray((qsizetype)width*nbRows, Qt::Uninitialized);
+        uchar* pixels = reinterpret_cast<uchar*>(tile->pixels.data());
+        for(int row=0; row<nbRows; row++)
+        {
+            memcpy(pixels + (qsizetype)row*width, currentImage.constScanLine(y + row) + x, width);
+        }
+        tile->inCurrentImage = false;
+        copiedBytes += tile->pixels.size();
+    });
+    bytesInMemory += copiedBytes;
+
+    // The pixels stored for the other tiles of revision are no longer needed
+    for(const shared_ptr<Tile> &tile : revision.tiles)
+    {
+        if(tile->inCurrentImage)
+            continue;
+        if(tile->spillOffset < 0)
+            bytesInMemory -= tile->pixels.size();
+        *tile = Tile{QByteArray(), -1, 0, true};
+    }
+}
+
+// The spilled tiles are read in order, then decompressed in parallel with the copies of the others
+QImage ImageHistory::restore(const Revision &revision)
+{
+    QImage image(revision.size, revision.format);
+    if(image.isNull())
+        return image;
+    image.setColorTable(revision.colorTable);
+    const qsizetype rowBytes = rowBytesOf(image);
+
+    vector<QByteArray> spilled(revision.tiles.size());
+    for(size_t i=0; i<revision.tiles.size(); i++)
+    {
+        const Tile &tile = *revision.tiles[i];
+        if(tile.spillOffset < 0)
+            continue;
+        if(!spillFile || !spillFile->seek(tile.spillOffset))
+            return QImage();
+        spilled[i] = spillFile->read(tile.spillSize);
+        if(spilled[i].size() != tile.spillSize)
+            return QImage();
+    }
+
+    atomic<bool> corrupted(false);
+    ThreadPool::instance().parallelFor(revision.tiles.size(), [&](const int i)
+    {
+        qsizetype x;
+        int y, width, nbRows;
+        tileArea(i, revision.columns, rowBytes, image.height(), x, y, width, nbRows);
+        const Tile &tile = *revision.tiles[i];
+        if(tile.inCurrentImage)
+        {
+            for(int row=0; row<nbRows; row++)
+            {
+                memcpy(image.scanLine(y + row) + x, currentImage.constScanLine(y + row) + x, width);
+            }
+            return;
+        }
+        if(tile.spillOffset >= 0)
+            spilled[i] = qUncompress(spilled[i]);
+        const QByteArray &pixels = tile.spillOffset >= 0 ? spilled[i] : tile.pixels;
+        if(pixels.size() != (qsizetype)width*nbRows)
+        {
+            corrupted = true;
+            return;
+        }
+        for(int row=0; row<nbRows; row++)
+        {
+            memcpy(image.scanLine(y + row) + x, pixels.constData() + (qsizetype)row*width, width);
+        }
+    });
+    return corrupted ? QImage() : image;
+}
+
+bool ImageHistory::canUndo() const
+{
+    return current > 0;
+}
+
+bool ImageHistory::canRedo() const
+{
+    return current >= 0 && current + 1 < (int)revisions.size();
+}
+
+QString ImageHistory::undoLabel() const
+{
+    return canUndo() ? revisions[current].label : QString();
+}
+
+QString ImageHistory::redoLabel() const
+{
+    return canRedo() ? revisions[current + 1].label : QString();
+}
+
+QImage ImageHistory::undo()
+{
+    return canUndo() ? moveTo(current - 1) : QImage();
+}
+
+QImage ImageHistory::redo()
+{
+    return canRedo() ? moveTo(current + 1) : QImage();
+}
+
+// The current revision does not change when its image cannot be read back
+QImage ImageHistory::moveTo(const int revision)
+{
+    const QImage image = restore(revisions[revision]);
+    if(image.isNull())
+        return image;
+    leaveCurrentImage(image, revisions[revision]);
+    current = revision;
+    currentImage = image;
+    return image;
+}
+
+void ImageHistory::setBudget(const qint64 budget)
+{
+    maxBytes = budget;
+    enforceBudget();
+}
+
+qint64 ImageHistory::budget() const
+{
+    return maxBytes;
+}
+
+void ImageHistory::setSpillDirectory(const QString &directory)
+{
+    spillPath = directory;
+    enforceBudget();
+}
+
+QString ImageHistory::spillDirectory() const
+{
+    return spillPath;
+}
+
+int ImageHistory::revisionCount() const
+{
+    return revisions.size();
+}
+
+qint64 ImageHistory::memoryUsed() const
+{
+    return bytesInMemory;
+}
+
+qint64 ImageHistory::spilledBytes() const
+{
+    return spillFile ? spillFile->size() : 0;
+}
+
+/*
+The revisions farthest from the current one go first: they are spilled when there is a
+spill directory (and the spill file can be written), dropped otherwise.
+*/
+void ImageHistory::enforceBudget()
+{
+    while(current >= 0 && bytesInMemory > maxBytes)
+    {
+        vector<int> order;
+        for(int i=0; i<(int)revisions.size(); i++)
+        {
+            if(i != current)
+                order.push_back(i);
+        }
+        if(order.empty())
+            return;
+        stable_sort(order.begin(), order.end(), [this](const int a, const int b)
+        {
+            return abs(a - current) > abs(b - current);
+        });
+
+        bool spilled = false;
+        if(!spillPath.isEmpty())
+        {
+            for(const int i : order)
+            {
+                if(spill(revisions[i]))
+                {
+                    spilled = true;
+                    break;
+                }
+            }
+        }
+        if(spilled)
+            continue;
+
+        // Nothing left to spill: the farthest revision is dropped
+        const int dropped = order.front();
+        dropRevision(dropped);
+        if(dropped < current)
+            current--;
+    }
+}
+
+// The tiles in memory that no other revision shares are freed with it
+void ImageHistory::dropRevision(const int index)
+{
+    for(const shared_ptr<Tile> &tile : revisions[index].tiles)
+    {
+        if(tile.use_count() == 1 && tile->spillOffset < 0)
+            bytesInMemory -= tile->pixels.size();
+    }
+    revisions.erase(revisions.begin() + index);
+}
+
+/*
+Compress the tiles of revision in memory to the end of the spill file; the tiles shared
+with the current revision are in its image. Returns false when there was none or on a write
+error, the tiles then stay in memory.
+*/
+bool ImageHistory::spill(Revision &revision)
+{
+    vector<shared_ptr<Tile>> tiles;
+    for(const shared_ptr<Tile> &tile : revision.tiles)
+    {
+        if(tile->spillOffset < 0 && !tile->inCurrentImage)
+            tiles.push_back(tile);
+    }
+    if(tiles.empty())
+        return false;
+
+    if(!spillFile)
+    {
+        spillFile.reset(new QTemporaryFile(QDir(spillPath).filePath(QStringLiteral("imagehistory-XXXXXX.spill"))));
+        if(!spillFile->open())
+        {
+            spillFile.reset();
+            return false;
+        }
+    }
+
+    // Fast compression: the point is to leave memory, not to save disk space
+    vector<QByteArray> compressed(tiles.size());
+    ThreadPool::instance().parallelFor(tiles.size(), [&](const int i)
+    {
+        compressed[i] = qCompress(tiles[i]->pixels, 1);
+    });
+
+    qint64 offset = spillFile->size();
+    if(!spillFile->seek(offset))
+        return false;
+    for(size_t i=0; i<tiles.size(); i++)
+    {
+        if(spillFile->write(compressed[i]) != compressed[i].size())
+        {
+            // The tiles written so far are spilled, the others stay in memory
+            return i > 0;
+        }
+        tiles[i]->spillOffset = offset;
+        tiles[i]->spillSize = compressed[i].size();
+        bytesInMemory -= tiles[i]->pixels.size();
+        tiles[i]->pixels = QByteArray();
+        offset += compressed[i].size();
+    }
+    return true;
+}
@@ -1,9 +1,22 @@
 #include "Headers/imageprocessing.h"
-#include "ui_imageprocessing.h"
+#include "Headers/simdkernels.h"
+#include "Headers/threadpool.h"
+#include "Headers/integralimage.h"
+#include "Headers/imagebufferpool.h"
+#include "Headers/imageview.h"
+#include "Headers/profiler.h"
+#include "Headers/resultcache.h"
+
+#include <QColor>
+
+#include <mutex>
 
 ImageProcessing::ImageProcessing(QImage* image)
 {
     currentImage = image;
+    nbThreads = 0;
+    filterControl = nullptr;
+    resultCache = nullptr;
 }
 
 ImageProcessing::~ImageProcessing()
@@ -20,335 +33,1074 @@ void ImageProcessing::setAsCurrentImage(QImage *image)
     currentImage = image;
 }
 
+void ImageProcessing::setThreadCount(const int threadCount)
+{
+    nbThreads = max(threadCount, 0);
+}
+
+int ImageProcessing::threadCount() const
+{
+    return nbThreads > 0 ? nbThreads : ThreadPool::instance().threadCount();
+}
+
+void ImageProcessing::setFilterControl(FilterControl* control)
+{
+    filterControl = control;
+}
+
+void ImageProcessing::setResultCache(ResultCache* cache)
+{
+    resultCache = cache;
+}
+
 /*
-Convert image to greyScale
+Summed-area table of source, the pixels of image in a supported format. With a result
+cache, the table is kept for the content of image, so the next filters reading the same
+pixels (another radius, or local contrast normalization after a blur) do not build it again.
 */
-QImage* ImageProcessing::convertToGrayScale(const  uchar* imageData,const int width,const int height,const QImage::Format format)
+shared_ptr<const IntegralImage> ImageProcessing::integralImageOf(const QImage &image, const ImageView &source, const bool withSquares) const
 {
-    QImage* grayScaleImage = new QImage(width,height,format);
-    uchar* grayScaleImageData = grayScaleImage->bits();
-    for(int i= 0;i<height * width * 4; i+=4 )
+    ResultCache::Hash hash;
+    if(resultCache)
     {
-        float greyScaleValue = 0.299f * imageData[i] + 0.587f * imageData[i+1] + 0.114f *imageData[i+2];
-        //Red
-        grayScaleImageData[i] = greyScaleValue;
-        //Green
-        grayScaleImageData[i+1] = greyScaleValue;
-        //Blue
-        grayScaleImageData[i+2] = greyScaleValue;
-        //Alpha
-        grayScaleImageData[i+3] = imageData[i +3];
+        hash = resultCache->contentHash(image);
+        const shared_ptr<const IntegralImage> cached = resultCache->integralImage(hash, withSquares);
+        if(cached)
+            return cached;
     }
+    const shared_ptr<IntegralImage> integralImage = make_shared<IntegralImage>();
+    integralImage->build(source, withSquares, threadCount());
+    if(resultCache)
+        resultCache->insertIntegralImage(hash, integralImage);
+    return integralImage;
+}
+
+/*
+Split the rows of an image in bands and run rowFunction(rowStart, rowEnd) on each band,
+as tasks of the shared thread pool. Bands only write their own rows and read the rows
+they need (halo) from the source, so the result does not depend on the number of bands.
+Bands are kept several halos high, so that the rows read twice stay a small part of the work.
+With a FilterControl, the rows are cut in up to bandsPerThread times more bands, taken in
+turn by the threads, so that a cancelled filter stops soon and the progress moves often.
+*/
+void ImageProcessing::forEachRowBand(const int height, const int halo, const function<void(int, int)>& rowFunction) const
+{
+    const int minBandHeight = max(32, 8*halo);
+    const int nbThreadBands = max(1, min(threadCount(), height / minBandHeight));
+    if(filterControl == nullptr)
+    {
+        ThreadPool::instance().parallelFor(nbThreadBands, [&](const int band)
+        {
+            PROFILE_SCOPE("band", "rows", 0);
+            rowFunction(band*height/nbThreadBands, (band+1)*height/nbThreadBands);
+        });
+        return;
+    }
+
+    const int bandsPerThread = 16;
+    const int nbBands = max(nbThreadBands, min(nbThreadBands*bandsPerThread, height / minBandHeight));
+    atomic<int> nextBand(0);
+    atomic<int> rowsDone(0);
+    ThreadPool::instance().parallelFor(nbThreadBands, [&](const int)
+    {
+        for(int band = nextBand++; band < nbBands && !filterControl->isCancelled(); band = nextBand++)
+        {
+            const int rowStart = band*height/nbBands;
+            const int rowEnd = (band+1)*height/nbBands;
+            {
+                PROFILE_SCOPE("band", "rows", 0);
+                rowFunction(rowStart, rowEnd);
+            }
+            filterControl->reportRows(rowsDone += rowEnd - rowStart, height);
+        }
+    });
+}
+
+/*
+Copy the pixels [x0, x1) of a source row into a halo-padded row: kernelRadius pixels are
+added on each side, replicating the first and last pixels of the image so the
+convolution never has to clamp x.
+*/
+template<typename Pixel>
+static void loadPaddedPixels(const uchar* sourceRow, const int width, const int x0, const int x1, const int kernelRadius, uchar* paddedRow)
+{
+    const Pixel* source = reinterpret_cast<const Pixel*>(sourceRow);
+    Pixel* padded = reinterpret_cast<Pixel*>(paddedRow);
+    const int first = x0 - kernelRadius;
+    const int last = x1 + kernelRadius;
+    const int copyStart = max(first, 0);
+    const int copyEnd = min(last, width);
+
+    for(int x=first; x<copyStart; x++)
+    {
+        *padded++ = source[0];
+    }
+    memcpy(padded, source + copyStart, (copyEnd - copyStart)*sizeof(Pixel));
+    padded += copyEnd - copyStart;
+    for(int x=copyEnd; x<last; x++)
+    {
+        *padded++ = source[width-1];
+    }
+}
+
+static void loadPaddedRow(const uchar* sourceRow, const int width, const int channels, const int x0, const int x1, const int kernelRadius, uchar* paddedRow)
+{
+    if(channels == 4)
+        loadPaddedPixels<quint32>(sourceRow, width, x0, x1, kernelRadius, paddedRow);
+    else
+        loadPaddedPixels<uchar>(sourceRow, width, x0, x1, kernelRadius, paddedRow);
+}
+
+/*
+Write one row of convolution sums: color channels are |sum| / kernelParameter
+saturated to 255, alpha is opaque.
+*/
+static void storeConvolutionRow(const int* accumulator, const int rowBytes, const int channels, const float kernelParameter, uchar* destinationRow)
+{
+    if(channels == 1)
+    {
+        for(int i=0; i<rowBytes; i++)
+        {
+            destinationRow[i] = fminf(abs(accumulator[i]) / kernelParameter, 255.0f);
+        }
+        return;
+    }
+    for(int i=0; i<rowBytes; i+=4)
+    {
+        destinationRow[i] = fminf(abs(accumulator[i]) / kernelParameter, 255.0f);
+        destinationRow[i+1] = fminf(abs(accumulator[i+1]) / kernelParameter, 255.0f);
+        destinationRow[i+2] = fminf(abs(accumulator[i+2]) / kernelParameter, 255.0f);
+        destinationRow[i+3] = 255;
+    }
+}
+
+// Image over the pixels given to the functions taking a pointer, rows aligned like QImage does
+static QImage wrapImage(const uchar* imageData, const int width, const int height, const QImage::Format format)
+{
+    return QImage(imageData, width, height, format);
+}
+
+/*
+The image itself when its format is processed directly, else its conversion (done once,
+here at the boundary) to Format_Grayscale8 or Format_ARGB32.
+*/
+static const QImage& supportedImage(const QImage &image, QImage &converted)
+{
+    if(ImageView::channelsOf(image.format()) != 0)
+    {
+        return image;
+    }
+    converted = image.convertToFormat(ImageView::supportedFormat(image.format(), image.isGrayscale()));
+    return converted;
+}
+
+/*
+Make destination a width x height image of the given format. Its buffer is kept when it
+already is one (and not shared with another QImage), otherwise it is taken from the pool:
+writing to a shared buffer would first copy pixels that are about to be overwritten.
+*/
+static MutableImageView prepareDestination(QImage &destination, const int width, const int height, const QImage::Format format)
+{
+    if(destination.width() != width || destination.height() != height || destination.format() != format
+       || !destination.isDetached())
+    {
+        destination = ImageBufferPool::instance().image(width, height, format);
+    }
+    return MutableImageView(destination);
+}
+
+/*
+Filters reading the neighbors of the pixels they write cannot run in place, the bands
+would read rows already written by the others: they read a copy of the source instead.
+A destination shared with another QImage gets a buffer of its own, the source stays valid.
+*/
+static ImageView separateSource(const ImageView &source, const QImage &destination, QImage &sourceCopy)
+{
+    if(source.data != destination.constBits() || !destination.isDetached())
+    {
+        return source;
+    }
+    sourceCopy = ImageBufferPool::instance().image(destination.width(), destination.height(), destination.format());
+    memcpy(sourceCopy.bits(), source.data, destination.sizeInBytes());
+    return ImageView(sourceCopy);
+}
+
+/*
+Convert image to greyScale, with fixed point luma weights (see SimdKernels).
+The result is a Format_Grayscale8 image, or an image of the format of the source with
+R = G = B when keepFormat is set.
+*/
+void ImageProcessing::convertToGrayScale(const QImage &image, QImage &destination, const bool keepFormat)
+{
+    PROFILE_SCOPE("filter", "grayscale", (qint64)image.width()*image.height());
+    QImage converted;
+    // Held by value: destination may be image itself and be reallocated to another format
+    const QImage input = supportedImage(image, converted);
+    const ImageView source(input);
+    const QImage::Format format = keepFormat ? input.format() : QImage::Format_Grayscale8;
+    const MutableImageView grayScale = prepareDestination(destination, source.width, source.height, format);
+    forEachRowBand(source.height, 0, [&](const int rowStart, const int rowEnd)
+    {
+        for(int y=rowStart; y<rowEnd; y++)
+        {
+            if(source.channels == 1)
+            {
+                if(grayScale.row(y) != source.row(y))
+                    memcpy(grayScale.row(y), source.row(y), source.width);
+            }
+            else if(grayScale.channels == 1)
+            {
+                SimdKernels::luma(source.row(y), grayScale.row(y), source.width);
+            }
+            else
+            {
+                SimdKernels::grayscale(source.row(y), grayScale.row(y), source.width);
+            }
+        }
+    });
+}
+
+void ImageProcessing::convertToGrayScale(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination)
+{
+    convertToGrayScale(wrapImage(imageData, width, height, format), destination, true);
+}
+
+QImage* ImageProcessing::convertToGrayScale(const  uchar* imageData,const int width,const int height,const QImage::Format format)
+{
+    QImage* grayScaleImage = new QImage();
+    convertToGrayScale(imageData, width, height, format, *grayScaleImage);
     return grayScaleImage;
 }
 
-QImage* ImageProcessing::meanBlur(const  uchar* imageData,const int width, const int height,const QImage::Format format)
+void ImageProcessing::meanBlur(const QImage &image, QImage &destination, const int kernelRadius)
 {
-    const int kernel[9] ={1,1,1,
-                          1,1,1,
-                          1,1,1};
+    PROFILE_SCOPE("filter", "mean blur", (qint64)image.width()*image.height());
+    // A smaller window would be another filter: larger radii give a null image
+    if(kernelRadius > IntegralImage::maxRadius)
+    {
+        destination = QImage();
+        return;
+    }
+    const int radius = max(kernelRadius, 1);
+    const float kernelParameter = (2*radius+1)*(2*radius+1);
+    if(radius <= 2)
+    {
+        const int kernel[5] ={1,1,1,1,1};
+        applySeparableFilter(image, destination, radius, kernel, kernel, kernelParameter);
+        return;
+    }
+
+    QImage converted;
+    const QImage &input = supportedImage(image, converted);
+    const ImageView source(input);
+
+    // Large windows: constant time per pixel with a summed-area table, which also makes it safe in place
+    const shared_ptr<const IntegralImage> integralImage = integralImageOf(image, source, false);
+    const int nbColors = integralImage->channelCount();
 
-    return applyFilter(imageData, width, height, format, 1, kernel, 9.0f , &ImageProcessing::applyConvolution);
+    const MutableImageView filtered = prepareDestination(destination, source.width, source.height, input.format());
+    forEachRowBand(source.height, 0, [&](const int rowStart, const int rowEnd)
+    {
+        for(int y=rowStart; y<rowEnd; y++)
+        {
+            uchar* filteredRow = filtered.row(y);
+            for(int x=0; x<source.width; x++)
+            {
+                quint64 sums[IntegralImage::nbChannels];
+                integralImage->windowSum(x, y, radius, sums);
+                uchar* filteredPixel = filteredRow + filtered.channels*x;
+                for(int c=0; c<nbColors; c++)
+                    filteredPixel[c] = sums[c] / kernelParameter;
+                if(filtered.channels == 4)
+                    filteredPixel[3] = 255;
+            }
+        }
+    });
+}
+
+void ImageProcessing::meanBlur(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination, const int kernelRadius)
+{
+    meanBlur(wrapImage(imageData, width, height, format), destination, kernelRadius);
+}
+
+QImage* ImageProcessing::meanBlur(const  uchar* imageData,const int width, const int height,const QImage::Format format, const int kernelRadius)
+{
+    QImage* filteredImage = new QImage();
+    meanBlur(imageData, width, height, format, *filteredImage, kernelRadius);
+    return filteredImage;
+}
+
+void ImageProcessing::gaussianBlur3x3(const QImage &image, QImage &destination)
+{
+    PROFILE_SCOPE("filter", "gaussian blur 3x3", (qint64)image.width()*image.height());
+    const int kernel[3] ={1,2,1};
+
+    applySeparableFilter(image, destination, 1, kernel, kernel, 16.0f);
+}
+
+void ImageProcessing::gaussianBlur3x3(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination)
+{
+    gaussianBlur3x3(wrapImage(imageData, width, height, format), destination);
 }
 
 QImage* ImageProcessing::gaussianBlur3x3(const  uchar* imageData,const int width, const int height,const QImage::Format format)
 {
-    const int kernel[9] ={1,2,1,
-                          2,4,2,
-                          1,2,1};
+    QImage* filteredImage = new QImage();
+    gaussianBlur3x3(imageData, width, height, format, *filteredImage);
+    return filteredImage;
+}
 
+void ImageProcessing::gaussianBlur5x5(const QImage &image, QImage &destination)
+{
+    PROFILE_SCOPE("filter", "gaussian blur 5x5", (qint64)image.width()*image.height());
+    const int kernel[5] ={1,4,6,4,1};
 
-    return applyFilter(imageData, width, height, format, 1, kernel, 16.0f , &ImageProcessing::applyConvolution);
+    applySeparableFilter(image, destination, 2, kernel, kernel, 246.0f);
 }
 
-QImage* ImageProcessing::gaussianBlur5x5(const  uchar* imageData,const int width, const int height,const QImage::Format format)
+void ImageProcessing::gaussianBlur5x5(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination)
 {
-    const int kernel[25] ={1,4,6,4,1,
-                          4,16,24,16,4,
-                          6,24,36,24,6,
-                          4,16,24,16,4,
-                           1,4,6,4,1};
+    gaussianBlur5x5(wrapImage(imageData, width, height, format), destination);
+}
 
-    return applyFilter(imageData, width, height, format, 2, kernel, 246.0f , &ImageProcessing::applyConvolution);
+QImage* ImageProcessing::gaussianBlur5x5(const  uchar* imageData,const int width, const int height,const QImage::Format format)
+{
+    QImage* filteredImage = new QImage();
+    gaussianBlur5x5(imageData, width, height, format, *filteredImage);
+    return filteredImage;
 }
 
-QImage* ImageProcessing::medianFilter(const uchar* imageData, const int width, const int height, QImage::Format format)
+/*
+Local contrast normalization: every channel is centered on the mean of the window and
+divided by its standard deviation, then mapped to 128 +/- 64 per standard deviation.
+The window statistics come from the summed-area table, so it can run in place.
+*/
+void ImageProcessing::localContrastNormalization(const QImage &image, QImage &destination, const int kernelRadius)
 {
-    QImage* filteredImage = new QImage(width,height, format);
-    uchar* filteredImageData = filteredImage->bits();
-    int kernelRadius = 1;
+    PROFILE_SCOPE("filter", "local contrast normalization", (qint64)image.width()*image.height());
+    if(kernelRadius > IntegralImage::maxRadius)
+    {
+        destination = QImage();
+        return;
+    }
+    const int radius = max(kernelRadius, 1);
+    const float minStandardDeviation = 1.0f;
+
+    QImage converted;
+    const QImage &input = supportedImage(image, converted);
+    const ImageView source(input);
+
+    const shared_ptr<const IntegralImage> integralImage = integralImageOf(image, source, true);
+    const int nbColors = integralImage->channelCount();
 
-    //list of neighborhood values
-    std::vector<int> medianList;
-    medianList.reserve(9);
-    for(int i=0; i<width; i++)
+    const MutableImageView filtered = prepareDestination(destination, source.width, source.height, input.format());
+    forEachRowBand(source.height, 0, [&](const int rowStart, const int rowEnd)
     {
-        for(int j=0; j<height; j++)
+        for(int y=rowStart; y<rowEnd; y++)
         {
-            medianList.clear();
-
-            for(int ki=-kernelRadius; ki<=kernelRadius; ki++)
+            const uchar* sourceRow = source.row(y);
+            uchar* filteredRow = filtered.row(y);
+            for(int x=0; x<source.width; x++)
             {
-                int x = fmax(fmin(i+ki,width-1),0);
-                for(int kj=-kernelRadius; kj<=kernelRadius; kj++)
+                float mean[IntegralImage::nbChannels];
+                float variance[IntegralImage::nbChannels];
+                integralImage->windowStatistics(x, y, radius, mean, variance);
+                const int i = source.channels*x;
+                for(int c=0; c<nbColors; c++)
                 {
-                    int y = fmax(fmin(j+kj,height-1),0);
-                    int index = 4*x+ y*width*4;
-                    medianList.push_back(imageData[index]);
+                    const float normalized = (sourceRow[i+c] - mean[c]) / max(sqrtf(variance[c]), minStandardDeviation);
+                    filteredRow[i+c] = min(max(128.0f + 64.0f*normalized, 0.0f), 255.0f);
                 }
+                if(filtered.channels == 4)
+                    filteredRow[i+3] = 255;
             }
-            // Find the median value
-            std::sort(medianList.begin(),medianList.end());
-            int medianValue = medianList[medianList.size()/2 ];
-            int id = 4*i+ j*width*4;
-            filteredImageData[id] = medianValue;
-            filteredImageData[id+1] = medianValue;
-            filteredImageData[id+2] = medianValue;
-            filteredImageData[id+3] = 255.0f;
         }
-    }
+    });
+}
+
+void ImageProcessing::localContrastNormalization(const uchar* imageData, const int width, const int height, const QImage::Format format,
+                                                 QImage &destination, const int kernelRadius)
+{
+    localContrastNormalization(wrapImage(imageData, width, height, format), destination, kernelRadius);
+}
+
+QImage* ImageProcessing::localContrastNormalization(const uchar* imageData, const int width, const int height, const QImage::Format format, const int kernelRadius)
+{
+    QImage* filteredImage = new QImage();
+    localContrastNormalization(imageData, width, height, format, *filteredImage, kernelRadius);
     return filteredImage;
 }
 
-QImage* ImageProcessing::variationFilter(const uchar* imageData, const int width, const int height, QImage::Format format)
+void ImageProcessing::medianFilter(const QImage &image, QImage &destination, const int kernelRadius)
 {
+    PROFILE_SCOPE("filter", "median", (qint64)image.width()*image.height());
+    QImage converted;
+    QImage sourceCopy;
+    const QImage &input = supportedImage(image, converted);
+    const ImageView source = separateSource(ImageView(input), destination, sourceCopy);
+    const MutableImageView filtered = prepareDestination(destination, source.width, source.height, input.format());
+    const int radius = min(max(kernelRadius, minMedianRadius), maxMedianRadius);
+    forEachRowBand(source.height, radius, [&](const int rowStart, const int rowEnd)
+    {
+        applyMedian(source, filtered, radius, rowStart, rowEnd);
+    });
+}
 
-    QImage* filteredImage = new QImage(width, height, format);
-    uchar* filteredImageData = filteredImage->bits();
+void ImageProcessing::medianFilter(const uchar* imageData, const int width, const int height, QImage::Format format, QImage &destination, const int kernelRadius)
+{
+    medianFilter(wrapImage(imageData, width, height, format), destination, kernelRadius);
+}
 
+QImage* ImageProcessing::medianFilter(const uchar* imageData, const int width, const int height, QImage::Format format, const int kernelRadius)
+{
+    QImage* filteredImage = new QImage();
+    medianFilter(imageData, width, height, format, *filteredImage, kernelRadius);
+    return filteredImage;
+}
 
-    int kernelRadius = 2;
-    int kernelSize = (kernelRadius*2+1)*(kernelRadius*2+1);
+/*
+Constant time median filter (Perreault and Hebert): every column keeps the histogram of
+its 2r+1 rows, updated with one add and one remove when moving down a row, and the
+kernel histogram is updated with one column in and one column out when moving right.
+Histograms are split in 16 coarse bins and 256 fine bins: the coarse kernel histogram
+is always up to date, a fine segment is only brought up to date when the median falls
+in it. Borders are replicated, each color channel is filtered separately.
+*/
+void ImageProcessing::applyMedian(const ImageView &source, const MutableImageView &destination, const int kernelRadius, const int rowStart, const int rowEnd)
+{
+    const int width = source.width;
+    const int height = source.height;
+    const int channels = source.channels;
+    const int nbColors = channels == 4 ? 3 : 1;
+    const int kernelWidth = 2*kernelRadius +1;
+    const int medianRank = kernelWidth*kernelWidth/2;
 
-    //list of neighborhood values
-    std::vector<float> neighborhoodValuesList;
-    neighborhoodValuesList.reserve(kernelSize);
+    PooledBuffer<quint16> columnCoarse(width*16);
+    PooledBuffer<quint16> columnFine(width*256);
+    auto column = [width](const int x) { return min(max(x, 0), width-1); };
+    auto row = [height](const int y) { return min(max(y, 0), height-1); };
 
-    for(int x=0; x<width; x++)
+    for(int c=0; c<nbColors; c++)
     {
-        for(int y=0; y<height; y++)
+        columnCoarse.fill(0);
+        columnFine.fill(0);
+
+        auto addRow = [&](const int y, const int delta)
         {
-            int id = 4*x+y*width*4;
-            QColor pixelColor = QColor(imageData[id],
-                                         imageData[id+1],
-                                         imageData[id+2]);
+            const uchar* sourceRow = source.row(row(y)) + c;
+            for(int x=0; x<width; x++)
+            {
+                const int value = sourceRow[channels*x];
+                columnCoarse[16*x + (value >> 4)] += delta;
+                columnFine[256*x + value] += delta;
+            }
+        };
 
-            float finalWeight=0.0f;
-            //finalColor is a float because the image is supposed to be grey (r = g = b)
-            float finalColor =0;
-            neighborhoodValuesList.clear();
+        for(int y=rowStart-kernelRadius; y<rowStart+kernelRadius; y++)
+        {
+            addRow(y, 1);
+        }
 
-            for(int i=-kernelRadius; i<=kernelRadius; i++)
+        for(int y=rowStart; y<rowEnd; y++)
+        {
+            // Slide the column histograms down, unless both rows are clamped to the same one
+            if(row(y - kernelRadius - 1) != row(y + kernelRadius) || y == rowStart)
             {
-                int xNeighbor = fmax(fmin(x+i, width-1), 0);
+                if(y > rowStart)
+                    addRow(y - kernelRadius - 1, -1);
+                addRow(y + kernelRadius, 1);
+            }
 
-                for(int j=-kernelRadius; j<=kernelRadius; j++)
-                {
-                    int yNeighbor = fmax(fmin(y+j, height-1), 0);
+            quint16 kernelCoarse[16] = {0};
+            quint16 kernelFine[256];
+            int fineColumn[16];
+            std::fill(fineColumn, fineColumn + 16, INT_MIN);
+            for(int x=-kernelRadius; x<=kernelRadius; x++)
+            {
+                const quint16* coarse = columnCoarse.data() + 16*column(x);
+                for(int k=0; k<16; k++)
+                    kernelCoarse[k] += coarse[k];
+            }
 
-                    float weight = 5.0f;
+            uchar* destinationRow = destination.row(y);
+            for(int x=0; x<width; x++)
+            {
+                if(x > 0)
+                {
+                    const quint16* in = columnCoarse.data() + 16*column(x + kernelRadius);
+                    const quint16* out = columnCoarse.data() + 16*column(x - kernelRadius - 1);
+                    for(int k=0; k<16; k++)
+                        kernelCoarse[k] += in[k] - out[k];
+                }
 
-                    int index = 4*xNeighbor+ yNeighbor*width*4;
-                    QColor neighborColor = QColor(imageData[index],
-                                                 imageData[index+1],
-                                                 imageData[index+2]);
+                // Coarse bin holding the median
+                int rank = medianRank;
+                int k = 0;
+                while(rank >= kernelCoarse[k])
+                {
+                    rank -= kernelCoarse[k];
+                    k++;
+                }
 
-                    if(pixelColor.red() != neighborColor.red())
+                // Bring the fine segment of this bin up to date
+                quint16* fine = kernelFine + 16*k;
+                if(fineColumn[k] == INT_MIN || x - fineColumn[k] > kernelWidth)
+                {
+                    std::fill(fine, fine + 16, 0);
+                    for(int xx=x-kernelRadius; xx<=x+kernelRadius; xx++)
+                    {
+                        const quint16* segment = columnFine.data() + 256*column(xx) + 16*k;
+                        for(int i=0; i<16; i++)
+                            fine[i] += segment[i];
+                    }
+                }
+                else
+                {
+                    for(int xx=fineColumn[k]+1; xx<=x; xx++)
                     {
-                        weight = abs(pixelColor.red() - neighborColor.red());
+                        const quint16* in = columnFine.data() + 256*column(xx + kernelRadius) + 16*k;
+                        const quint16* out = columnFine.data() + 256*column(xx - kernelRadius - 1) + 16*k;
+                        for(int i=0; i<16; i++)
+                            fine[i] += in[i] - out[i];
                     }
-                    neighborhoodValuesList.push_back(1.0/weight * neighborColor.red());
-                    finalWeight += 1.0/weight;
                 }
+                fineColumn[k] = x;
+
+                int i = 0;
+                while(rank >= fine[i])
+                {
+                    rank -= fine[i];
+                    i++;
+                }
+                destinationRow[channels*x + c] = 16*k + i;
+                if(c == 0 && channels == 4)
+                    destinationRow[4*x + 3] = 255;
             }
+        }
+    }
+}
+
+void ImageProcessing::variationFilter(const QImage &image, QImage &destination)
+{
+    PROFILE_SCOPE("filter", "variation", (qint64)image.width()*image.height());
+    QImage converted;
+    QImage sourceCopy;
+    const QImage &input = supportedImage(image, converted);
+    const ImageView source = separateSource(ImageView(input), destination, sourceCopy);
+    const MutableImageView filtered = prepareDestination(destination, source.width, source.height, input.format());
+    const int width = source.width;
+    const int height = source.height;
 
-            for(int k=0; k<(int)neighborhoodValuesList.size(); k++)
+    int kernelRadius = 2;
+    int kernelSize = (kernelRadius*2+1)*(kernelRadius*2+1);
+
+    auto colorAt = [&](const int x, const int y)
+    {
+        const uchar* pixel = source.row(y) + source.channels*x;
+        return source.channels == 4 ? QColor(pixel[0], pixel[1], pixel[2]) : QColor(pixel[0], pixel[0], pixel[0]);
+    };
+
+    forEachRowBand(height, kernelRadius, [&](const int rowStart, const int rowEnd)
+    {
+        //list of neighborhood values
+        std::vector<float> neighborhoodValuesList;
+        neighborhoodValuesList.reserve(kernelSize);
+
+        for(int y=rowStart; y<rowEnd; y++)
+        {
+            for(int x=0; x<width; x++)
             {
-                finalColor = finalColor + neighborhoodValuesList[k] /(finalWeight);
-            }
+                QColor pixelColor = colorAt(x, y);
+
+                float finalWeight=0.0f;
+                //finalColor is a float because the image is supposed to be grey (r = g = b)
+                float finalColor =0;
+                neighborhoodValuesList.clear();
+
+                for(int i=-kernelRadius; i<=kernelRadius; i++)
+                {
+                    int xNeighbor = fmax(fmin(x+i, width-1), 0);
+
+                    for(int j=-kernelRadius; j<=kernelRadius; j++)
+                    {
+                        int yNeighbor = fmax(fmin(y+j, height-1), 0);
+
+                        float weight = 5.0f;
+
+                        QColor neighborColor = colorAt(xNeighbor, yNeighbor);
+
+                        if(pixelColor.red() != neighborColor.red())
+                        {
+                            weight = abs(pixelColor.red() - neighborColor.red());
+                        }
+                        neighborhoodValuesList.push_back(1.0/weight * neighborColor.red());
+                        finalWeight += 1.0/weight;
+                    }
+                }
+
+                for(int k=0; k<(int)neighborhoodValuesList.size(); k++)
+                {
+                    finalColor = finalColor + neighborhoodValuesList[k] /(finalWeight);
+                }
 
-            filteredImageData[id] = finalColor;
-            filteredImageData[id+1] = finalColor;
-            filteredImageData[id+2] = finalColor;
-            filteredImageData[id+3] = 255.0f;
+                uchar* filteredPixel = filtered.row(y) + filtered.channels*x;
+                filteredPixel[0] = finalColor;
+                if(filtered.channels == 4)
+                {
+                    filteredPixel[1] = finalColor;
+                    filteredPixel[2] = finalColor;
+                    filteredPixel[3] = 255.0f;
+                }
+            }
         }
-    }
+    });
+}
+
+void ImageProcessing::variationFilter(const uchar* imageData, const int width, const int height, QImage::Format format, QImage &destination)
+{
+    variationFilter(wrapImage(imageData, width, height, format), destination);
+}
 
+QImage* ImageProcessing::variationFilter(const uchar* imageData, const int width, const int height, QImage::Format format)
+{
+    QImage* filteredImage = new QImage();
+    variationFilter(imageData, width, height, format, *filteredImage);
     return filteredImage;
 }
 
-void ImageProcessing::computeHistogram(const uchar* imageData, const int width, const int height,std::vector<float> *greyHistogram)
+// With a result cache, an image whose pixels did not change is not read again
+void ImageProcessing::computeHistograms(const QImage &image, ImageHistograms &histograms)
 {
+    PROFILE_SCOPE("filter", "histograms", (qint64)image.width()*image.height());
+    ResultCache::Hash hash;
+    if(resultCache)
+    {
+        hash = resultCache->contentHash(image);
+        const shared_ptr<const ImageHistograms> cached = resultCache->histograms(hash);
+        if(cached)
+        {
+            histograms = *cached;
+            return;
+        }
+    }
 
-    const int nbThreads = 4;
-    vector<thread> threads;
+    QImage converted;
+    const ImageView source(supportedImage(image, converted));
+    const qint64 imageSize = (qint64)source.width*source.height;
+    const int nbSections = max(1, (int)min<qint64>(min(threadCount(), source.height), imageSize / 65536));
+
+    //sectionHistograms[sectionId] = histograms computed for the section of id sectionId
+    vector<ImageHistograms> sectionHistograms(nbSections);
+
+    ThreadPool::instance().parallelFor(nbSections, [&](const int id)
+    {
+        fillHistograms(source, id*source.height/nbSections, (id+1)*source.height/nbSections, sectionHistograms[id]);
+    });
 
-    //histogramVector[threadId] = grayHistogram computed for the thread of id threadId
-    vector< vector<float> *> *grayHistograms = new vector< vector<float> *>(nbThreads);
+    // Add all values computed by the sections to get the final value
+    memset(&histograms, 0, sizeof(histograms));
+    for(int i=0; i< nbSections; i++)
+    {
+        for(int c=0; c<ImageHistograms::NbChannels; c++)
+        {
+            for(int j=0; j< 256; j++)
+            {
+                histograms.counts[c][j] += sectionHistograms[i].counts[c][j];
+            }
+        }
+    }
+    if(resultCache)
+        resultCache->insertHistograms(hash, histograms);
+}
 
-    int imageSize = width*height;
-    int sectionSize = width*height/nbThreads +1;
-    int sectionStart = 0;
-    int sectionEnd = 0;
+// 4 bytes per pixel, rows of width*4 bytes
+void ImageProcessing::computeHistograms(const uchar* imageData, const int width, const int height, ImageHistograms &histograms)
+{
+    computeHistograms(wrapImage(imageData, width, height, QImage::Format_ARGB32), histograms);
+}
 
-    for(int id = 0 ; id < nbThreads;  id++   )
+/*
+Count the pixels of the rows [rowStart, rowEnd). Consecutive pixels often have the same
+value, so they are counted in 4 interleaved banks: an increment never has to wait for
+the store of the previous one to the same counter. The banks are summed at the end.
+A grayscale pixel v counts as (v, v, v, 255), whose luma is v.
+*/
+void ImageProcessing::fillHistograms(const ImageView &image, const int rowStart, const int rowEnd, ImageHistograms &histograms)
+{
+    const int nbBanks = 4;
+    vector<quint32> banks(nbBanks*ImageHistograms::NbChannels*256, 0);
+    quint32* bank[nbBanks];
+    for(int k=0; k<nbBanks; k++)
     {
-        grayHistograms->at(id) = new vector<float>(256,0.0f);
-        sectionStart =  min(id *sectionSize, imageSize);
-        sectionEnd = min(sectionStart + sectionSize, imageSize);
-        threads.push_back(thread(fillHistogram,imageData,sectionStart,sectionEnd,std::ref(grayHistograms),id));
+        bank[k] = banks.data() + k*ImageHistograms::NbChannels*256;
     }
 
-    for_each(threads.begin(),threads.end(),
-        mem_fn(&thread::join));
+    auto count = [](quint32* counters, const uchar* pixel)
+    {
+        counters[pixel[0]]++;
+        counters[256 + pixel[1]]++;
+        counters[2*256 + pixel[2]]++;
+        counters[3*256 + pixel[3]]++;
+        counters[4*256 + SimdKernels::luma(pixel)]++;
+    };
+    auto countGray = [](quint32* counters, const uchar* pixel)
+    {
+        counters[4*256 + pixel[0]]++;
+    };
 
-    // Add all values computed by the threads to get the final value
-    for(int i=0; i< nbThreads; i++)
+    for(int y=rowStart; y<rowEnd; y++)
     {
-        for(int j=0; j< 256; j++)
+        const uchar* row = image.row(y);
+        int x = 0;
+        if(image.channels == 4)
         {
-            (*greyHistogram)[j] += grayHistograms->at(i)->at(j);
+            for(; x + nbBanks <= image.width; x += nbBanks)
+            {
+                const uchar* pixel = row + 4*x;
+                count(bank[0], pixel);
+                count(bank[1], pixel + 4);
+                count(bank[2], pixel + 8);
+                count(bank[3], pixel + 12);
+            }
+            for(; x < image.width; x++)
+            {
+                count(bank[0], row + 4*x);
+            }
+        }
+        else
+        {
+            for(; x + nbBanks <= image.width; x += nbBanks)
+            {
+                countGray(bank[0], row + x);
+                countGray(bank[1], row + x + 1);
+                countGray(bank[2], row + x + 2);
+                countGray(bank[3], row + x + 3);
+            }
+            for(; x < image.width; x++)
+            {
+                countGray(bank[0], row + x);
+            }
         }
+    }
 
+    for(int c=0; c<ImageHistograms::NbChannels; c++)
+    {
+        for(int j=0; j<256; j++)
+        {
+            const int index = c*256 + j;
+            histograms.counts[c][j] = bank[0][index] + bank[1][index] + bank[2][index] + bank[3][index];
+        }
     }
 
+    if(image.channels == 1)
+    {
+        for(int c=ImageHistograms::Red; c<=ImageHistograms::Blue; c++)
+        {
+            memcpy(histograms.counts[c], histograms.counts[ImageHistograms::Luma], sizeof(histograms.counts[c]));
+        }
+        histograms.counts[ImageHistograms::Alpha][255] = (quint32)image.width*(rowEnd - rowStart);
+    }
 }
 
-void ImageProcessing::fillHistogram(const uchar* imageData, const int sectionStart,const int sectionEnd, std::vector< std::vector<float> *> * grayHistograms, const int threadId)
+void ImageProcessing::computeHistogram(const QImage &image, std::vector<float> *greyHistogram)
 {
-    if(sectionStart < sectionEnd)
+    ImageHistograms histograms;
+    computeHistograms(image, histograms);
+    for(int j=0; j< 256; j++)
     {
-        for(int i = sectionStart ; i < sectionEnd; i= i+1 )
-        {
-             grayHistograms->at(threadId)->at(imageData[4*i]) +=1;
-        }
+        (*greyHistogram)[j] += histograms.counts[ImageHistograms::Red][j];
     }
 }
 
-void ImageProcessing::cumulativeHistogram(const uchar* imageData, const int width, const int height,std::vector<float> *greyHistogram)
+void ImageProcessing::computeHistogram(const uchar* imageData, const int width, const int height,std::vector<float> *greyHistogram)
 {
-   computeHistogram(imageData, width,height, greyHistogram);
+    computeHistogram(wrapImage(imageData, width, height, QImage::Format_ARGB32), greyHistogram);
+}
+
+void ImageProcessing::cumulativeHistogram(const QImage &image, std::vector<float> *greyHistogram)
+{
+   computeHistogram(image, greyHistogram);
    for(int i = 0 ; i < 256; i++ )
    {
       (* greyHistogram)[i] +=  (i-1)>= 0 ? greyHistogram->at(i-1) : 0 ;
    }
 }
 
-QImage* ImageProcessing::gradientThreshold(const  uchar* imageData,const int width, const int height,const QImage::Format format)
+void ImageProcessing::cumulativeHistogram(const uchar* imageData, const int width, const int height,std::vector<float> *greyHistogram)
 {
-    QImage* filteredImage = gradientFilter(imageData,width,height,format);
-    vector<float> *greyHistogram = new vector<float>(256,0.0f);
-    cumulativeHistogram(filteredImage->constBits(),filteredImage->width(),filteredImage->height(),greyHistogram);
-    int i=0;
-    float percentageOfPixels = 0.95f;
-    while(i<256 && greyHistogram->at(i)/(width*height) < percentageOfPixels )
-    {
-        i++;
-    }
-    int threshold = i;
-    uchar* filteredImageData = filteredImage->bits();
-    for(int i=0; i<width*height *4; i = i+4)
+    cumulativeHistogram(wrapImage(imageData, width, height, QImage::Format_ARGB32), greyHistogram);
+}
+
+/*
+Gradient magnitude binarized at the value reached by percentageOfPixels of the pixels.
+The histogram of the magnitudes is counted while they are computed, so the image is only
+read again by the binarization.
+*/
+void ImageProcessing::gradientThreshold(const QImage &image, QImage &destination, const float percentageOfPixels)
+{
+    PROFILE_SCOPE("filter", "gradient threshold", (qint64)image.width()*image.height());
+    QImage converted;
+    QImage sourceCopy;
+    const QImage &input = supportedImage(image, converted);
+    const ImageView source = separateSource(ImageView(input), destination, sourceCopy);
+    const MutableImageView filtered = prepareDestination(destination, source.width, source.height, input.format());
+
+    const int threshold = gradientHistogramThreshold(source, filtered, percentageOfPixels);
+
+    forEachRowBand(source.height, 0, [&](const int rowStart, const int rowEnd)
     {
-        if(filteredImageData[i] < threshold)
+        for(int y=rowStart; y<rowEnd; y++)
         {
-            //red
-            filteredImageData[i]= 0;
-            //green
-            filteredImageData[i+1]= 0;
-            //blue
-            filteredImageData[i+2]= 0;
-            //alpha
-            filteredImageData[i+3]= 255;
-        }
-        else
-        {
-            //red
-            filteredImageData[i]= 255;
-            //green
-            filteredImageData[i+1]= 255;
-            //blue
-            filteredImageData[i+2]= 255;
-            //alpha
-            filteredImageData[i+3]= 255;
+            uchar* row = filtered.row(y);
+            if(filtered.channels == 1)
+            {
+                for(int x=0; x<filtered.width; x++)
+                {
+                    row[x] = row[x] < threshold ? 0 : 255;
+                }
+                continue;
+            }
+            for(int i=0; i<filtered.width*4; i+=4)
+            {
+                const uchar value = row[i] < threshold ? 0 : 255;
+                row[i] = value;
+                row[i+1] = value;
+                row[i+2] = value;
+                row[i+3] = 255;
+            }
         }
-    }
+    });
+}
+
+void ImageProcessing::gradientThreshold(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination,
+                                        const float percentageOfPixels)
+{
+    gradientThreshold(wrapImage(imageData, width, height, format), destination, percentageOfPixels);
+}
+
+QImage* ImageProcessing::gradientThreshold(const  uchar* imageData,const int width, const int height,const QImage::Format format,
+                                           const float percentageOfPixels)
+{
+    QImage* filteredImage = new QImage();
+    gradientThreshold(imageData, width, height, format, *filteredImage, percentageOfPixels);
     return filteredImage;
 }
 
-QImage* ImageProcessing::gradientFilter(const  uchar* imageData,const int width, const int height,const QImage::Format format)
+void ImageProcessing::gradientThresholdMask(const QImage &image, QImage &destination, const float percentageOfPixels)
 {
-    // c = 2 : Sobel ; c = 1 : Prewitt
-    const int c = 2;
-    const int kernelX[9] ={-1,0,1,
-                          -c,0,c,
-                          -1,0,1};
+    PROFILE_SCOPE("filter", "gradient threshold mask", (qint64)image.width()*image.height());
+    QImage converted;
+    QImage sourceCopy;
+    const ImageView source = separateSource(ImageView(supportedImage(image, converted)), destination, sourceCopy);
+    const MutableImageView mask = prepareDestination(destination, source.width, source.height, QImage::Format_Grayscale8);
 
-    const int kernelY[9] ={-1,-c,-1,
-                           0,0,0,
-                           1,c,1};
-    const int kernelRadius = 1;
-    const int kernelWidth = 3;
+    const int threshold = gradientHistogramThreshold(source, mask, percentageOfPixels);
 
-    QImage* imageFiltered = new QImage(width, height,format);
-    uchar* imageFilteredData = imageFiltered->bits();
-    for(int i= 0 ; i<width; i++)
+    forEachRowBand(source.height, 0, [&](const int rowStart, const int rowEnd)
     {
-        for(int j= 0 ; j<height; j++)
+        for(int y=rowStart; y<rowEnd; y++)
         {
-            float gradientX[3] = {0.0f,0.0f,0.0f};
-            float gradientY[3] = {0.0f,0.0f,0.0f};
-            for(int ki=-kernelRadius; ki<=kernelRadius; ki++)
+            uchar* row = mask.row(y);
+            for(int x=0; x<mask.width; x++)
             {
-                int x_k = ki+ kernelRadius;
-                int x = fmax(fmin(i+ki,width-1),0);
-                for(int kj=-kernelRadius; kj<=kernelRadius; kj++)
-                {
-                    int y_k = kj+ kernelRadius;
-                    int y = fmax(fmin(j+kj,height-1),0);
+                row[x] = row[x] < threshold ? 0 : 255;
+            }
+        }
+    });
+}
+
+// 4 bytes per pixel, rows of width*4 bytes
+void ImageProcessing::gradientThresholdMask(const uchar* imageData, const int width, const int height, QImage &destination, const float percentageOfPixels)
+{
+    gradientThresholdMask(wrapImage(imageData, width, height, QImage::Format_ARGB32), destination, percentageOfPixels);
+}
+
+QImage* ImageProcessing::gradientThresholdMask(const uchar* imageData, const int width, const int height, const float percentageOfPixels)
+{
+    QImage* mask = new QImage();
+    gradientThresholdMask(imageData, width, height, *mask, percentageOfPixels);
+    return mask;
+}
+
+/*
+Write the gradient magnitude of the image into destination (all the bytes of the source
+pixels, or only the first one for a 1 byte per pixel destination) and return the smallest
+value i such that at least percentageOfPixels of the pixels have a first byte <= i (256 if
+there is none).
+The bands count their own histogram, the counts are summed at the end.
+*/
+int ImageProcessing::gradientHistogramThreshold(const ImageView &source, const MutableImageView &destination, const float percentageOfPixels)
+{
+    mutex histogramMutex;
+    quint32 histogram[256] = {};
+    forEachRowBand(source.height, 1, [&](const int rowStart, const int rowEnd)
+    {
+        quint32 bandHistogram[256] = {};
+        applyGradientHistogram(source, destination, SimdKernels::MagnitudeL2, bandHistogram, rowStart, rowEnd);
+        lock_guard<mutex> lock(histogramMutex);
+        for(int j=0; j<256; j++)
+        {
+            histogram[j] += bandHistogram[j];
+        }
+    });
+
+    return histogramThreshold(histogram, (qint64)source.width*source.height, percentageOfPixels);
+}
+
+/*
+Smallest value i such that at least percentageOfPixels of the nbPixels counted in histogram
+are <= i, 256 if there is none.
+*/
+int ImageProcessing::histogramThreshold(const quint32 histogram[], const qint64 nbPixels, const float percentageOfPixels)
+{
+    // Same comparison as the ratio of the cumulative histogram, with exact counts
+    qint64 cumulative = 0;
+    int i=0;
+    while(i<256 && (float)(cumulative + histogram[i]) / nbPixels < percentageOfPixels)
+    {
+        cumulative += histogram[i];
+        i++;
+    }
+    return i;
+}
 
-                    int index = 4*x + y*width *4;
-                    int red = imageData[index];
-                    int green = imageData[index +1] ;
-                    int blue = imageData[index +2] ;
+void ImageProcessing::gradientFilter(const QImage &image, QImage &destination, const SimdKernels::GradientMagnitude magnitude, QImage* orientation)
+{
+    PROFILE_SCOPE("filter", "gradient", (qint64)image.width()*image.height());
+    QImage converted;
+    QImage sourceCopy;
+    const QImage &input = supportedImage(image, converted);
+    const ImageView source = separateSource(ImageView(input), destination, sourceCopy);
+    const MutableImageView filtered = prepareDestination(destination, source.width, source.height, input.format());
+
+    uchar* orientationData = nullptr;
+    qsizetype orientationStride = 0;
+    if(orientation != nullptr)
+    {
+        if(orientation->size() != QSize(source.width, source.height) || orientation->format() != QImage::Format_Grayscale8)
+            *orientation = ImageBufferPool::instance().image(source.width, source.height, QImage::Format_Grayscale8);
+        orientationData = orientation->bits();
+        orientationStride = orientation->bytesPerLine();
+    }
 
-                    float h = kernelX[x_k + y_k*kernelWidth];
-                    float hY = kernelY[x_k + y_k*kernelWidth];
+    forEachRowBand(source.height, 1, [&](const int rowStart, const int rowEnd)
+    {
+        applyGradient(source, filtered, magnitude, orientationData, orientationStride, rowStart, rowEnd);
+    });
+}
 
-                    gradientX[0]+= (red * h);
-                    gradientX[1]+=(green * h);
-                    gradientX[2]+=(blue * h);
+void ImageProcessing::gradientFilter(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination,
+                                     const SimdKernels::GradientMagnitude magnitude, QImage* orientation)
+{
+    gradientFilter(wrapImage(imageData, width, height, format), destination, magnitude, orientation);
+}
 
-                    gradientY[0]+= (red * hY);
-                    gradientY[1]+=(green * hY);
-                    gradientY[2]+=(blue * hY);
+QImage* ImageProcessing::gradientFilter(const  uchar* imageData,const int width, const int height,const QImage::Format format,
+                                        const SimdKernels::GradientMagnitude magnitude, QImage* orientation)
+{
+    QImage* imageFiltered = new QImage();
+    gradientFilter(imageData, width, height, format, *imageFiltered, magnitude, orientation);
+    return imageFiltered;
+}
+
+/*
+Run rowFunction(y, above, row, below) for the rows [rowStart, rowEnd): the 3 source rows
+of the Sobel window are kept as padded rows, starting at pixel -1.
+*/
+template<typename RowFunction>
+static void forEachSobelWindow(const ImageView &source, const int rowStart, const int rowEnd, RowFunction rowFunction)
+{
+    const int width = source.width;
+    const int height = source.height;
+    const int paddedRowBytes = (width + 2)*source.channels;
+    PooledBuffer<uchar> ring(3*paddedRowBytes);
+    auto slot = [&](const int s) { return ring.data() + ((s + 1) % 3)*paddedRowBytes; };
+
+    for(int s = rowStart-1; s < rowStart+1; s++)
+    {
+        loadPaddedRow(source.row(min(max(s, 0), height-1)), width, source.channels, 0, width, 1, slot(s));
+    }
 
+    for(int y=rowStart; y<rowEnd; y++)
+    {
+        loadPaddedRow(source.row(min(y+1, height-1)), width, source.channels, 0, width, 1, slot(y+1));
+        rowFunction(y, slot(y-1), slot(y), slot(y+1));
+    }
+}
+
+/*
+Fused Sobel gradient: SimdKernels::sobelRow computes Gx, Gy and the magnitude of every
+color byte of a row in one sweep.
+The orientation, if requested, is the angle of the gradient summed over the color
+channels, from 0 to 255 for [-pi, pi).
+*/
+void ImageProcessing::applyGradient(const ImageView &source, const MutableImageView &destination, const SimdKernels::GradientMagnitude magnitude,
+                                    uchar *orientation, const qsizetype orientationStride, const int rowStart, const int rowEnd)
+{
+    const int step = source.channels;
+    const int nbColors = step == 4 ? 3 : 1;
+    forEachSobelWindow(source, rowStart, rowEnd, [&](const int y, const uchar* above, const uchar* row, const uchar* below)
+    {
+        SimdKernels::sobelRow(above, row, below, destination.row(y), source.width, magnitude, step);
+
+        if(orientation != nullptr)
+        {
+            uchar* orientationRow = orientation + y*orientationStride;
+            for(int x=0; x<source.width; x++)
+            {
+                int gradientX = 0;
+                int gradientY = 0;
+                for(int c=0; c<nbColors; c++)
+                {
+                    const int i = step*x + c;
+                    gradientX += (above[i+2*step] - above[i]) + 2*(row[i+2*step] - row[i]) + (below[i+2*step] - below[i]);
+                    gradientY += (below[i] + 2*below[i+step] + below[i+2*step]) - (above[i] + 2*above[i+step] + above[i+2*step]);
                 }
+                const float angle = atan2f(gradientY, gradientX);
+                orientationRow[x] = (int)lroundf((angle + (float)M_PI) * (256.0f / (2.0f*(float)M_PI))) & 255;
             }
-            gradientX[0] /= (c+2);
-            gradientX[1] /= (c+2);
-            gradientX[2] /= (c+2);
-
-            gradientY[0] /= (c+2);
-            gradientY[1] /= (c+2);
-            gradientY[2] /= (c+2);
-
-            int id = 4*i + j*width *4;
-            //red
-            imageFilteredData[id] = sqrt(pow(gradientX[0],2)+pow(gradientY[0],2));
-            //green
-            imageFilteredData[id+1] = sqrt(pow(gradientX[1],2)+pow(gradientY[1],2));
-            //blue
-            imageFilteredData[id+2] =sqrt(pow(gradientX[2],2)+pow(gradientY[2],2));
-            //alpha
-            imageFilteredData[id+3] = 255.0f;
+        }
+    });
+}
 
+/*
+Sobel gradient magnitude counted in histogram (first byte of the pixels) as the rows are
+written, while they are still in cache. A 1 byte per pixel destination of a 4 bytes per
+pixel source only gets the first byte of the magnitude, the full row goes through a
+scratch row of the band.
+*/
+void ImageProcessing::applyGradientHistogram(const ImageView &source, const MutableImageView &destination, const SimdKernels::GradientMagnitude magnitude,
+                                             quint32 histogram[], const int rowStart, const int rowEnd)
+{
+    const int width = source.width;
+    const bool firstByteOnly = destination.channels != source.channels;
+    PooledBuffer<uchar> scratchRow(firstByteOnly ? width*source.channels : 0);
+    forEachSobelWindow(source, rowStart, rowEnd, [&](const int y, const uchar* above, const uchar* row, const uchar* below)
+    {
+        uchar* destinationRow = destination.row(y);
+        if(!firstByteOnly)
+        {
+            SimdKernels::sobelRow(above, row, below, destinationRow, width, magnitude, source.channels);
+            for(int x=0; x<width; x++)
+            {
+                histogram[destinationRow[destination.channels*x]]++;
+            }
         }
-    }
-    return imageFiltered;
+        else
+        {
+            SimdKernels::sobelRow(above, row, below, scratchRow.data(), width, magnitude, source.channels);
+            for(int x=0; x<width; x++)
+            {
+                destinationRow[x] = scratchRow[source.channels*x];
+                histogram[destinationRow[x]]++;
+            }
+        }
+    });
 }
 
-QImage* ImageProcessing::horizontalSobelGradientFilter(const  uchar* imageData,const int width, const int height,const QImage::Format format)
+void ImageProcessing::horizontalSobelGradientFilter(const QImage &image, QImage &destination)
 {
+    PROFILE_SCOPE("filter", "horizontal sobel", (qint64)image.width()*image.height());
     const int c = 2;
 
     const int kernel[9] ={-1,0,1,
@@ -356,71 +1108,283 @@ QImage* ImageProcessing::horizontalSobelGradientFilter(const  uchar* imageData,c
                           -1,0,1};
 
 
-    return applyFilter(imageData, width, height, format, 1, kernel, c+2 , &ImageProcessing::applyConvolution);
+    applyFilter(image, destination, 1, kernel, c+2);
 }
 
-QImage* ImageProcessing::verticalSobelGradientFilter(const  uchar* imageData,const int width, const int height,const QImage::Format format)
+void ImageProcessing::horizontalSobelGradientFilter(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination)
+{
+    horizontalSobelGradientFilter(wrapImage(imageData, width, height, format), destination);
+}
+
+QImage* ImageProcessing::horizontalSobelGradientFilter(const  uchar* imageData,const int width, const int height,const QImage::Format format)
+{
+    QImage* imageFiltered = new QImage();
+    horizontalSobelGradientFilter(imageData, width, height, format, *imageFiltered);
+    return imageFiltered;
+}
+
+void ImageProcessing::verticalSobelGradientFilter(const QImage &image, QImage &destination)
 {
+    PROFILE_SCOPE("filter", "vertical sobel", (qint64)image.width()*image.height());
     const int c = 2;
 
     const int kernel[9] ={-1,-c,-1,
                            0,0,0,
                            1,c,1};
 
-    return applyFilter(imageData, width, height, format, 1, kernel, c+2 , &ImageProcessing::applyConvolution);
+    applyFilter(image, destination, 1, kernel, c+2);
+}
+
+void ImageProcessing::verticalSobelGradientFilter(const uchar* imageData, const int width, const int height, const QImage::Format format, QImage &destination)
+{
+    verticalSobelGradientFilter(wrapImage(imageData, width, height, format), destination);
 }
 
-QImage* ImageProcessing::applyFilter(const uchar *imageData, const int width, const int height, const QImage::Format format, const int kernelRadius, const int kernel[], const float kernelParameter,
-                                          QColor (*convolution)(const uchar *,const int, const int,
-                                                               const int , const int[], const float ,const int ,
-                                                               const int ,const int ))
+QImage* ImageProcessing::verticalSobelGradientFilter(const  uchar* imageData,const int width, const int height,const QImage::Format format)
 {
+    QImage* imageFiltered = new QImage();
+    verticalSobelGradientFilter(imageData, width, height, format, *imageFiltered);
+    return imageFiltered;
+}
+
+void ImageProcessing::applyFilter(const QImage &image, QImage &destination, const int kernelRadius, const int kernel[], const float kernelParameter)
+{
+    PROFILE_SCOPE("filter", "convolution", (qint64)image.width()*image.height());
     const int kernelWidth = 2*kernelRadius +1;
-    QImage* imageFiltered = new QImage(width, height, format);
-    uchar* imageFilteredData = imageFiltered->bits();
+    vector<int> rowKernel(kernelWidth);
+    vector<int> columnKernel(kernelWidth);
+    if(isSeparable(kernel, kernelWidth, rowKernel.data(), columnKernel.data()))
+    {
+        applySeparableFilter(image, destination, kernelRadius, rowKernel.data(), columnKernel.data(), kernelParameter);
+        return;
+    }
+
+    QImage converted;
+    QImage sourceCopy;
+    const QImage &input = supportedImage(image, converted);
+    const ImageView source = separateSource(ImageView(input), destination, sourceCopy);
+    const MutableImageView filtered = prepareDestination(destination, source.width, source.height, input.format());
+    forEachRowBand(source.height, kernelRadius, [&](const int rowStart, const int rowEnd)
+    {
+        applyConvolution(source, filtered, kernelRadius, kernel, kernelParameter, rowStart, rowEnd);
+    });
+}
+
+void ImageProcessing::applyFilter(const uchar *imageData, const int width, const int height, const QImage::Format format, QImage &destination,
+                                  const int kernelRadius, const int kernel[], const float kernelParameter)
+{
+    applyFilter(wrapImage(imageData, width, height, format), destination, kernelRadius, kernel, kernelParameter);
+}
+
+QImage* ImageProcessing::applyFilter(const uchar *imageData, const int width, const int height, const QImage::Format format, const int kernelRadius, const int kernel[], const float kernelParameter)
+{
+    QImage* imageFiltered = new QImage();
+    applyFilter(imageData, width, height, format, *imageFiltered, kernelRadius, kernel, kernelParameter);
+    return imageFiltered;
+}
+
+void ImageProcessing::applySeparableFilter(const QImage &image, QImage &destination, const int kernelRadius,
+                                           const int rowKernel[], const int columnKernel[], const float kernelParameter)
+{
+    PROFILE_SCOPE("filter", "separable convolution", (qint64)image.width()*image.height());
+    QImage converted;
+    QImage sourceCopy;
+    const QImage &input = supportedImage(image, converted);
+    const ImageView source = separateSource(ImageView(input), destination, sourceCopy);
+    const MutableImageView filtered = prepareDestination(destination, source.width, source.height, input.format());
+    forEachRowBand(source.height, kernelRadius, [&](const int rowStart, const int rowEnd)
+    {
+        applySeparableConvolution(source, filtered, kernelRadius, rowKernel, columnKernel, kernelParameter, rowStart, rowEnd);
+    });
+}
+
+void ImageProcessing::applySeparableFilter(const uchar *imageData, const int width, const int height, const QImage::Format format, QImage &destination,
+                                           const int kernelRadius, const int rowKernel[], const int columnKernel[], const float kernelParameter)
+{
+    applySeparableFilter(wrapImage(imageData, width, height, format), destination, kernelRadius, rowKernel, columnKernel, kernelParameter);
+}
+
+QImage* ImageProcessing::applySeparableFilter(const uchar *imageData, const int width, const int height, const QImage::Format format, const int kernelRadius,
+                                              const int rowKernel[], const int columnKernel[], const float kernelParameter)
+{
+    QImage* imageFiltered = new QImage();
+    applySeparableFilter(imageData, width, height, format, *imageFiltered, kernelRadius, rowKernel, columnKernel, kernelParameter);
+    return imageFiltered;
+}
 
-    for(int x= 0 ; x<width; x++)
+/*
+An integer kernel is separable when it is the outer product columnKernel x rowKernel.
+rowKernel is taken from the first non zero row, reduced by the gcd of its values, so
+that columnKernel stays integer and the separable sums are exactly the 2D ones.
+*/
+bool ImageProcessing::isSeparable(const int kernel[], const int kernelWidth, int rowKernel[], int columnKernel[])
+{
+    int pivotRow = 0;
+    while(pivotRow < kernelWidth && std::all_of(kernel + pivotRow*kernelWidth, kernel + (pivotRow+1)*kernelWidth, [](int h) { return h == 0; }))
     {
-        for(int y= 0 ; y<height; y++)
+        pivotRow++;
+    }
+    if(pivotRow == kernelWidth)
+        return false;
+
+    const int* pivot = kernel + pivotRow*kernelWidth;
+    int divisor = 0;
+    int pivotColumn = 0;
+    for(int i=0; i<kernelWidth; i++)
+    {
+        divisor = std::gcd(divisor, pivot[i]);
+        if(pivot[i] != 0 && pivot[pivotColumn] == 0)
+            pivotColumn = i;
+    }
+    for(int i=0; i<kernelWidth; i++)
+    {
+        rowKernel[i] = pivot[i] / divisor;
+    }
+
+    for(int j=0; j<kernelWidth; j++)
+    {
+        const int* row = kernel + j*kernelWidth;
+        if(row[pivotColumn] % rowKernel[pivotColumn] != 0)
+            return false;
+        columnKernel[j] = row[pivotColumn] / rowKernel[pivotColumn];
+        for(int i=0; i<kernelWidth; i++)
         {
-            QColor color = convolution(imageData,width,height,kernelRadius,kernel,kernelParameter,kernelWidth,x,y);
-            int index = 4*x + y * width*4 ;
-            imageFilteredData[index] = color.red();
-            imageFilteredData[index +1] = color.green();
-            imageFilteredData[index +2] = color.blue();
-            imageFilteredData[index +3] = color.alpha();
+            if(row[i] != columnKernel[j] * rowKernel[i])
+                return false;
         }
     }
-    return imageFiltered;
+    return true;
 }
 
-// A simple convolution function
-QColor ImageProcessing::applyConvolution(const uchar *imageData,const int width, const int height,
-                                               const int kernelRadius, const int kernel[], const float kernelParameter,const int kernelWidth,
-                                               const int x,const int y)
+/*
+Separable convolution: a horizontal pass with rowKernel fills a ring of (2r+1) rows of
+sums, then a vertical pass with columnKernel combines them, i.e. 2(2r+1) taps per pixel
+instead of (2r+1)^2. The image is processed in column blocks so that the ring stays in cache.
+*/
+void ImageProcessing::applySeparableConvolution(const ImageView &source, const MutableImageView &destination, const int kernelRadius,
+                                                const int rowKernel[], const int columnKernel[], const float kernelParameter,
+                                                const int rowStart, const int rowEnd)
 {
-    int r = 0;
-    int g = 0;
-    int b = 0;
+    const int width = source.width;
+    const int height = source.height;
+    const int channels = source.channels;
+    const int kernelWidth = 2*kernelRadius +1;
+    const int ringBytes = 256*1024;
+    const int blockWidth = min(width, max(64, ringBytes / (kernelWidth * channels * (int)sizeof(int))));
+
+    PooledBuffer<uchar> paddedRow((blockWidth + 2*kernelRadius)*channels);
+    PooledBuffer<int> ring(kernelWidth * blockWidth*channels);
+    PooledBuffer<int> accumulator(blockWidth*channels);
 
-    for(int kx=-kernelRadius; kx<=kernelRadius; kx++)
+    for(int x0=0; x0<width; x0+=blockWidth)
     {
-        int iKernel = kx + kernelRadius;
-        //index i of the neighboor pixel
-        int i = fmax(fmin(x+kx,width-1),0);
-        for(int ky=-kernelRadius; ky<=kernelRadius; ky++)
+        const int x1 = min(x0 + blockWidth, width);
+        const int blockBytes = (x1 - x0)*channels;
+
+        // Horizontal pass of the source row s (clamped) into its ring slot
+        auto loadRow = [&](const int s)
+        {
+            const int y = min(max(s, 0), height-1);
+            loadPaddedRow(source.row(y), width, channels, x0, x1, kernelRadius, paddedRow.data());
+            int* sums = ring.data() + ((s + kernelRadius) % kernelWidth)*blockWidth*channels;
+            std::fill(sums, sums + blockBytes, 0);
+            for(int kx=0; kx<kernelWidth; kx++)
+            {
+                const int h = rowKernel[kx];
+                if(h == 0)
+                    continue;
+                const uchar* tap = paddedRow.data() + kx*channels;
+                for(int i=0; i<blockBytes; i++)
+                {
+                    sums[i] += h * tap[i];
+                }
+            }
+        };
+
+        for(int s = rowStart-kernelRadius; s < rowStart+kernelRadius; s++)
+        {
+            loadRow(s);
+        }
+
+        for(int y=rowStart; y<rowEnd; y++)
         {
-            int jKernel = ky + kernelRadius;
-            //index j of the neighboor pixel
-            int j = fmax(fmin(y+ky,height-1),0);
-            QColor imageColor =  QColor(imageData[4*i +j* width*4], imageData[4*i +j* width*4 +1],imageData[4*i +j* width*4+2] ,imageData[4*i +j* width*4+3]) ;
+            loadRow(y + kernelRadius);
 
-            float h = kernel[iKernel+ jKernel*kernelWidth] / kernelParameter;
-            r = fminf( r + imageColor.red()   * h, 255.0f);
-            g = fminf( g + imageColor.green()   * h, 255.0f);
-            b = fminf( b + imageColor.blue()   * h, 255.0f);
+            // Vertical pass
+            int* acc = accumulator.data();
+            std::fill(acc, acc + blockBytes, 0);
+            for(int ky=0; ky<kernelWidth; ky++)
+            {
+                const int h = columnKernel[ky];
+                if(h == 0)
+                    continue;
+                const int* sums = ring.data() + ((y + ky) % kernelWidth)*blockWidth*channels;
+                for(int i=0; i<blockBytes; i++)
+                {
+                    acc[i] += h * sums[i];
+                }
+            }
 
+            storeConvolutionRow(acc, blockBytes, channels, kernelParameter, destination.row(y) + x0*channels);
         }
     }
-    return QColor(abs(r),abs(g),abs(b));
+}
+
+/*
+Row-major convolution of a 4 or 1 bytes per pixel image.
+The (2r+1) source rows of the current window live in a ring of padded rows (clamped
+rows at the top and bottom, replicated pixels at the left and right), so the
+inner loops have no border test. Each tap is accumulated over the whole row.
+*/
+void ImageProcessing::applyConvolution(const ImageView &source, const MutableImageView &destination, const int kernelRadius,
+                                       const int kernel[], const float kernelParameter, const int rowStart, const int rowEnd)
+{
+    const int width = source.width;
+    const int height = source.height;
+    const int channels = source.channels;
+    const int kernelWidth = 2*kernelRadius +1;
+    const int rowBytes = width*channels;
+    const int paddedRowBytes = (width + 2*kernelRadius)*channels;
+
+    PooledBuffer<uchar> ring(kernelWidth * paddedRowBytes);
+    PooledBuffer<int> accumulator(rowBytes);
+    vector<const uchar*> rows(kernelWidth);
+
+    // Border path: rows above the image are copies of the first one
+    for(int s = rowStart-kernelRadius; s < rowStart+kernelRadius; s++)
+    {
+        const int y = min(max(s, 0), height-1);
+        loadPaddedRow(source.row(y), width, channels, 0, width, kernelRadius, ring.data() + ((s + kernelRadius) % kernelWidth)*paddedRowBytes);
+    }
+
+    for(int y=rowStart; y<rowEnd; y++)
+    {
+        // Bring in the row entering the window, clamped at the bottom of the image
+        const int yIn = min(y + kernelRadius, height-1);
+        loadPaddedRow(source.row(yIn), width, channels, 0, width, kernelRadius, ring.data() + ((y + kernelWidth-1) % kernelWidth)*paddedRowBytes);
+        for(int ky=0; ky<kernelWidth; ky++)
+        {
+            rows[ky] = ring.data() + ((y + ky) % kernelWidth)*paddedRowBytes;
+        }
+
+        // Interior fast path
+        accumulator.fill(0);
+        int* acc = accumulator.data();
+        for(int ky=0; ky<kernelWidth; ky++)
+        {
+            for(int kx=0; kx<kernelWidth; kx++)
+            {
+                const int h = kernel[kx + ky*kernelWidth];
+                if(h == 0)
+                    continue;
+                const uchar* tap = rows[ky] + kx*channels;
+                for(int i=0; i<rowBytes; i++)
+                {
+                    acc[i] += h * tap[i];
+                }
+            }
+        }
+
+        storeConvolutionRow(acc, rowBytes, channels, kernelParameter, destination.row(y));
+    }
 }
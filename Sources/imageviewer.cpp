@@ -44,39 +44,75 @@
 #endif
 
 #include "Headers/imageviewer.h"
+#include "Headers/integralimage.h"
+#include "Headers/mappedimage.h"
+#include "Headers/profiler.h"
 
 ImageViewer::ImageViewer()
-   : imageLabel(new QLabel)
+   : imageCanvas(new ImageCanvas)
    , scrollArea(new QScrollArea)
    , scaleFactor(1)
+   , imageProcessor(new ImageProcessing())
+   , filterRunner(new FilterRunner(this))
+   , progressBar(new QProgressBar)
+   , firstProfileEvent(0)
+   , tilesShown(false)
 {
-    imageLabel->setBackgroundRole(QPalette::Base);
-    imageLabel->setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
-    imageLabel->setScaledContents(true);
+    imageCanvas->setBackgroundRole(QPalette::Base);
+    imageCanvas->setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
 
     scrollArea->setBackgroundRole(QPalette::Dark);
-    scrollArea->setWidget(imageLabel);
+    scrollArea->setWidget(imageCanvas);
     scrollArea->setVisible(false);
     setCentralWidget(scrollArea);
 
     createActions();
 
+    progressBar->setRange(0, 100);
+    progressBar->setMaximumWidth(200);
+    progressBar->setVisible(false);
+    statusBar()->addPermanentWidget(progressBar);
+    connect(filterRunner, &FilterRunner::progressChanged, this, &ImageViewer::filterProgress);
+    connect(filterRunner, &FilterRunner::finished, this, &ImageViewer::filterFinished);
+    connect(filterRunner, &FilterRunner::cancelled, this, &ImageViewer::filterCancelled);
+    connect(filterRunner, &FilterRunner::tileReady, this, &ImageViewer::filterTileReady);
+    // Filters applied again, histograms and summed-area tables of unchanged images are not computed again
+    imageProcessor->setResultCache(&ResultCache::instance());
+    filterRunner->setResultCache(&ResultCache::instance());
+    // The tiles shown are filtered first
+    for (QScrollBar *scrollBar : {scrollArea->horizontalScrollBar(), scrollArea->verticalScrollBar()}) {
+        connect(scrollBar, &QScrollBar::valueChanged, this, &ImageViewer::updateVisibleRect);
+        connect(scrollBar, &QScrollBar::rangeChanged, this, &ImageViewer::updateVisibleRect);
+    }
+
     resize(QGuiApplication::primaryScreen()->availableSize() * 3 / 5);
 }
 
 
 bool ImageViewer::loadFile(const QString &fileName)
 {
-    QImageReader reader(fileName);
-    reader.setAutoTransform(true);
-    const QImage newImage = reader.read();
+    // Mapped images are used in place, without decoding nor copying the pixels
+    QString errorMessage;
+    QImage newImage;
+    {
+        PROFILE_SCOPE("io", "load", 0);
+        if (MappedImage::isMappedImage(fileName)) {
+            newImage = MappedImage::load(fileName, errorMessage);
+        } else {
+            QImageReader reader(fileName);
+            reader.setAutoTransform(true);
+            newImage = reader.read();
+            errorMessage = reader.errorString();
+        }
+    }
     if (newImage.isNull()) {
         QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
                                  tr("Cannot load %1: %2")
-                                 .arg(QDir::toNativeSeparators(fileName), reader.errorString()));
+                                 .arg(QDir::toNativeSeparators(fileName), errorMessage));
         return false;
     }
 
+    filterRunner->cancel();
     setImage(newImage);
 
     setWindowFilePath(fileName);
@@ -87,10 +123,145 @@ bool ImageViewer::loadFile(const QString &fileName)
     return true;
 }
 
+/*
+Run a filter on the current image in the background, see filterFinished. A filter asked
+while another one runs replaces it. The filter writes into the buffer of filteredImage,
+the previous image, so that it does not allocate a new one.
+halo is how far from a pixel the filter reads, -1 when it needs the whole image. With a
+halo and the progressive preview on, the part of the image shown is filtered and
+displayed first, see filterTileReady.
+operation names the filter and its parameters: a filter applied again to the same pixels
+(after an undo, or on an image opened again) takes its result from the result cache.
+*/
+void ImageViewer::applyFilter(const QString &message, const QString &operation, const int halo, const FilterRunner::Filter &filter)
+{
+    // The events of the previous filters are dropped before the store is full, so that the
+    // events of this one are kept and its time shown
+    if (Profiler::instance().eventCount() > Profiler::maxEvents / 2)
+        Profiler::instance().clear();
+    firstProfileEvent = Profiler::instance().eventCount();
+    if (halo >= 0 && progressiveAct->isChecked()) {
+        filterRunner->runProgressive(message, operation, image, std::move(filteredImage), filter, halo,
+                                     visibleImageRect(), displayScale());
+        tilesShown = true;
+    } else {
+        filterRunner->run(message, operation, image, std::move(filteredImage), filter);
+    }
+    filteredImage = QImage();
+    progressBar->setValue(0);
+    progressBar->setVisible(true);
+    cancelFilterAct->setEnabled(true);
+    statusBar()->showMessage(tr("Filtering..."));
+}
+
+void ImageViewer::cancelFilter()
+{
+    filterRunner->cancel();
+}
+
+void ImageViewer::filterProgress(int percent)
+{
+    progressBar->setValue(percent);
+}
+
+// Shown over the image until the filter is done, a reduced preview is scaled up to rect
+void ImageViewer::filterTileReady(const QRect &rect, const QImage &tile)
+{
+    imageCanvas->drawPatch(rect, tile);
+}
+
+// Part of the image shown in the scroll area, in pixels of the image
+QRect ImageViewer::visibleImageRect() const
+{
+    const double scale = displayScale();
+    if (image.isNull() || scale <= 0.0)
+        return QRect();
+    const QRect shown = QRect(-imageCanvas->pos(), scrollArea->viewport()->size()) & imageCanvas->rect();
+    return QRect(QPoint(qFloor(shown.left() / scale), qFloor(shown.top() / scale)),
+                 QPoint(qCeil((shown.right() + 1) / scale), qCeil((shown.bottom() + 1) / scale)))
+        & image.rect();
+}
+
+// Size of the image shown over its size in pixels
+double ImageViewer::displayScale() const
+{
+    return image.isNull() ? 1.0 : imageCanvas->width() / (double)image.width();
+}
+
+void ImageViewer::updateVisibleRect()
+{
+    if (filterRunner->isRunning())
+        filterRunner->setVisibleRect(visibleImageRect());
+}
+
+// The result becomes the current image, the time it took is shown in the status bar when profiling
+void ImageViewer::filterFinished(const QString &message, const QImage &result)
+{
+    progressBar->setVisible(false);
+    cancelFilterAct->setEnabled(false);
+    if(result.isNull())
+    {
+        QMessageBox::warning(this, tr("Warning"),tr("No image found"));
+        return;
+    }
+    history.push(result, message);
+    replaceImage(result);
+    statusBar()->showMessage(message + profileMessage(Profiler::instance().events(firstProfileEvent)));
+}
+
+void ImageViewer::filterCancelled()
+{
+    progressBar->setVisible(false);
+    cancelFilterAct->setEnabled(false);
+    // The tiles already shown are dropped
+    if (tilesShown) {
+        imageCanvas->clearPatches();
+        tilesShown = false;
+    }
+    statusBar()->showMessage(tr("Filter cancelled"));
+}
+
+// Wall and CPU time, throughput and use of the threads of the events of one filter
+QString ImageViewer::profileMessage(const vector<Profiler::Event> &events) const
+{
+    if(events.empty())
+        return QString();
+    const Profiler::Totals totals = Profiler::totals(events);
+    return tr(" in %1 ms (CPU %2 ms), %3 Mpixels/s, %4 threads %5% busy")
+        .arg(totals.wallSeconds * 1e3, 0, 'f', 1).arg(totals.cpuSeconds * 1e3, 0, 'f', 1)
+        .arg(totals.wallSeconds > 0.0 ? totals.pixels / totals.wallSeconds * 1e-6 : 0.0, 0, 'f', 1)
+        .arg(totals.threads).arg(qRound(100.0 * totals.utilization));
+}
+
+void ImageViewer::setProfiling(const bool enable)
+{
+    Profiler::setEnabled(enable);
+    saveTraceAct->setEnabled(enable);
+}
+
+void ImageViewer::saveTrace()
+{
+    const QString fileName = QFileDialog::getSaveFileName(this, tr("Save Trace"), QString(), tr("Chrome traces (*.json)"));
+    if (fileName.isEmpty())
+        return;
+    QString errorMessage;
+    if (!Profiler::instance().saveChromeTrace(fileName, errorMessage)) {
+        QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
+                                 tr("Cannot write %1: %2").arg(QDir::toNativeSeparators(fileName), errorMessage));
+        return;
+    }
+    statusBar()->showMessage(tr("Wrote \"%1\", %2 events").arg(QDir::toNativeSeparators(fileName))
+                             .arg(Profiler::instance().eventCount()));
+}
+
+// New document: the history starts over from it
 void ImageViewer::setImage(const QImage &newImage)
 {
     image = newImage;
-    imageLabel->setPixmap(QPixmap::fromImage(image));
+    tilesShown = false;
+    imageCanvas->setImage(image);
+    history.clear();
+    history.push(image, QString());
     scaleFactor = 1.0;
 
     scrollArea->setVisible(true);
@@ -99,17 +270,100 @@ void ImageViewer::setImage(const QImage &newImage)
     updateActions();
 
     if (!fitToWindowAct->isChecked())
-        imageLabel->adjustSize();
+        imageCanvas->adjustSize();
+}
+
+/*
+Show the next state of the image: a filter result or a revision of the history. The zoom
+and the scroll position are kept when the size does not change. The image replaced is kept
+as the buffer of the next filter.
+*/
+void ImageViewer::replaceImage(const QImage &newImage)
+{
+    filteredImage = image;
+    const bool sameSize = newImage.size() == image.size();
+    image = newImage;
+    tilesShown = false;
+    imageCanvas->setImage(image);
+    if (!sameSize && !fitToWindowAct->isChecked()) {
+        scaleFactor = 1.0;
+        imageCanvas->adjustSize();
+    }
+    updateActions();
+}
+
+void ImageViewer::undo()
+{
+    filterRunner->cancel();
+    const QString label = history.undoLabel();
+    const QImage previous = history.undo();
+    if (previous.isNull()) {
+        QMessageBox::warning(this, tr("Warning"), tr("Cannot read back the image before \"%1\"").arg(label));
+        return;
+    }
+    replaceImage(previous);
+    statusBar()->showMessage(tr("Undo: %1").arg(label));
+}
+
+void ImageViewer::redo()
+{
+    filterRunner->cancel();
+    const QString label = history.redoLabel();
+    const QImage next = history.redo();
+    if (next.isNull()) {
+        QMessageBox::warning(this, tr("Warning"), tr("Cannot read back the image of \"%1\"").arg(label));
+        return;
+    }
+    replaceImage(next);
+    statusBar()->showMessage(tr("Redo: %1").arg(label));
+}
+
+void ImageViewer::setHistoryBudget()
+{
+    bool ok = false;
+    const int megabytes = QInputDialog::getInt(this, tr("History memory"), tr("Memory of the undo history (MB):"),
+                                               history.budget() / (1024*1024), 16, 1 << 20, 64, &ok);
+    if (!ok)
+        return;
+    history.setBudget(qint64(megabytes)*1024*1024);
+    updateActions();
+}
+
+// The revisions over the memory of the history are compressed to the temporary directory instead of dropped
+void ImageViewer::setHistorySpill(const bool enable)
+{
+    history.setSpillDirectory(enable ? QDir::tempPath() : QString());
+}
+
+void ImageViewer::setResultCacheBudget()
+{
+    bool ok = false;
+    const int megabytes = QInputDialog::getInt(this, tr("Result cache memory"), tr("Memory of the filter results kept (MB):"),
+                                               ResultCache::instance().budget() / (1024*1024), 0, 1 << 20, 64, &ok);
+    if (!ok)
+        return;
+    ResultCache::instance().setBudget(qint64(megabytes)*1024*1024);
 }
 
 bool ImageViewer::saveFile(const QString &fileName)
 {
-    QImageWriter writer(fileName);
+    QString errorMessage;
+    bool written;
+    {
+        PROFILE_SCOPE("io", "save", (qint64)image.width()*image.height());
+        if (QFileInfo(fileName).suffix() == QLatin1String(MappedImage::suffix)) {
+            written = MappedImage::save(image, fileName, errorMessage);
+        } else {
+            QImageWriter writer(fileName);
+            written = writer.write(image);
+            errorMessage = writer.errorString();
+        }
+    }
 
-    if (!writer.write(image)) {
+    if (!written) {
         QMessageBox::information(this, QGuiApplication::applicationDisplayName(),
                                  tr("Cannot write %1: %2")
-                                 .arg(QDir::toNativeSeparators(fileName)), writer.errorString());
+                                 .arg(QDir::toNativeSeparators(fileName), errorMessage));
         return false;
     }
     const QString message = tr("Wrote \"%1\"").arg(QDir::toNativeSeparators(fileName));
@@ -134,6 +388,9 @@ static void initializeImageFileDialog(QFileDialog &dialog, QFileDialog::AcceptMo
         mimeTypeFilters.append(mimeTypeName);
     mimeTypeFilters.sort();
     dialog.setMimeTypeFilters(mimeTypeFilters);
+    QStringList nameFilters = dialog.nameFilters();
+    nameFilters.append(QObject::tr("Mapped images (*.%1)").arg(QLatin1String(MappedImage::suffix)));
+    dialog.setNameFilters(nameFilters);
     dialog.selectMimeTypeFilter("image/png");
     if (acceptMode == QFileDialog::AcceptSave)
         dialog.setDefaultSuffix("png");
@@ -157,17 +414,16 @@ void ImageViewer::saveAs()
 
 void ImageViewer::print()
 {
-  //  Q_ASSERT(imageLabel->pixmap());
 #if !defined(QT_NO_PRINTER) && !defined(QT_NO_PRINTDIALOG)
     QPrintDialog dialog(&printer, this);
     if (dialog.exec()) {
         QPainter painter(&printer);
         QRect rect = painter.viewport();
-        QSize size = imageLabel->pixmap().size();
+        QSize size = image.size();
         size.scale(rect.size(), Qt::KeepAspectRatio);
         painter.setViewport(rect.x(), rect.y(), size.width(), size.height());
-        painter.setWindow(imageLabel->pixmap().rect());
-        painter.drawPixmap(0, 0, imageLabel->pixmap());
+        painter.setWindow(image.rect());
+        painter.drawImage(0, 0, image);
     }
 #endif
 }
@@ -200,6 +456,7 @@ void ImageViewer::paste()
     if (newImage.isNull()) {
         statusBar()->showMessage(tr("No image in clipboard"));
     } else {
+        filterRunner->cancel();
         setImage(newImage);
         setWindowFilePath(QString());
         const QString message = tr("Obtained image from clipboard, %1x%2, Depth: %3")
@@ -221,8 +478,9 @@ void ImageViewer::zoomOut()
 
 void ImageViewer::normalSize()
 {
-    imageLabel->adjustSize();
+    imageCanvas->adjustSize();
     scaleFactor = 1.0;
+    updateVisibleRect();
 }
 
 void ImageViewer::fitToWindow()
@@ -232,90 +490,86 @@ void ImageViewer::fitToWindow()
     if (!fitToWindow)
         normalSize();
     updateActions();
+    updateVisibleRect();
 }
 
 void ImageViewer::grayscale()
 {
-    QImage* result =  imageProcessor->convertToGrayScale(image.constBits() ,image.width(), image.height(), image.format());
-    //QImage* result =  imageProcessor->convertToGrayScale(&image);
-    if(result != nullptr)
-    {
-        setImage(*result);
-        QMessageBox::warning(this, tr("Warning"),tr("Gray"));
-    }
-    else
+    applyFilter(tr("Gray"), QStringLiteral("gray"), 0, [](ImageProcessing &processing, const QImage &source, QImage &destination)
     {
-        QMessageBox::warning(this, tr("Warning"),tr("No image found"));
-    }
+        processing.convertToGrayScale(source, destination);
+    });
 }
 void ImageViewer::meanBlur()
 {
-   QImage* result =  imageProcessor->meanBlur(image.constBits(),image.width(),image.height(),image.format());
-   if(result != nullptr)
-   {
-       setImage(*result);
-       QMessageBox::warning(this, tr("Warning"),tr("Blur applied"));
-   }
-   else
-   {
-       QMessageBox::warning(this, tr("Warning"),tr("No image found"));
-   }
+    applyFilter(tr("Blur applied"), QStringLiteral("mean 1"), 1, [](ImageProcessing &processing, const QImage &source, QImage &destination)
+    {
+        processing.meanBlur(source, destination);
+    });
 }
 
-void ImageViewer::gaussianBlur3x3()
+void ImageViewer::boxBlur()
 {
-    QImage* result =  imageProcessor->gaussianBlur3x3(image.constBits(),image.width(),image.height(),image.format());
-    if(result != nullptr)
+    bool ok = false;
+    const int radius = QInputDialog::getInt(this, tr("Box blur"), tr("Radius:"), 5, 1, IntegralImage::maxRadius, 1, &ok);
+    if(!ok)
+        return;
+
+    applyFilter(tr("Blur applied"), QStringLiteral("mean %1").arg(radius), radius, [radius](ImageProcessing &processing, const QImage &source, QImage &destination)
     {
-        setImage(*result);
-        QMessageBox::warning(this, tr("Warning"),tr("Blur applied"));
-    }
-    else
+        processing.meanBlur(source, destination, radius);
+    });
+}
+
+void ImageViewer::gaussianBlur3x3()
+{
+    applyFilter(tr("Blur applied"), QStringLiteral("gauss3"), 1, [](ImageProcessing &processing, const QImage &source, QImage &destination)
     {
-        QMessageBox::warning(this, tr("Warning"),tr("No image found"));
-    }
+        processing.gaussianBlur3x3(source, destination);
+    });
 }
 
 void ImageViewer::gaussianBlur5x5()
 {
-   QImage* result =  imageProcessor->gaussianBlur5x5(image.constBits(),image.width(),image.height(),image.format());
-   if(result != nullptr)
-   {
-       setImage(*result);
-       QMessageBox::warning(this, tr("Warning"),tr("Blur applied"));
-   }
-   else
-   {
-       QMessageBox::warning(this, tr("Warning"),tr("No image found"));
-   }
+    applyFilter(tr("Blur applied"), QStringLiteral("gauss5"), 2, [](ImageProcessing &processing, const QImage &source, QImage &destination)
+    {
+        processing.gaussianBlur5x5(source, destination);
+    });
 }
 
 void ImageViewer::medianFilter()
 {
-    QImage* result =  imageProcessor->medianFilter(image.constBits(),image.width(),image.height(),image.format());
-    if(result != nullptr)
-    {
-        setImage(*result);
-        QMessageBox::warning(this, tr("Warning"),tr("Blur applied"));
-    }
-    else
+    bool ok = false;
+    const int radius = QInputDialog::getInt(this, tr("Median filter"), tr("Radius:"), 1,
+                                            ImageProcessing::minMedianRadius, ImageProcessing::maxMedianRadius, 1, &ok);
+    if(!ok)
+        return;
+
+    applyFilter(tr("Blur applied"), QStringLiteral("median %1").arg(radius), radius, [radius](ImageProcessing &processing, const QImage &source, QImage &destination)
     {
-        QMessageBox::warning(this, tr("Warning"),tr("No image found"));
-    }
+        processing.medianFilter(source, destination, radius);
+    });
 }
 
 void ImageViewer::variationFilter()
 {
-   QImage* result =  imageProcessor->variationFilter(image.constBits(),image.width(),image.height(),image.format());
-   if(result != nullptr)
-   {
-       setImage(*result);
-       QMessageBox::warning(this, tr("Warning"),tr("Blur applied"));
-   }
-   else
-   {
-       QMessageBox::warning(this, tr("Warning"),tr("No image found"));
-   }
+    applyFilter(tr("Blur applied"), QStringLiteral("variation"), 2, [](ImageProcessing &processing, const QImage &source, QImage &destination)
+    {
+        processing.variationFilter(source, destination);
+    });
+}
+
+void ImageViewer::localContrastNormalization()
+{
+    bool ok = false;
+    const int radius = QInputDialog::getInt(this, tr("Local contrast normalization"), tr("Radius:"), 15, 1, IntegralImage::maxRadius, 1, &ok);
+    if(!ok)
+        return;
+
+    applyFilter(tr("Filter applied"), QStringLiteral("lcn %1").arg(radius), radius, [radius](ImageProcessing &processing, const QImage &source, QImage &destination)
+    {
+        processing.localContrastNormalization(source, destination, radius);
+    });
 }
 
 void ImageViewer::showHistogram()
@@ -323,7 +577,7 @@ void ImageViewer::showHistogram()
     std::vector<float> greyHistogram(256,0.0f);
     QBarSeries *series = new QBarSeries();
 
-    imageProcessor->computeHistogram(image.constBits(),image.width(),image.height(),&greyHistogram);
+    imageProcessor->computeHistogram(image, &greyHistogram);
 
     int size = greyHistogram.size();
     float imageSize = image.width()*image.height();
@@ -368,7 +622,7 @@ void ImageViewer::showCumulativeHistogram()
     std::vector<float> greyHistogram(256,0.0f);
     QBarSeries *series = new QBarSeries();
 
-    imageProcessor->cumulativeHistogram(image.constBits(),image.width(),image.height(),&greyHistogram);
+    imageProcessor->cumulativeHistogram(image, &greyHistogram);
 
     int size = greyHistogram.size();
     float imageSize = image.width()*image.height();
@@ -410,62 +664,38 @@ void ImageViewer::showCumulativeHistogram()
 
 void ImageViewer::gradientThreshold()
 {
- QImage* result = imageProcessor->gradientThreshold(image.constBits(),image.width(),image.height(),image.format());
- if(result != nullptr)
- {
-     setImage(*result);
-     QMessageBox::warning(this, tr("Warning"),tr("Filter applied"));
- }
- else
- {
-     QMessageBox::warning(this, tr("Warning"),tr("No image found"));
- }
+    applyFilter(tr("Filter applied"), QStringLiteral("gradient threshold"), -1, [](ImageProcessing &processing, const QImage &source, QImage &destination)
+    {
+        processing.gradientThreshold(source, destination);
+    });
 
 }
 
 void ImageViewer::gradientFilter()
 {
- QImage* result = imageProcessor->gradientFilter(image.constBits(),image.width(),image.height(),image.format());
- if(result != nullptr)
- {
-     setImage(*result);
-     QMessageBox::warning(this, tr("Warning"),tr("Filter applied"));
- }
- else
- {
-     QMessageBox::warning(this, tr("Warning"),tr("No image found"));
- }
+    applyFilter(tr("Filter applied"), QStringLiteral("gradient"), 1, [](ImageProcessing &processing, const QImage &source, QImage &destination)
+    {
+        processing.gradientFilter(source, destination);
+    });
 
 }
 
 void ImageViewer::horizontalGradientFilter()
 {
 
-    QImage* result = imageProcessor->horizontalSobelGradientFilter(image.constBits(),image.width(),image.height(),image.format());
-    if(result != nullptr)
+    applyFilter(tr("Filter applied"), QStringLiteral("sobelx"), 1, [](ImageProcessing &processing, const QImage &source, QImage &destination)
     {
-        setImage(*result);
-        QMessageBox::warning(this, tr("Warning"),tr("Filter applied"));
-    }
-    else
-    {
-        QMessageBox::warning(this, tr("Warning"),tr("No image found"));
-    }
+        processing.horizontalSobelGradientFilter(source, destination);
+    });
 
 }
 
 void ImageViewer::verticalGradientFilter()
 {
-    QImage* result = imageProcessor->verticalSobelGradientFilter(image.constBits(),image.width(),image.height(),image.format());
-    if(result != nullptr)
+    applyFilter(tr("Filter applied"), QStringLiteral("sobely"), 1, [](ImageProcessing &processing, const QImage &source, QImage &destination)
     {
-        setImage(*result);
-        QMessageBox::warning(this, tr("Warning"),tr("Filter applied"));
-    }
-    else
-    {
-        QMessageBox::warning(this, tr("Warning"),tr("No image found"));
-    }
+        processing.verticalSobelGradientFilter(source, destination);
+    });
 
 }
 
@@ -507,6 +737,16 @@ void ImageViewer::createActions()
 
     QMenu *editMenu = menuBar()->addMenu(tr("&Edit"));
 
+    undoAct = editMenu->addAction(tr("&Undo"), this, &ImageViewer::undo);
+    undoAct->setShortcut(QKeySequence::Undo);
+    undoAct->setEnabled(false);
+
+    redoAct = editMenu->addAction(tr("&Redo"), this, &ImageViewer::redo);
+    redoAct->setShortcut(QKeySequence::Redo);
+    redoAct->setEnabled(false);
+
+    editMenu->addSeparator();
+
     copyAct = editMenu->addAction(tr("&Copy"), this, &ImageViewer::copy);
     copyAct->setShortcut(QKeySequence::Copy);
     copyAct->setEnabled(false);
@@ -514,6 +754,19 @@ void ImageViewer::createActions()
     QAction *pasteAct = editMenu->addAction(tr("&Paste"), this, &ImageViewer::paste);
     pasteAct->setShortcut(QKeySequence::Paste);
 
+    editMenu->addSeparator();
+
+    cancelFilterAct = editMenu->addAction(tr("Cancel &Filter"), this, &ImageViewer::cancelFilter);
+    cancelFilterAct->setShortcut(QKeySequence::Cancel);
+    cancelFilterAct->setEnabled(false);
+
+    editMenu->addSeparator();
+
+    editMenu->addAction(tr("History &Memory..."), this, &ImageViewer::setHistoryBudget);
+    QAction *spillHistoryAct = editMenu->addAction(tr("Compress Old History to &Disk"), this, &ImageViewer::setHistorySpill);
+    spillHistoryAct->setCheckable(true);
+    editMenu->addAction(tr("Result &Cache Memory..."), this, &ImageViewer::setResultCacheBudget);
+
     QMenu *viewMenu = menuBar()->addMenu(tr("&View"));
 
     zoomInAct = viewMenu->addAction(tr("Zoom &In (25%)"), this, &ImageViewer::zoomIn);
@@ -535,13 +788,27 @@ void ImageViewer::createActions()
     fitToWindowAct->setCheckable(true);
     fitToWindowAct->setShortcut(tr("Ctrl+F"));
 
+    viewMenu->addSeparator();
+
+    // Off by default: the timers then only read a flag
+    profilingAct = viewMenu->addAction(tr("&Profile Filters"), this, &ImageViewer::setProfiling);
+    profilingAct->setCheckable(true);
+    saveTraceAct = viewMenu->addAction(tr("Save &Trace..."), this, &ImageViewer::saveTrace);
+    setProfiling(false);
+
+    progressiveAct = viewMenu->addAction(tr("Progressive P&review"));
+    progressiveAct->setCheckable(true);
+    progressiveAct->setChecked(true);
+
     filtersMenu = menuBar()->addMenu(tr("&Filters"));
     filtersMenu->setEnabled(false);
     filtersMenu->addAction(tr("&MeanBlur"), this, &ImageViewer::meanBlur);
+    filtersMenu->addAction(tr("&BoxBlur..."), this, &ImageViewer::boxBlur);
     filtersMenu->addAction(tr("&GaussianBlur"), this, &ImageViewer::gaussianBlur3x3);
     filtersMenu->addAction(tr("&GaussianBlur5x5"), this, &ImageViewer::gaussianBlur5x5);
-    filtersMenu->addAction(tr("&MedianFilter"), this, &ImageViewer::medianFilter);
+    filtersMenu->addAction(tr("&MedianFilter..."), this, &ImageViewer::medianFilter);
     filtersMenu->addAction(tr("&VariationFilter"), this, &ImageViewer::variationFilter);
+    filtersMenu->addAction(tr("&LocalContrastNormalization..."), this, &ImageViewer::localContrastNormalization);
 
     imageMenu = menuBar()->addMenu(tr("&Image"));
     imageMenu->setEnabled(false);
@@ -565,6 +832,8 @@ void ImageViewer::updateActions()
 {
     saveAsAct->setEnabled(!image.isNull());
     copyAct->setEnabled(!image.isNull());
+    undoAct->setEnabled(history.canUndo());
+    redoAct->setEnabled(history.canRedo());
     zoomInAct->setEnabled(!fitToWindowAct->isChecked());
     zoomOutAct->setEnabled(!fitToWindowAct->isChecked());
     normalSizeAct->setEnabled(!fitToWindowAct->isChecked());
@@ -576,15 +845,15 @@ void ImageViewer::updateActions()
 
 void ImageViewer::scaleImage(double factor)
 {
-   // Q_ASSERT(imageLabel->pixmap());
     scaleFactor *= factor;
-    imageLabel->resize(scaleFactor * imageLabel->pixmap().size());
+    imageCanvas->resize(scaleFactor * image.size());
 
     adjustScrollBar(scrollArea->horizontalScrollBar(), factor);
     adjustScrollBar(scrollArea->verticalScrollBar(), factor);
 
     zoomInAct->setEnabled(scaleFactor < 3.0);
     zoomOutAct->setEnabled(scaleFactor > 0.333);
+    updateVisibleRect();
 }
 
 void ImageViewer::adjustScrollBar(QScrollBar *scrollBar, double factor)
@@ -0,0 +1,193 @@
+#include "Headers/integralimage.h"
+#include "Headers/threadpool.h"
+
+#include <algorithm>
+#include <cmath>
+
+IntegralImage::IntegralImage()
+    : tableWidth(1)
+    , tableHeight(1)
+    , tableChannels(nbChannels)
+{
+}
+
+int IntegralImage::width() const
+{
+    return tableWidth - 1;
+}
+
+int IntegralImage::height() const
+{
+    return tableHeight - 1;
+}
+
+int IntegralImage::channelCount() const
+{
+    return tableChannels;
+}
+
+bool IntegralImage::hasSquares() const
+{
+    return !squareSums.empty();
+}
+
+qint64 IntegralImage::sizeInBytes() const
+{
+    return (qint64)(sums.size() + squareSums.size()) * sizeof(quint64);
+}
+
+void IntegralImage::build(const ImageView &image, const bool withSquares, const int nbThreads)
+{
+    tableWidth = image.width + 1;
+    tableHeight = image.height + 1;
+    tableChannels = image.channels == 1 ? 1 : nbChannels;
+    buildTable(image, tableChannels, false, sums, nbThreads);
+    if(withSquares)
+        buildTable(image, tableChannels, true, squareSums, nbThreads);
+    else
+        squareSums.reset();
+}
+
+/*
+Two parallel passes: prefix sums along each row (rows are independent), then prefix
+sums down each column, by blocks of columns so every thread reads and writes
+contiguous pieces of rows.
+*/
+void IntegralImage::buildTable(const ImageView &image, const int channels, const bool squares,
+                               PooledBuffer<quint64>& table, const int nbThreads)
+{
+    const int width = image.width;
+    const int height = image.height;
+    const int rowSize = (width + 1)*channels;
+    table.resize((qsizetype)rowSize*(height + 1));
+    std::fill(table.data(), table.data() + rowSize, 0);
+
+    const int nbBands = max(1, min(nbThreads, height / 16));
+    ThreadPool::instance().parallelFor(nbBands, [&](const int band)
+    {
+        for(int y=band*height/nbBands; y<(band+1)*height/nbBands; y++)
+        {
+            const uchar* row = image.row(y);
+            quint64* entry = table.data() + (qsizetype)(y+1)*rowSize;
+            quint64 total[nbChannels] = {0};
+            for(int c=0; c<channels; c++)
+                entry[c] = 0;
+            for(int x=0; x<width; x++)
+            {
+                entry += channels;
+                for(int c=0; c<channels; c++)
+                {
+                    const quint64 value = row[image.channels*x + c];
+                    total[c] += squares ? value*value : value;
+                    entry[c] = total[c];
+                }
+            }
+        }
+    });
+
+    const int blockSize = 1024;
+    const int nbBlocks = (rowSize + blockSize - 1) / blockSize;
+    const int nbWorkers = max(1, min(nbBlocks, nbThreads));
+    ThreadPool::instance().parallelFor(nbWorkers, [&](const int worker)
+    {
+        for(int block=worker; block<nbBlocks; block+=nbWorkers)
+        {
+            const int start = block*blockSize;
+            const int end = min(start + blockSize, rowSize);
+            for(int y=1; y<=height; y++)
+            {
+                const quint64* above = table.data() + (qsizetype)(y-1)*rowSize;
+                quint64* current = table.data() + (qsizetype)y*rowSize;
+                for(int i=start; i<end; i++)
+                    current[i] += above[i];
+            }
+        }
+    });
+}
+
+void IntegralImage::rectangleSum(const PooledBuffer<quint64>& table, const int x0, const int y0, const int x1, const int y1, quint64 sums[nbChannels]) const
+{
+    const int channels = tableChannels;
+    const quint64* top = table.data() + ((qsizetype)y0*tableWidth)*channels;
+    const quint64* bottom = table.data() + ((qsizetype)y1*tableWidth)*channels;
+    for(int c=0; c<channels; c++)
+    {
+        sums[c] = bottom[x1*channels + c] - bottom[x0*channels + c] - top[x1*channels + c] + top[x0*channels + c];
+    }
+}
+
+void IntegralImage::sum(const int x0, const int y0, const int x1, const int y1, quint64 sums[nbChannels]) const
+{
+    rectangleSum(this->sums, x0, y0, x1, y1, sums);
+}
+
+void IntegralImage::squareSum(const int x0, const int y0, const int x1, const int y1, quint64 sums[nbChannels]) const
+{
+    rectangleSum(squareSums, x0, y0, x1, y1, sums);
+}
+
+/*
+With replicated borders, the window weights are separable: inside the image every
+column (row) counts once, and the first and last columns (rows) also count for every
+position of the window that falls outside the image. The sum is then a combination of
+at most 3 x 3 rectangle sums, and of a single one for windows inside the image.
+*/
+void IntegralImage::clampedWindowSum(const PooledBuffer<quint64>& table, const int x, const int y, const int radius, quint64 sums[nbChannels]) const
+{
+    const int w = width();
+    const int h = height();
+    const int x0 = max(x - radius, 0);
+    const int x1 = min(x + radius + 1, w);
+    const int y0 = max(y - radius, 0);
+    const int y1 = min(y + radius + 1, h);
+
+    rectangleSum(table, x0, y0, x1, y1, sums);
+    const int extraLeft = max(radius - x, 0);
+    const int extraRight = max(x + radius + 1 - w, 0);
+    const int extraTop = max(radius - y, 0);
+    const int extraBottom = max(y + radius + 1 - h, 0);
+    if(extraLeft + extraRight + extraTop + extraBottom == 0)
+        return;
+
+    // Column ranges and row ranges with their weights
+    const int columns[3][3] = {{x0, x1, 1}, {0, 1, extraLeft}, {w-1, w, extraRight}};
+    const int rows[3][3] = {{y0, y1, 1}, {0, 1, extraTop}, {h-1, h, extraBottom}};
+    for(int i=0; i<3; i++)
+    {
+        for(int j=0; j<3; j++)
+        {
+            const quint64 weight = quint64(columns[i][2]) * rows[j][2];
+            if(weight == 0 || (i == 0 && j == 0))
+                continue;
+            quint64 part[nbChannels];
+            rectangleSum(table, columns[i][0], rows[j][0], columns[i][1], rows[j][1], part);
+            for(int c=0; c<tableChannels; c++)
+                sums[c] += weight * part[c];
+        }
+    }
+}
+
+void IntegralImage::windowSum(const int x, const int y, const int radius, quint64 sums[nbChannels]) const
+{
+    clampedWindowSum(this->sums, x, y, radius, sums);
+}
+
+void IntegralImage::windowSquareSum(const int x, const int y, const int radius, quint64 sums[nbChannels]) const
+{
+    clampedWindowSum(squareSums, x, y, radius, sums);
+}
+
+void IntegralImage::windowStatistics(const int x, const int y, const int radius, float mean[nbChannels], float variance[nbChannels]) const
+{
+    const double area = (2.0*radius + 1)*(2.0*radius + 1);
+    quint64 windowSums[nbChannels];
+    quint64 windowSquareSums[nbChannels];
+    windowSum(x, y, radius, windowSums);
+    windowSquareSum(x, y, radius, windowSquareSums);
+    for(int c=0; c<tableChannels; c++)
+    {
+        const double m = windowSums[c] / area;
+        mean[c] = m;
+        variance[c] = max(windowSquareSums[c] / area - m*m, 0.0);
+    }
+}
@@ -0,0 +1,257 @@
+#include "Headers/mappedimage.h"
+
+#include <cstring>
+#include <limits>
+
+const char* const MappedImage::suffix = "ipraw";
+
+static const char fileMagic[8] = {'I', 'P', 'R', 'A', 'W', 'I', 'M', 'G'};
+// Version 2 adds the color table
+static constexpr quint32 fileVersion = 2;
+static constexpr qint64 rowAlignment = 64;
+static constexpr quint32 maxColors = 256;
+
+struct MappedImageHeader
+{
+    char magic[8];
+    quint32 version;
+    quint32 format;
+    qint32 width;
+    qint32 height;
+    qint64 stride;
+    qint64 dataOffset;
+    // Colors of the table written after the header, 0 in version 1 files
+    quint32 colorCount;
+    char reserved[20];
+};
+static_assert(sizeof(MappedImageHeader) == 64, "the rows start on a 64 bytes boundary");
+
+// Bytes of the pixels of a row, 0 for an invalid format
+static qint64 bytesPerRow(const int width, const QImage::Format format)
+{
+    if(format <= QImage::Format_Invalid || format >= QImage::NImageFormats)
+        return 0;
+    return ((qint64)width*QImage::toPixelFormat(format).bitsPerPixel() + 7) / 8;
+}
+
+MappedImage::Mapping::~Mapping()
+{
+    file.unmap(address);
+}
+
+MappedImage::MappedImage()
+    : pixels(nullptr)
+    , writable(false)
+    , imageWidth(0)
+    , imageHeight(0)
+    , imageFormat(QImage::Format_Invalid)
+    , imageStride(0)
+{
+}
+
+MappedImage::~MappedImage()
+{
+    close();
+}
+
+bool MappedImage::isMappedImage(const QString &path)
+{
+    QFile file(path);
+    char magic[sizeof(fileMagic)];
+    return file.open(QIODevice::ReadOnly) && file.read(magic, sizeof(magic)) == sizeof(magic)
+            && memcmp(magic, fileMagic, sizeof(magic)) == 0;
+}
+
+void MappedImage::close()
+{
+    mapping.reset();
+    pixels = nullptr;
+    writable = false;
+    imageWidth = 0;
+    imageHeight = 0;
+    imageFormat = QImage::Format_Invalid;
+    imageStride = 0;
+    colors.clear();
+}
+
+bool MappedImage::map(const qint64 size)
+{
+    mapping->address = mapping->file.map(0, size);
+    if(mapping->address == nullptr)
+    {
+        error = mapping->file.errorString();
+        mapping.reset();
+        return false;
+    }
+    return true;
+}
+
+bool MappedImage::open(const QString &path, const bool writable)
+{
+    close();
+    error.clear();
+    mapping = make_shared<Mapping>();
+    mapping->address = nullptr;
+    mapping->file.setFileName(path);
+    if(!mapping->file.open(writable ? QIODevice::ReadWrite : QIODevice::ReadOnly))
+    {
+        error = mapping->file.errorString();
+        mapping.reset();
+        return false;
+    }
+
+    MappedImageHeader header;
+    const qint64 fileSize = mapping->file.size();
+    if(mapping->file.read((char*)&header, sizeof(header)) != sizeof(header) || memcmp(header.magic, fileMagic, sizeof(fileMagic)) != 0)
+    {
+        error = QStringLiteral("not a mapped image file");
+        mapping.reset();
+        return false;
+    }
+    const QImage::Format format = (QImage::Format)header.format;
+    const qint64 rowBytes = bytesPerRow(header.width, format);
+    const quint32 colorCount = header.version >= 2 ? header.colorCount : 0;
+    if(header.version == 0 || header.version > fileVersion || header.width <= 0 || header.height <= 0 || rowBytes == 0
+            || header.stride < rowBytes || header.stride % 4 != 0 || colorCount > maxColors
+            || header.dataOffset < qint64(sizeof(header) + colorCount*sizeof(QRgb)) || header.dataOffset % 4 != 0)
+    {
+        error = QStringLiteral("unsupported mapped image header");
+        mapping.reset();
+        return false;
+    }
+    // Bounded by the file size before the product, which a bad header would overflow
+    if(header.dataOffset > fileSize || header.stride > (fileSize - header.dataOffset) / header.height)
+    {
+        error = QStringLiteral("truncated file");
+        mapping.reset();
+        return false;
+    }
+    if(!map(header.dataOffset + header.stride*header.height))
+        return false;
+
+    colors.resize(colorCount);
+    if(colorCount > 0)
+        memcpy(colors.data(), mapping->address + sizeof(header), colorCount*sizeof(QRgb));
+    pixels = mapping->address + header.dataOffset;
+    this->writable = writable;
+    imageWidth = header.width;
+    imageHeight = header.height;
+    imageFormat = format;
+    imageStride = header.stride;
+    return true;
+}
+
+bool MappedImage::create(const QString &path, const int width, const int height, const QImage::Format format,
+                         const QVector<QRgb> &colorTable)
+{
+    close();
+    error.clear();
+    const qint64 rowBytes = bytesPerRow(width, format);
+    if(width <= 0 || height <= 0 || rowBytes == 0 || rowBytes > numeric_limits<qint64>::max() / 2 / height)
+    {
+        error = QStringLiteral("invalid image size or format");
+        return false;
+    }
+    if((quint32)colorTable.size() > maxColors)
+    {
+        error = QStringLiteral("color table of more than %1 colors").arg(maxColors);
+        return false;
+    }
+    MappedImageHeader header = {};
+    memcpy(header.magic, fileMagic, sizeof(fileMagic));
+    header.version = fileVersion;
+    header.format = format;
+    header.width = width;
+    header.height = height;
+    header.stride = (rowBytes + rowAlignment - 1) / rowAlignment * rowAlignment;
+    header.colorCount = colorTable.size();
+    // The rows start on the first boundary after the color table
+    header.dataOffset = (sizeof(header) + header.colorCount*sizeof(QRgb) + rowAlignment - 1) / rowAlignment * rowAlignment;
+    const qint64 size = header.dataOffset + header.stride*height;
+
+    mapping = make_shared<Mapping>();
+    mapping->address = nullptr;
+    mapping->file.setFileName(path);
+    if(!mapping->file.open(QIODevice::ReadWrite | QIODevice::Truncate) || !mapping->file.resize(size))
+    {
+        error = mapping->file.errorString();
+        mapping.reset();
+        return false;
+    }
+    if(!map(size))
+        return false;
+    memcpy(mapping->address, &header, sizeof(header));
+    if(header.colorCount > 0)
+        memcpy(mapping->address + sizeof(header), colorTable.data(), header.colorCount*sizeof(QRgb));
+
+    colors = colorTable;
+    pixels = mapping->address + header.dataOffset;
+    writable = true;
+    imageWidth = width;
+    imageHeight = height;
+    imageFormat = format;
+    imageStride = header.stride;
+    return true;
+}
+
+// Every image holds a reference to the mapping
+static void releaseMapping(void* info)
+{
+    delete static_cast<shared_ptr<void>*>(info);
+}
+
+QImage MappedImage::image() const
+{
+    if(mapping == nullptr)
+        return QImage();
+    shared_ptr<void>* reference = new shared_ptr<void>(mapping);
+    QImage image = writable ? QImage(pixels, imageWidth, imageHeight, imageStride, imageFormat, releaseMapping, reference)
+                            : QImage((const uchar*)pixels, imageWidth, imageHeight, imageStride, imageFormat, releaseMapping, reference);
+    // Qt 5 copies the pixels of a read only image to set its table, Qt 6 does not
+    if(!colors.empty())
+        image.setColorTable(colors);
+    return image;
+}
+
+ImageView MappedImage::view() const
+{
+    const int channels = ImageView::channelsOf(imageFormat);
+    if(mapping == nullptr || channels == 0)
+        return ImageView();
+    return ImageView(pixels, imageWidth, imageHeight, imageStride, channels);
+}
+
+MutableImageView MappedImage::mutableView() const
+{
+    const int channels = ImageView::channelsOf(imageFormat);
+    if(mapping == nullptr || channels == 0 || !writable)
+        return MutableImageView();
+    return MutableImageView(pixels, imageWidth, imageHeight, imageStride, channels);
+}
+
+QImage MappedImage::load(const QString &path, QString &errorMessage)
+{
+    MappedImage file;
+    if(!file.open(path))
+    {
+        errorMessage = file.errorString();
+        return QImage();
+    }
+    return file.image();
+}
+
+bool MappedImage::save(const QImage &image, const QString &path, QString &errorMessage)
+{
+    MappedImage file;
+    if(!file.create(path, image.width(), image.height(), image.format(), image.colorTable()))
+    {
+        errorMessage = file.errorString();
+        return false;
+    }
+    const qsizetype rowBytes = bytesPerRow(image.width(), image.format());
+    for(int y=0; y<image.height(); y++)
+    {
+        memcpy(file.pixels + y*file.imageStride, image.constScanLine(y), rowBytes);
+    }
+    return true;
+}
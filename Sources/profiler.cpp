@@ -0,0 +1,253 @@
+#include "Headers/profiler.h"
+
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonObject>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+#ifdef Q_OS_WIN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+atomic<bool> Profiler::enabled(false);
+
+static atomic<int> nbThreads(0);
+static thread_local int currentThread = -1;
+
+Profiler::ScopedTimer::ScopedTimer(const char* category, const char* name, const qint64 pixels)
+    : category(category), name(name), pixels(pixels), start(0), cpuStart(0), active(Profiler::isEnabled())
+{
+    if(!active)
+        return;
+    start = Profiler::nanoseconds();
+    cpuStart = Profiler::threadCpuNanoseconds();
+}
+
+Profiler::ScopedTimer::~ScopedTimer()
+{
+    if(!active)
+        return;
+    const qint64 end = Profiler::nanoseconds();
+    Profiler::instance().record(Event{category, name, start, end - start, Profiler::threadCpuNanoseconds() - cpuStart, pixels,
+                                      Profiler::threadIndex()});
+}
+
+Profiler::Profiler()
+    : nbDropped(0)
+{
+}
+
+Profiler& Profiler::instance()
+{
+    static Profiler profiler;
+    return profiler;
+}
+
+void Profiler::setEnabled(const bool enable)
+{
+    enabled = enable;
+}
+
+qint64 Profiler::nanoseconds()
+{
+    static const chrono::steady_clock::time_point processStart = chrono::steady_clock::now();
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - processStart).count();
+}
+
+qint64 Profiler::threadCpuNanoseconds()
+{
+#ifdef Q_OS_WIN
+    FILETIME creation, exitTime, kernel, user;
+    if(!GetThreadTimes(GetCurrentThread(), &creation, &exitTime, &kernel, &user))
+        return 0;
+    // 100 ns units
+    const qint64 kernelTime = (qint64(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime;
+    const qint64 userTime = (qint64(user.dwHighDateTime) << 32) | user.dwLowDateTime;
+    return (kernelTime + userTime) * 100;
+#else
+    timespec time;
+    if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0)
+        return 0;
+    return qint64(time.tv_sec)*1000000000 + time.tv_nsec;
+#endif
+}
+
+int Profiler::threadIndex()
+{
+    if(currentThread < 0)
+        currentThread = nbThreads++;
+    return currentThread;
+}
+
+void Profiler::record(const Event &event)
+{
+    lock_guard<mutex> lock(eventsMutex);
+    if((int)recorded.size() >= maxEvents)
+    {
+        nbDropped++;
+        return;
+    }
+    if(recorded.capacity() == 0)
+        recorded.reserve(4096);
+    recorded.push_back(event);
+}
+
+void Profiler::clear()
+{
+    lock_guard<mutex> lock(eventsMutex);
+    recorded.clear();
+    nbDropped = 0;
+}
+
+int Profiler::eventCount() const
+{
+    lock_guard<mutex> lock(eventsMutex);
+    return recorded.size();
+}
+
+int Profiler::droppedCount() const
+{
+    lock_guard<mutex> lock(eventsMutex);
+    return nbDropped;
+}
+
+vector<Profiler::Event> Profiler::events(const int first) const
+{
+    lock_guard<mutex> lock(eventsMutex);
+    return vector<Event>(recorded.begin() + min<int>(max(first, 0), recorded.size()), recorded.end());
+}
+
+vector<Profiler::Entry> Profiler::summary(const vector<Event> &events)
+{
+    vector<Entry> entries;
+    map<pair<QString, QString>, int> entryIndex;
+    const auto entryOf = [&](const QString &category, const QString &name, const bool estimated) -> Entry&
+    {
+        const pair<QString, QString> key(category, name);
+        auto found = entryIndex.find(key);
+        if(found == entryIndex.end())
+        {
+            found = entryIndex.insert({key, (int)entries.size()}).first;
+            entries.push_back(Entry{category, name, 0, 0.0, 0.0, 0, estimated});
+        }
+        return entries[found->second];
+    };
+    for(const Event &event : events)
+    {
+        Entry &entry = entryOf(QString::fromLatin1(event.category), QString::fromLatin1(event.name), false);
+        entry.count++;
+        entry.wallSeconds += event.wallNanoseconds * 1e-9;
+        entry.cpuSeconds += event.cpuNanoseconds * 1e-9;
+        entry.pixels += event.pixels;
+        // Every part processes the pixels of the event
+        for(const pair<const char*, qint64> &part : event.parts)
+        {
+            Entry &partEntry = entryOf(QStringLiteral("stage"), QString::fromLatin1(part.first), true);
+            partEntry.count++;
+            partEntry.wallSeconds += part.second * 1e-9;
+            partEntry.pixels += event.pixels;
+        }
+    }
+    return entries;
+}
+
+/*
+Timers nest on a thread (a filter around its bands, a strip around its reads), only the
+outermost events of every thread are counted so that nothing is counted twice.
+*/
+Profiler::Totals Profiler::totals(const vector<Event> &events)
+{
+    Totals totals = {};
+    if(events.empty())
+        return totals;
+
+    vector<Event> sorted = events;
+    sort(sorted.begin(), sorted.end(), [](const Event &a, const Event &b)
+    {
+        if(a.thread != b.thread)
+            return a.thread < b.thread;
+        if(a.startNanoseconds != b.startNanoseconds)
+            return a.startNanoseconds < b.startNanoseconds;
+        return a.wallNanoseconds > b.wallNanoseconds;
+    });
+
+    qint64 first = sorted.front().startNanoseconds;
+    qint64 last = first;
+    qint64 busyNanoseconds = 0;
+    int thread = -1;
+    qint64 outerEnd = 0;
+    for(const Event &event : sorted)
+    {
+        const qint64 end = event.startNanoseconds + event.wallNanoseconds;
+        first = min(first, event.startNanoseconds);
+        last = max(last, end);
+        if(event.thread != thread)
+        {
+            thread = event.thread;
+            outerEnd = 0;
+            totals.threads++;
+        }
+        else if(event.startNanoseconds < outerEnd)
+        {
+            continue;
+        }
+        outerEnd = end;
+        busyNanoseconds += event.wallNanoseconds;
+        totals.cpuSeconds += event.cpuNanoseconds * 1e-9;
+        totals.pixels += event.pixels;
+    }
+    totals.wallSeconds = (last - first) * 1e-9;
+    totals.utilization = last > first ? (double)busyNanoseconds / ((double)(last - first) * totals.threads) : 1.0;
+    return totals;
+}
+
+// Complete events ("ph": "X") in microseconds, with the thread names as metadata events
+QJsonDocument Profiler::chromeTrace(const vector<Event> &events)
+{
+    QJsonArray traceEvents;
+    vector<bool> namedThreads;
+    for(const Event &event : events)
+    {
+        if(event.thread >= (int)namedThreads.size())
+            namedThreads.resize(event.thread + 1, false);
+        if(!namedThreads[event.thread])
+        {
+            namedThreads[event.thread] = true;
+            traceEvents.append(QJsonObject{{"name", "thread_name"}, {"ph", "M"}, {"pid", 1}, {"tid", event.thread},
+                                           {"args", QJsonObject{{"name", QStringLiteral("thread %1").arg(event.thread)}}}});
+        }
+        QJsonObject args{{"cpu_ms", event.cpuNanoseconds * 1e-6}};
+        if(event.pixels > 0)
+            args.insert("pixels", event.pixels);
+        for(const pair<const char*, qint64> &part : event.parts)
+        {
+            args.insert(QStringLiteral("%1 ms (estimate)").arg(QString::fromLatin1(part.first)), part.second * 1e-6);
+        }
+        traceEvents.append(QJsonObject{{"name", event.name}, {"cat", event.category}, {"ph", "X"}, {"pid", 1},
+                                       {"tid", event.thread}, {"ts", event.startNanoseconds * 1e-3},
+                                       {"dur", event.wallNanoseconds * 1e-3}, {"args", args}});
+    }
+    return QJsonDocument(QJsonObject{{"traceEvents", traceEvents}, {"displayTimeUnit", "ms"}});
+}
+
+bool Profiler::saveChromeTrace(const QString &path, QString &errorMessage) const
+{
+    QFile file(path);
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        errorMessage = file.errorString();
+        return false;
+    }
+    if(file.write(chromeTrace(events()).toJson(QJsonDocument::Compact)) < 0)
+    {
+        errorMessage = file.errorString();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,238 @@
+#include "Headers/resultcache.h"
+#include "Headers/threadpool.h"
+
+#include <climits>
+#include <cstring>
+#include <vector>
+
+// Rows hashed by one task, fixed so that the hash does not depend on the number of threads
+static const int hashRows = 64;
+// Hashes of images remembered by cacheKey
+static const size_t maxHashes = 64;
+
+static const quint64 prime1 = 0x9E3779B97F4A7C15ULL;
+static const quint64 prime2 = 0xC2B2AE3D27D4EB4FULL;
+
+static inline quint64 rotate(const quint64 x, const int bits)
+{
+    return (x << bits) | (x >> (64 - bits));
+}
+
+// Final mix of MurmurHash3: every bit of the result depends on every bit of x
+static quint64 finalize(quint64 x)
+{
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCDULL;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Both lanes read every word, each with its own mix: together they make a 128 bits hash
+static inline void mixWord(ResultCache::Hash &hash, const quint64 word)
+{
+    hash.low = rotate(hash.low ^ word, 29) * prime1;
+    hash.high = rotate(hash.high + word, 37) * prime2;
+}
+
+/*
+The padding at the end of the rows is not read: an image and its copy have the same hash
+whatever their strides.
+*/
+static ResultCache::Hash hashRowBand(const QImage &image, const int rowStart, const int rowEnd)
+{
+    const qsizetype rowBytes = ((qsizetype)image.width()*image.depth() + 7) / 8;
+    ResultCache::Hash hash{prime1 ^ quint64(rowStart), prime2 + quint64(rowStart)};
+    for(int y=rowStart; y<rowEnd; y++)
+    {
+        const uchar* row = image.constScanLine(y);
+        qsizetype x = 0;
+        for(; x + 8 <= rowBytes; x += 8)
+        {
+            quint64 word;
+            memcpy(&word, row + x, 8);
+            mixWord(hash, word);
+        }
+        if(x < rowBytes)
+        {
+            quint64 word = 0;
+            memcpy(&word, row + x, rowBytes - x);
+            mixWord(hash, word);
+        }
+    }
+    return ResultCache::Hash{finalize(hash.low), finalize(hash.high)};
+}
+
+ResultCache::ResultCache(const qint64 budget)
+    : maxBytes(budget)
+{
+}
+
+// Never destroyed, like the buffer pool: filters may still run on other threads at exit
+ResultCache& ResultCache::instance()
+{
+    static ResultCache* cache = new ResultCache();
+    return *cache;
+}
+
+ResultCache::Hash ResultCache::contentHash(const QImage &image)
+{
+    const qint64 key = image.cacheKey();
+    {
+        lock_guard<mutex> lock(cacheMutex);
+        const auto found = hashes.find(key);
+        if(found != hashes.end())
+            return found->second;
+    }
+
+    // Hashed without the lock, an image hashed by two threads at once gets the same hash
+    const Hash hash = hashImage(image);
+    lock_guard<mutex> lock(cacheMutex);
+    if(hashes.insert({key, hash}).second)
+    {
+        hashedKeys.push_back(key);
+        if(hashedKeys.size() > maxHashes)
+        {
+            hashes.erase(hashedKeys.front());
+            hashedKeys.pop_front();
+        }
+    }
+    return hash;
+}
+
+// The hashes of the bands are computed in parallel and combined in order
+ResultCache::Hash ResultCache::hashImage(const QImage &image)
+{
+    Hash hash{prime2, prime1};
+    mixWord(hash, (quint64(image.width()) << 32) | quint32(image.height()));
+    mixWord(hash, quint64(image.format()));
+    for(const QRgb color : image.colorTable())
+    {
+        mixWord(hash, color);
+    }
+
+    const int nbBands = (image.height() + hashRows - 1) / hashRows;
+    vector<Hash> bandHashes(nbBands);
+    ThreadPool::instance().parallelFor(nbBands, [&](const int band)
+    {
+        bandHashes[band] = hashRowBand(image, band*hashRows, min(image.height(), (band + 1)*hashRows));
+    });
+    for(const Hash &bandHash : bandHashes)
+    {
+        hash.low = rotate(hash.low ^ bandHash.low, 31) * prime1;
+        hash.high = rotate(hash.high + bandHash.high, 27) * prime2;
+    }
+    return Hash{finalize(hash.low ^ hash.high), finalize(hash.high + prime1*hash.low)};
+}
+
+// Move the entry of key, when there is one, to the front
+const ResultCache::Entry* ResultCache::find(Lru &lru, const Key &key)
+{
+    const auto found = lru.index.find(key);
+    if(found == lru.index.end())
+        return nullptr;
+    lru.entries.splice(lru.entries.begin(), lru.entries, found->second);
+    return &found->second->second;
+}
+
+void ResultCache::insert(Lru &lru, const Key &key, const Entry &entry)
+{
+    const auto found = lru.index.find(key);
+    if(found != lru.index.end())
+    {
+        lru.bytes -= found->second->second.bytes;
+        lru.entries.erase(found->second);
+    }
+    lru.entries.push_front({key, entry});
+    lru.index[key] = lru.entries.begin();
+    lru.bytes += entry.bytes;
+}
+
+void ResultCache::trim(Lru &lru, const qint64 maxBytes, const size_t maxEntries)
+{
+    while(!lru.entries.empty() && (lru.bytes > maxBytes || lru.entries.size() > maxEntries))
+    {
+        lru.bytes -= lru.entries.back().second.bytes;
+        lru.index.erase(lru.entries.back().first);
+        lru.entries.pop_back();
+    }
+}
+
+QImage ResultCache::image(const Hash &input, const QString &operation)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    const Entry* entry = find(results, Key(input, operation));
+    return entry ? entry->image : QImage();
+}
+
+void ResultCache::insertImage(const Hash &input, const QString &operation, const QImage &result)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    if(result.isNull() || result.sizeInBytes() > maxBytes)
+        return;
+    insert(results, Key(input, operation), Entry{result, nullptr, nullptr, result.sizeInBytes()});
+    trim(results, maxBytes, results.entries.size());
+}
+
+shared_ptr<const ImageHistograms> ResultCache::histograms(const Hash &input)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    const Entry* entry = find(histogramResults, Key(input, QStringLiteral("histograms")));
+    return entry ? entry->histograms : nullptr;
+}
+
+void ResultCache::insertHistograms(const Hash &input, const ImageHistograms &histograms)
+{
+    const shared_ptr<const ImageHistograms> copy = make_shared<ImageHistograms>(histograms);
+    lock_guard<mutex> lock(cacheMutex);
+    insert(histogramResults, Key(input, QStringLiteral("histograms")), Entry{QImage(), nullptr, copy, sizeof(ImageHistograms)});
+    trim(histogramResults, LLONG_MAX, maxHistograms);
+}
+
+shared_ptr<const IntegralImage> ResultCache::integralImage(const Hash &input, const bool withSquares)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    const Entry* entry = find(results, Key(input, QStringLiteral("integral image with squares")));
+    if(entry == nullptr && !withSquares)
+        entry = find(results, Key(input, QStringLiteral("integral image")));
+    return entry ? entry->integralImage : nullptr;
+}
+
+void ResultCache::insertIntegralImage(const Hash &input, const shared_ptr<const IntegralImage> &integralImage)
+{
+    const QString operation = integralImage->hasSquares() ? QStringLiteral("integral image with squares") : QStringLiteral("integral image");
+    lock_guard<mutex> lock(cacheMutex);
+    if(integralImage->sizeInBytes() > maxBytes)
+        return;
+    insert(results, Key(input, operation), Entry{QImage(), integralImage, nullptr, integralImage->sizeInBytes()});
+    trim(results, maxBytes, results.entries.size());
+}
+
+void ResultCache::clear()
+{
+    lock_guard<mutex> lock(cacheMutex);
+    trim(results, 0, 0);
+    trim(histogramResults, 0, 0);
+    hashes.clear();
+    hashedKeys.clear();
+}
+
+void ResultCache::setBudget(const qint64 budget)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    maxBytes = budget;
+    trim(results, maxBytes, results.entries.size());
+}
+
+qint64 ResultCache::budget() const
+{
+    lock_guard<mutex> lock(cacheMutex);
+    return maxBytes;
+}
+
+qint64 ResultCache::memoryUsed() const
+{
+    lock_guard<mutex> lock(cacheMutex);
+    return results.bytes + histogramResults.bytes;
+}
@@ -0,0 +1,432 @@
+#include "Headers/simdkernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+using namespace std;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMDKERNELS_X86
+#include <immintrin.h>
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+static void grayscaleScalar(const uchar* source, uchar* destination, const int pixelCount)
+{
+    for(int i=0; i<pixelCount*4; i+=4)
+    {
+        const uchar luma = SimdKernels::luma(source + i);
+        destination[i] = luma;
+        destination[i+1] = luma;
+        destination[i+2] = luma;
+        destination[i+3] = source[i+3];
+    }
+}
+
+// min(255, sqrt(i)), i being the squared magnitude / 16
+static const uchar* magnitudeTable()
+{
+    static const vector<uchar> table = []
+    {
+        vector<uchar> values(65536);
+        for(int i=0; i<65536; i++)
+            values[i] = min(255, (int)sqrt((double)i));
+        return values;
+    }();
+    return table.data();
+}
+
+static inline int sobelMagnitude(const int gradientX, const int gradientY, const SimdKernels::GradientMagnitude magnitude)
+{
+    switch(magnitude)
+    {
+    case SimdKernels::MagnitudeL1:
+        return min((abs(gradientX) + abs(gradientY)) >> 2, 255);
+    case SimdKernels::MagnitudeLut:
+        return magnitudeTable()[min((gradientX*gradientX + gradientY*gradientY) >> 4, 65535)];
+    default:
+        return min((int)(sqrtf((float)(gradientX*gradientX + gradientY*gradientY)) * 0.25f), 255);
+    }
+}
+
+static void lumaScalar(const uchar* source, uchar* destination, const int pixelCount)
+{
+    for(int i=0; i<pixelCount; i++)
+    {
+        destination[i] = SimdKernels::luma(source + 4*i);
+    }
+}
+
+// Scalar Sobel on the bytes [start, end) of the row, pixels being step bytes apart
+static void sobelRowScalar(const uchar* above, const uchar* row, const uchar* below, uchar* destination, const int start, const int end,
+                           const int step, const SimdKernels::GradientMagnitude magnitude)
+{
+    for(int i=start; i<end; i++)
+    {
+        if(step == 4 && (i & 3) == 3)
+        {
+            destination[i] = 255;
+            continue;
+        }
+        const int gradientX = (above[i+2*step] - above[i]) + 2*(row[i+2*step] - row[i]) + (below[i+2*step] - below[i]);
+        const int gradientY = (below[i] + 2*below[i+step] + below[i+2*step]) - (above[i] + 2*above[i+step] + above[i+2*step]);
+        destination[i] = sobelMagnitude(gradientX, gradientY, magnitude);
+    }
+}
+
+#ifdef SIMDKERNELS_X86
+/*
+Each 32 bit lane holds one pixel: the three color bytes are isolated with shifts and
+masks and multiplied with madd (the high 16 bits of every lane are zero). grayscale4
+then replicates the luma in bytes 0..2 and keeps the alpha byte.
+*/
+TARGET_SSE2 static inline __m128i luma4(const __m128i pixels)
+{
+    const __m128i byteMask = _mm_set1_epi32(0xFF);
+    const __m128i c0 = _mm_and_si128(pixels, byteMask);
+    const __m128i c1 = _mm_and_si128(_mm_srli_epi32(pixels, 8), byteMask);
+    const __m128i c2 = _mm_and_si128(_mm_srli_epi32(pixels, 16), byteMask);
+    __m128i sum = _mm_madd_epi16(c0, _mm_set1_epi32(SimdKernels::lumaWeight0));
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(c1, _mm_set1_epi32(SimdKernels::lumaWeight1)));
+    sum = _mm_add_epi32(sum, _mm_madd_epi16(c2, _mm_set1_epi32(SimdKernels::lumaWeight2)));
+    return _mm_srli_epi32(sum, SimdKernels::lumaShift);
+}
+
+TARGET_SSE2 static inline __m128i grayscale4(const __m128i pixels)
+{
+    const __m128i luma = luma4(pixels);
+    const __m128i gray = _mm_or_si128(luma, _mm_or_si128(_mm_slli_epi32(luma, 8), _mm_slli_epi32(luma, 16)));
+    return _mm_or_si128(gray, _mm_andnot_si128(_mm_set1_epi32(0x00FFFFFF), pixels));
+}
+
+TARGET_SSE2 static void grayscaleSSE2(const uchar* source, uchar* destination, const int pixelCount)
+{
+    int i = 0;
+    for(; i + 8 <= pixelCount; i += 8)
+    {
+        const __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 4*i));
+        const __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 4*i + 16));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 4*i), grayscale4(p0));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + 4*i + 16), grayscale4(p1));
+    }
+    grayscaleScalar(source + 4*i, destination + 4*i, pixelCount - i);
+}
+
+// 16 pixels to 16 luma bytes
+TARGET_SSE2 static void lumaSSE2(const uchar* source, uchar* destination, const int pixelCount)
+{
+    int i = 0;
+    for(; i + 16 <= pixelCount; i += 16)
+    {
+        __m128i luma[4];
+        for(int k=0; k<4; k++)
+            luma[k] = luma4(_mm_loadu_si128(reinterpret_cast<const __m128i*>(source + 4*i + 16*k)));
+        const __m128i words = _mm_packs_epi32(luma[0], luma[1]);
+        const __m128i words2 = _mm_packs_epi32(luma[2], luma[3]);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_packus_epi16(words, words2));
+    }
+    lumaScalar(source + 4*i, destination + i, pixelCount - i);
+}
+
+TARGET_AVX2 static inline __m256i luma8(const __m256i pixels)
+{
+    const __m256i byteMask = _mm256_set1_epi32(0xFF);
+    const __m256i c0 = _mm256_and_si256(pixels, byteMask);
+    const __m256i c1 = _mm256_and_si256(_mm256_srli_epi32(pixels, 8), byteMask);
+    const __m256i c2 = _mm256_and_si256(_mm256_srli_epi32(pixels, 16), byteMask);
+    __m256i sum = _mm256_madd_epi16(c0, _mm256_set1_epi32(SimdKernels::lumaWeight0));
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(c1, _mm256_set1_epi32(SimdKernels::lumaWeight1)));
+    sum = _mm256_add_epi32(sum, _mm256_madd_epi16(c2, _mm256_set1_epi32(SimdKernels::lumaWeight2)));
+    return _mm256_srli_epi32(sum, SimdKernels::lumaShift);
+}
+
+TARGET_AVX2 static inline __m256i grayscale8(const __m256i pixels)
+{
+    const __m256i luma = luma8(pixels);
+    const __m256i gray = _mm256_or_si256(luma, _mm256_or_si256(_mm256_slli_epi32(luma, 8), _mm256_slli_epi32(luma, 16)));
+    return _mm256_or_si256(gray, _mm256_andnot_si256(_mm256_set1_epi32(0x00FFFFFF), pixels));
+}
+
+TARGET_AVX2 static void grayscaleAVX2(const uchar* source, uchar* destination, const int pixelCount)
+{
+    int i = 0;
+    for(; i + 32 <= pixelCount; i += 32)
+    {
+        for(int k=0; k<4; k++)
+        {
+            const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + 4*i + 32*k));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + 4*i + 32*k), grayscale8(pixels));
+        }
+    }
+    grayscaleSSE2(source + 4*i, destination + 4*i, pixelCount - i);
+}
+
+/*
+32 pixels to 32 luma bytes. The packs work on 128 bit halves, the dwords of the result
+are put back in order with a permutation.
+*/
+TARGET_AVX2 static void lumaAVX2(const uchar* source, uchar* destination, const int pixelCount)
+{
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int i = 0;
+    for(; i + 32 <= pixelCount; i += 32)
+    {
+        __m256i luma[4];
+        for(int k=0; k<4; k++)
+            luma[k] = luma8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + 4*i + 32*k)));
+        const __m256i words = _mm256_packs_epi32(luma[0], luma[1]);
+        const __m256i words2 = _mm256_packs_epi32(luma[2], luma[3]);
+        const __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(words, words2), order);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination + i), bytes);
+    }
+    lumaSSE2(source + 4*i, destination + i, pixelCount - i);
+}
+
+/*
+Sobel on 8 bytes widened to int16 lanes (|G| <= 1020). The squared magnitude of 4 lanes
+is computed with madd on interleaved (Gx, Gy) pairs.
+*/
+TARGET_SSE2 static inline __m128i loadWords8(const uchar* p)
+{
+    return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)), _mm_setzero_si128());
+}
+
+TARGET_SSE2 static inline void sobel8(const uchar* above, const uchar* row, const uchar* below, const int step, __m128i& gradientX, __m128i& gradientY)
+{
+    const __m128i aboveLeft = loadWords8(above), aboveCenter = loadWords8(above + step), aboveRight = loadWords8(above + 2*step);
+    const __m128i belowLeft = loadWords8(below), belowCenter = loadWords8(below + step), belowRight = loadWords8(below + 2*step);
+    const __m128i rowDifference = _mm_sub_epi16(loadWords8(row + 2*step), loadWords8(row));
+    gradientX = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(aboveRight, aboveLeft), _mm_sub_epi16(belowRight, belowLeft)),
+                              _mm_add_epi16(rowDifference, rowDifference));
+    const __m128i belowSum = _mm_add_epi16(_mm_add_epi16(belowLeft, belowRight), _mm_add_epi16(belowCenter, belowCenter));
+    const __m128i aboveSum = _mm_add_epi16(_mm_add_epi16(aboveLeft, aboveRight), _mm_add_epi16(aboveCenter, aboveCenter));
+    gradientY = _mm_sub_epi16(belowSum, aboveSum);
+}
+
+TARGET_SSE2 static inline __m128i l2Magnitude4(const __m128i squares)
+{
+    const __m128 magnitude = _mm_mul_ps(_mm_sqrt_ps(_mm_cvtepi32_ps(squares)), _mm_set1_ps(0.25f));
+    return _mm_cvttps_epi32(magnitude);
+}
+
+TARGET_SSE2 static void sobelRowSSE2(const uchar* above, const uchar* row, const uchar* below, uchar* destination, const int width,
+                                     const int bytesPerPixel, const SimdKernels::GradientMagnitude magnitude)
+{
+    const int rowBytes = bytesPerPixel*width;
+    const __m128i opaque = bytesPerPixel == 4 ? _mm_set1_epi32(0xFF000000) : _mm_setzero_si128();
+    alignas(16) qint32 squares[16];
+    int i = 0;
+    for(; i + 16 <= rowBytes; i += 16)
+    {
+        __m128i gradientX[2], gradientY[2];
+        sobel8(above + i, row + i, below + i, bytesPerPixel, gradientX[0], gradientY[0]);
+        sobel8(above + i + 8, row + i + 8, below + i + 8, bytesPerPixel, gradientX[1], gradientY[1]);
+
+        __m128i result;
+        if(magnitude == SimdKernels::MagnitudeL1)
+        {
+            __m128i sums[2];
+            for(int k=0; k<2; k++)
+            {
+                const __m128i absX = _mm_max_epi16(gradientX[k], _mm_sub_epi16(_mm_setzero_si128(), gradientX[k]));
+                const __m128i absY = _mm_max_epi16(gradientY[k], _mm_sub_epi16(_mm_setzero_si128(), gradientY[k]));
+                sums[k] = _mm_srai_epi16(_mm_add_epi16(absX, absY), 2);
+            }
+            result = _mm_packus_epi16(sums[0], sums[1]);
+        }
+        else
+        {
+            __m128i words[2];
+            for(int k=0; k<2; k++)
+            {
+                const __m128i low = _mm_unpacklo_epi16(gradientX[k], gradientY[k]);
+                const __m128i high = _mm_unpackhi_epi16(gradientX[k], gradientY[k]);
+                __m128i squaresLow = _mm_madd_epi16(low, low);
+                __m128i squaresHigh = _mm_madd_epi16(high, high);
+                if(magnitude == SimdKernels::MagnitudeLut)
+                {
+                    _mm_store_si128(reinterpret_cast<__m128i*>(squares + 8*k), squaresLow);
+                    _mm_store_si128(reinterpret_cast<__m128i*>(squares + 8*k + 4), squaresHigh);
+                    continue;
+                }
+                words[k] = _mm_packs_epi32(l2Magnitude4(squaresLow), l2Magnitude4(squaresHigh));
+            }
+            if(magnitude == SimdKernels::MagnitudeLut)
+            {
+                const uchar* table = magnitudeTable();
+                for(int k=0; k<16; k++)
+                    destination[i+k] = table[min(squares[k] >> 4, 65535)];
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i),
+                                 _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(destination + i)), opaque));
+                continue;
+            }
+            result = _mm_packus_epi16(words[0], words[1]);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_or_si128(result, opaque));
+    }
+    sobelRowScalar(above, row, below, destination, i, rowBytes, bytesPerPixel, magnitude);
+}
+
+TARGET_AVX2 static inline __m256i loadWords16(const uchar* p)
+{
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+TARGET_AVX2 static inline void sobel16(const uchar* above, const uchar* row, const uchar* below, const int step, __m256i& gradientX, __m256i& gradientY)
+{
+    const __m256i aboveLeft = loadWords16(above), aboveCenter = loadWords16(above + step), aboveRight = loadWords16(above + 2*step);
+    const __m256i belowLeft = loadWords16(below), belowCenter = loadWords16(below + step), belowRight = loadWords16(below + 2*step);
+    const __m256i rowDifference = _mm256_sub_epi16(loadWords16(row + 2*step), loadWords16(row));
+    gradientX = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(aboveRight, aboveLeft), _mm256_sub_epi16(belowRight, belowLeft)),
+                                 _mm256_add_epi16(rowDifference, rowDifference));
+    const __m256i belowSum = _mm256_add_epi16(_mm256_add_epi16(belowLeft, belowRight), _mm256_add_epi16(belowCenter, belowCenter));
+    const __m256i aboveSum = _mm256_add_epi16(_mm256_add_epi16(aboveLeft, aboveRight), _mm256_add_epi16(aboveCenter, aboveCenter));
+    gradientY = _mm256_sub_epi16(belowSum, aboveSum);
+}
+
+TARGET_AVX2 static inline __m256i l2Magnitude8(const __m256i squares)
+{
+    const __m256 magnitude = _mm256_mul_ps(_mm256_sqrt_ps(_mm256_cvtepi32_ps(squares)), _mm256_set1_ps(0.25f));
+    return _mm256_cvttps_epi32(magnitude);
+}
+
+// 16 int16 lanes back to 16 bytes with unsigned saturation, in order
+TARGET_AVX2 static inline __m128i packBytes16(const __m256i words)
+{
+    const __m256i packed = _mm256_packus_epi16(words, words);
+    return _mm256_castsi256_si128(_mm256_permute4x64_epi64(packed, 0xD8));
+}
+
+TARGET_AVX2 static void sobelRowAVX2(const uchar* above, const uchar* row, const uchar* below, uchar* destination, const int width,
+                                     const int bytesPerPixel, const SimdKernels::GradientMagnitude magnitude)
+{
+    const int rowBytes = bytesPerPixel*width;
+    const __m128i opaque = bytesPerPixel == 4 ? _mm_set1_epi32(0xFF000000) : _mm_setzero_si128();
+    int i = 0;
+    for(; i + 16 <= rowBytes; i += 16)
+    {
+        __m256i gradientX, gradientY;
+        sobel16(above + i, row + i, below + i, bytesPerPixel, gradientX, gradientY);
+
+        __m256i words;
+        if(magnitude == SimdKernels::MagnitudeL1)
+        {
+            words = _mm256_srai_epi16(_mm256_add_epi16(_mm256_abs_epi16(gradientX), _mm256_abs_epi16(gradientY)), 2);
+        }
+        else
+        {
+            // unpack and pack both work on 128 bit halves, so the lane order is restored by packs
+            const __m256i low = _mm256_unpacklo_epi16(gradientX, gradientY);
+            const __m256i high = _mm256_unpackhi_epi16(gradientX, gradientY);
+            const __m256i squaresLow = _mm256_madd_epi16(low, low);
+            const __m256i squaresHigh = _mm256_madd_epi16(high, high);
+            if(magnitude == SimdKernels::MagnitudeLut)
+            {
+                const __m256i maxIndex = _mm256_set1_epi32(65535);
+                const __m256i indices = _mm256_packus_epi32(_mm256_min_epi32(_mm256_srli_epi32(squaresLow, 4), maxIndex),
+                                                            _mm256_min_epi32(_mm256_srli_epi32(squaresHigh, 4), maxIndex));
+                alignas(32) quint16 tableIndices[16];
+                _mm256_store_si256(reinterpret_cast<__m256i*>(tableIndices), indices);
+                const uchar* table = magnitudeTable();
+                for(int k=0; k<16; k++)
+                    destination[i+k] = table[tableIndices[k]];
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i),
+                                 _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(destination + i)), opaque));
+                continue;
+            }
+            words = _mm256_packs_epi32(l2Magnitude8(squaresLow), l2Magnitude8(squaresHigh));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + i), _mm_or_si128(packBytes16(words), opaque));
+    }
+    sobelRowScalar(above, row, below, destination, i, rowBytes, bytesPerPixel, magnitude);
+}
+#endif
+
+SimdKernels::InstructionSet SimdKernels::detectInstructionSet()
+{
+#ifdef SIMDKERNELS_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+        return AVX2;
+    if(__builtin_cpu_supports("sse2"))
+        return SSE2;
+#endif
+    return Scalar;
+}
+
+static std::atomic<int> selectedInstructionSet(-1);
+
+SimdKernels::InstructionSet SimdKernels::instructionSet()
+{
+    int selected = selectedInstructionSet.load(std::memory_order_relaxed);
+    if(selected < 0)
+    {
+        selected = detectInstructionSet();
+        selectedInstructionSet.store(selected, std::memory_order_relaxed);
+    }
+    return static_cast<InstructionSet>(selected);
+}
+
+void SimdKernels::setInstructionSet(InstructionSet instructionSet)
+{
+    selectedInstructionSet.store(std::min(instructionSet, detectInstructionSet()), std::memory_order_relaxed);
+}
+
+void SimdKernels::grayscale(const uchar* source, uchar* destination, const int pixelCount)
+{
+    switch(instructionSet())
+    {
+#ifdef SIMDKERNELS_X86
+    case AVX2:
+        grayscaleAVX2(source, destination, pixelCount);
+        break;
+    case SSE2:
+        grayscaleSSE2(source, destination, pixelCount);
+        break;
+#endif
+    default:
+        grayscaleScalar(source, destination, pixelCount);
+        break;
+    }
+}
+
+void SimdKernels::luma(const uchar* source, uchar* destination, const int pixelCount)
+{
+    switch(instructionSet())
+    {
+#ifdef SIMDKERNELS_X86
+    case AVX2:
+        lumaAVX2(source, destination, pixelCount);
+        break;
+    case SSE2:
+        lumaSSE2(source, destination, pixelCount);
+        break;
+#endif
+    default:
+        lumaScalar(source, destination, pixelCount);
+        break;
+    }
+}
+
+void SimdKernels::sobelRow(const uchar* above, const uchar* row, const uchar* below, uchar* destination, const int width,
+                           const GradientMagnitude magnitude, const int bytesPerPixel)
+{
+    switch(instructionSet())
+    {
+#ifdef SIMDKERNELS_X86
+    case AVX2:
+        sobelRowAVX2(above, row, below, destination, width, bytesPerPixel, magnitude);
+        break;
+    case SSE2:
+        sobelRowSSE2(above, row, below, destination, width, bytesPerPixel, magnitude);
+        break;
+#endif
+    default:
+        sobelRowScalar(above, row, below, destination, 0, bytesPerPixel*width, bytesPerPixel, magnitude);
+        break;
+    }
+}
@@ -0,0 +1,343 @@
+#include "Headers/stripio.h"
+
+#include <QFileInfo>
+#include <QImageReader>
+
+#include <cctype>
+#include <cstring>
+
+unique_ptr<StripReader> StripReader::create(const QString &path)
+{
+    if(MappedImage::isMappedImage(path))
+    {
+        return unique_ptr<StripReader>(new MappedStripReader());
+    }
+    QFile file(path);
+    char magic[2] = {};
+    if(file.open(QIODevice::ReadOnly) && file.read(magic, 2) == 2 && magic[0] == 'P' && (magic[1] == '5' || magic[1] == '6'))
+    {
+        return unique_ptr<StripReader>(new PnmStripReader());
+    }
+    return unique_ptr<StripReader>(new QImageStripReader());
+}
+
+// Next number of a PNM header, skipping blanks and comments
+static bool readHeaderNumber(QFile &file, int &value)
+{
+    char c;
+    do
+    {
+        if(!file.getChar(&c))
+            return false;
+        if(c == '#')
+        {
+            while(c != '\n' && file.getChar(&c)) {}
+        }
+    }
+    while(isspace((uchar)c) || c == '#');
+
+    value = 0;
+    while(isdigit((uchar)c))
+    {
+        value = 10*value + (c - '0');
+        if(value > 1000000000)
+            return false;
+        if(!file.getChar(&c))
+            return false;
+    }
+    // A single blank ends the number
+    return isspace((uchar)c);
+}
+
+bool PnmStripReader::open(const QString &path)
+{
+    file.setFileName(path);
+    if(!file.open(QIODevice::ReadOnly))
+    {
+        error = file.errorString();
+        return false;
+    }
+    char magic[2] = {};
+    int maxValue = 0;
+    if(file.read(magic, 2) != 2 || magic[0] != 'P' || (magic[1] != '5' && magic[1] != '6')
+            || !readHeaderNumber(file, imageWidth) || !readHeaderNumber(file, imageHeight) || !readHeaderNumber(file, maxValue)
+            || imageWidth <= 0 || imageHeight <= 0)
+    {
+        error = QStringLiteral("not a binary PGM or PPM file");
+        return false;
+    }
+    if(maxValue != 255)
+    {
+        error = QStringLiteral("only 8 bits samples are supported");
+        return false;
+    }
+    fileChannels = magic[1] == '5' ? 1 : 3;
+    imageFormat = fileChannels == 1 ? QImage::Format_Grayscale8 : QImage::Format_RGB32;
+    dataOffset = file.pos();
+    if(file.size() < dataOffset + (qint64)imageWidth*imageHeight*fileChannels)
+    {
+        error = QStringLiteral("truncated file");
+        return false;
+    }
+    return true;
+}
+
+bool PnmStripReader::readRows(const int y, const MutableImageView &rows)
+{
+    const qint64 fileRowBytes = (qint64)imageWidth*fileChannels;
+    if(!file.seek(dataOffset + y*fileRowBytes))
+    {
+        error = file.errorString();
+        return false;
+    }
+    if(fileChannels == 1)
+    {
+        for(int i=0; i<rows.height; i++)
+        {
+            if(file.read((char*)rows.row(i), fileRowBytes) != fileRowBytes)
+            {
+                error = file.errorString();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    QImage packed(imageWidth, rows.height, QImage::Format_RGB888);
+    for(int i=0; i<rows.height; i++)
+    {
+        if(file.read((char*)packed.scanLine(i), fileRowBytes) != fileRowBytes)
+        {
+            error = file.errorString();
+            return false;
+        }
+    }
+    const QImage converted = packed.convertToFormat(imageFormat);
+    for(int i=0; i<rows.height; i++)
+    {
+        memcpy(rows.row(i), converted.constScanLine(i), rows.rowBytes());
+    }
+    return true;
+}
+
+bool QImageStripReader::open(const QString &path)
+{
+    file.setFileName(path);
+    if(!file.open(QIODevice::ReadOnly))
+    {
+        error = file.errorString();
+        return false;
+    }
+    QImageReader reader(&file);
+    if(!reader.canRead())
+    {
+        error = reader.errorString();
+        return false;
+    }
+    fileFormat = reader.format();
+    const QSize size = reader.size();
+    clipRectSupported = reader.supportsOption(QImageIOHandler::ClipRect) && size.isValid();
+    imageFormat = reader.imageFormat() == QImage::Format_Grayscale8 ? QImage::Format_Grayscale8 : QImage::Format_ARGB32;
+    decoded = QImage();
+    decodedFirst = 0;
+    if(size.isValid())
+    {
+        imageWidth = size.width();
+        imageHeight = size.height();
+        return true;
+    }
+
+    // The size is only known once decoded
+    if(!decode(0, 0))
+        return false;
+    imageWidth = decoded.width();
+    imageHeight = decoded.height();
+    return !overBudget(decoded.sizeInBytes());
+}
+
+bool QImageStripReader::overBudget(const qint64 bytes)
+{
+    if(bytes <= budget)
+        return false;
+    error = QStringLiteral("%1 images are decoded whole: %2 MB, over the memory budget of %3 MB")
+            .arg(QString::fromLatin1(fileFormat)).arg(bytes / (1024*1024)).arg(budget / (1024*1024));
+    decoded = QImage();
+    return true;
+}
+
+// Rows [y, y + rows) when the format supports ClipRect, the whole image otherwise
+bool QImageStripReader::decode(const int y, const int rows)
+{
+    if(!file.seek(0))
+    {
+        error = file.errorString();
+        return false;
+    }
+    QImageReader reader(&file, fileFormat);
+    if(clipRectSupported)
+        reader.setClipRect(QRect(0, y, imageWidth, rows));
+    QImage image;
+    if(!reader.read(&image))
+    {
+        error = reader.errorString();
+        return false;
+    }
+    decoded = image.convertToFormat(imageFormat);
+    decodedFirst = clipRectSupported ? y : 0;
+    return true;
+}
+
+bool QImageStripReader::readRows(const int y, const MutableImageView &rows)
+{
+    if(decoded.isNull() || y < decodedFirst || y + rows.height > decodedFirst + decoded.height())
+    {
+        const qint64 rowBytes = ImageView::defaultStride(imageWidth, ImageView::channelsOf(imageFormat));
+        if(!clipRectSupported)
+        {
+            if(overBudget(rowBytes*imageHeight) || !decode(0, imageHeight))
+                return false;
+        }
+        else
+        {
+            const int chunk = (int)min<qint64>(max<qint64>(rows.height, budget / rowBytes), imageHeight - y);
+            if(!decode(y, chunk))
+                return false;
+        }
+    }
+    for(int i=0; i<rows.height; i++)
+    {
+        memcpy(rows.row(i), decoded.constScanLine(y - decodedFirst + i), rows.rowBytes());
+    }
+    return true;
+}
+
+bool MappedStripReader::open(const QString &path)
+{
+    if(!file.open(path))
+    {
+        error = file.errorString();
+        return false;
+    }
+    imageWidth = file.width();
+    imageHeight = file.height();
+    imageFormat = ImageView::supportedFormat(file.format(), false);
+    return true;
+}
+
+bool MappedStripReader::readRows(const int y, const MutableImageView &rows)
+{
+    const QImage image = file.image();
+    const QImage strip = QImage(image.constScanLine(y), imageWidth, rows.height, image.bytesPerLine(), image.format()).convertToFormat(imageFormat);
+    for(int i=0; i<rows.height; i++)
+    {
+        memcpy(rows.row(i), strip.constScanLine(i), rows.rowBytes());
+    }
+    return true;
+}
+
+ImageView MappedStripReader::mappedView() const
+{
+    return file.view();
+}
+
+unique_ptr<StripWriter> StripWriter::create(const QString &path)
+{
+    if(QFileInfo(path).suffix() == QLatin1String(MappedImage::suffix))
+    {
+        return unique_ptr<StripWriter>(new MappedStripWriter());
+    }
+    return unique_ptr<StripWriter>(new PnmStripWriter());
+}
+
+bool PnmStripWriter::open(const QString &path, const int width, const int height, const QImage::Format format)
+{
+    imageFormat = format;
+    file.setFileName(path);
+    if(!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        error = file.errorString();
+        return false;
+    }
+    const QByteArray header = QStringLiteral("P%1\n%2 %3\n255\n").arg(format == QImage::Format_Grayscale8 ? 5 : 6).arg(width).arg(height).toLatin1();
+    if(file.write(header) != header.size())
+    {
+        error = file.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool PnmStripWriter::writeRows(const ImageView &rows)
+{
+    if(imageFormat == QImage::Format_Grayscale8)
+    {
+        for(int i=0; i<rows.height; i++)
+        {
+            if(file.write((const char*)rows.row(i), rows.width) != rows.width)
+            {
+                error = file.errorString();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const QImage packed = QImage(rows.data, rows.width, rows.height, rows.stride, imageFormat).convertToFormat(QImage::Format_RGB888);
+    for(int i=0; i<rows.height; i++)
+    {
+        if(file.write((const char*)packed.constScanLine(i), 3*rows.width) != 3*rows.width)
+        {
+            error = file.errorString();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PnmStripWriter::close()
+{
+    if(!file.flush())
+    {
+        error = file.errorString();
+        return false;
+    }
+    file.close();
+    return true;
+}
+
+bool MappedStripWriter::open(const QString &path, const int width, const int height, const QImage::Format format)
+{
+    nextRow = 0;
+    if(!file.create(path, width, height, format))
+    {
+        error = file.errorString();
+        return false;
+    }
+    return true;
+}
+
+bool MappedStripWriter::writeRows(const ImageView &rows)
+{
+    const MutableImageView destination = mappedRows(nextRow, rows.height);
+    for(int i=0; i<rows.height; i++)
+    {
+        memcpy(destination.row(i), rows.row(i), rows.rowBytes());
+    }
+    nextRow += rows.height;
+    return true;
+}
+
+MutableImageView MappedStripWriter::mappedRows(const int y, const int height)
+{
+    const MutableImageView image = file.mutableView();
+    if(image.data == nullptr)
+        return image;
+    return MutableImageView(image.row(y), image.width, height, image.stride, image.channels);
+}
+
+// Unmapping writes the pages back
+bool MappedStripWriter::close()
+{
+    file.close();
+    return true;
+}
@@ -0,0 +1,164 @@
+#include "Headers/stripprocessor.h"
+#include "Headers/imagebufferpool.h"
+#include "Headers/profiler.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+
+StripProcessor::StripProcessor(const FilterPipeline &pipeline)
+    : pipeline(pipeline)
+    , budget(256*1024*1024)
+{
+}
+
+void StripProcessor::setMemoryBudget(const qint64 bytes)
+{
+    budget = max<qint64>(bytes, 0);
+}
+
+qint64 StripProcessor::memoryBudget() const
+{
+    return budget;
+}
+
+int StripProcessor::stripHeight(const int width, const QImage::Format sourceFormat) const
+{
+    const int halo = pipeline.halo();
+    const qint64 sourceStride = ImageView::defaultStride(width, ImageView::channelsOf(sourceFormat));
+    const qint64 resultStride = ImageView::defaultStride(width, ImageView::channelsOf(pipeline.resultFormat(sourceFormat)));
+    // Source strip with its halos, and result strip
+    const qint64 rows = (budget - 2*halo*sourceStride) / (sourceStride + resultStride);
+    return (int)max<qint64>(min<qint64>(rows, INT_MAX), 1);
+}
+
+QString StripProcessor::errorString() const
+{
+    return error;
+}
+
+QSize StripProcessor::imageSize() const
+{
+    return size;
+}
+
+bool StripProcessor::process(const QString &inputPath, const QString &outputPath)
+{
+    unique_ptr<StripReader> reader = StripReader::create(inputPath);
+    reader->setMemoryBudget(budget);
+    if(!reader->open(inputPath))
+    {
+        error = inputPath + ": " + reader->errorString();
+        return false;
+    }
+    unique_ptr<StripWriter> writer = StripWriter::create(outputPath);
+    if(!writer->open(outputPath, reader->width(), reader->height(), pipeline.resultFormat(reader->format())))
+    {
+        error = outputPath + ": " + writer->errorString();
+        return false;
+    }
+    return process(*reader, *writer);
+}
+
+// The writer is open for an image of the size of the source, of format pipeline.resultFormat(reader.format())
+bool StripProcessor::process(StripReader &reader, StripWriter &writer)
+{
+    error.clear();
+    size = QSize(reader.width(), reader.height());
+    reader.setMemoryBudget(budget);
+    int threshold = -1;
+    if(pipeline.hasPercentileThreshold())
+    {
+        quint32 histogram[256] = {};
+        if(!runPass(reader, nullptr, histogram, -1))
+            return false;
+        threshold = pipeline.percentileThresholdValue(histogram, (qint64)reader.width()*reader.height());
+    }
+    return runPass(reader, &writer, nullptr, threshold);
+}
+
+/*
+Strip [y0, y1) of the result needs the source rows [y0 - halo, y1 + halo): the 2 halo
+rows at the bottom of the previous source strip are moved to the top of the buffer, and
+only the rows below them are read. A mapped source is read in place, and the result
+strips are computed directly into a mapped destination.
+*/
+bool StripProcessor::runPass(StripReader &reader, StripWriter* writer, quint32 histogram[], const int threshold)
+{
+    const int width = reader.width();
+    const int height = reader.height();
+    const int halo = pipeline.halo();
+    const int channels = ImageView::channelsOf(reader.format());
+    const QImage::Format resultFormat = pipeline.resultFormat(reader.format());
+    const int resultChannels = ImageView::channelsOf(resultFormat);
+    const int strip = min(stripHeight(width, reader.format()), height);
+    const ImageView mappedSource = reader.mappedView();
+    const int bufferRows = mappedSource.isNull() ? min(strip + 2*halo, height) : 0;
+    const qsizetype stride = ImageView::defaultStride(width, channels);
+    const qsizetype resultStride = ImageView::defaultStride(width, resultChannels);
+
+    PooledBuffer<uchar> sourceRows(bufferRows*stride);
+    PooledBuffer<uchar> resultRows;
+    int bufferFirst = 0;
+    int bufferEnd = 0;
+
+    for(int y0=0; y0<height; y0+=strip)
+    {
+        const int y1 = min(y0 + strip, height);
+        PROFILE_SCOPE("strip", writer != nullptr ? "strip" : "histogram strip", (qint64)(y1 - y0)*width);
+
+        ImageView source = mappedSource;
+        if(mappedSource.isNull())
+        {
+            const int needFirst = max(y0 - halo, 0);
+            const int needEnd = min(y1 + halo, height);
+
+            // Carry the rows already read
+            const int kept = max(bufferEnd - needFirst, 0);
+            if(kept > 0 && needFirst != bufferFirst)
+                memmove(sourceRows.data(), sourceRows.data() + (needFirst - bufferFirst)*stride, kept*stride);
+            const MutableImageView newRows(sourceRows.data() + kept*stride, width, needEnd - needFirst - kept, stride, channels);
+            if(newRows.height > 0)
+            {
+                PROFILE_SCOPE("io", "read rows", (qint64)newRows.height*width);
+                if(!reader.readRows(needFirst + kept, newRows))
+                {
+                    error = reader.errorString();
+                    return false;
+                }
+            }
+            bufferFirst = needFirst;
+            bufferEnd = needEnd;
+            source = ImageView(sourceRows.data(), width, bufferEnd - bufferFirst, stride, channels);
+        }
+
+        MutableImageView result;
+        if(writer != nullptr)
+            result = writer->mappedRows(y0, y1 - y0);
+        const bool inPlace = result.data != nullptr;
+        if(!inPlace)
+        {
+            resultRows.resize(strip*resultStride);
+            result = MutableImageView(resultRows.data(), width, y1 - y0, resultStride, resultChannels);
+        }
+        pipeline.runRows(source, bufferFirst, height, result, y0, y1, histogram);
+        if(writer == nullptr)
+            continue;
+        if(threshold >= 0)
+            pipeline.binarize(result, threshold);
+        if(inPlace)
+            continue;
+        PROFILE_SCOPE("io", "write rows", (qint64)result.height*width);
+        if(!writer->writeRows(result))
+        {
+            error = writer->errorString();
+            return false;
+        }
+    }
+    if(writer != nullptr && !writer->close())
+    {
+        error = writer->errorString();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,174 @@
+#include "Headers/threadpool.h"
+
+#include <algorithm>
+#include <chrono>
+
+// Pool and queue index of the current thread, if it is a worker
+static thread_local ThreadPool* currentPool = nullptr;
+static thread_local int currentWorker = -1;
+
+ThreadPool::ThreadPool(const int nbWorkers)
+    : queuedTasks(0)
+    , stopping(false)
+{
+    for(int i=0; i<nbWorkers; i++)
+    {
+        workerQueues.push_back(unique_ptr<WorkQueue>(new WorkQueue()));
+    }
+    for(int i=0; i<nbWorkers; i++)
+    {
+        workers.push_back(thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    for_each(workers.begin(),workers.end(),
+        mem_fn(&thread::join));
+}
+
+ThreadPool& ThreadPool::instance()
+{
+    static ThreadPool pool(max<int>(thread::hardware_concurrency(), 2) - 1);
+    return pool;
+}
+
+int ThreadPool::threadCount() const
+{
+    return workers.size() + 1;
+}
+
+void ThreadPool::submit(TaskGroup& group, const function<void()>& task)
+{
+    group.pending++;
+    // Workers push on their own deque (depth first for nested tasks), other threads on the shared queue
+    WorkQueue& queue = currentPool == this ? *workerQueues[currentWorker] : sharedQueue;
+    {
+        lock_guard<mutex> lock(queue.queueMutex);
+        queue.tasks.push_back(Task{task, &group});
+    }
+    queuedTasks++;
+    {
+        lock_guard<mutex> lock(sleepMutex);
+    }
+    workAvailable.notify_one();
+}
+
+bool ThreadPool::popTask(const int workerIndex, Task& task)
+{
+    if(workerIndex >= 0)
+    {
+        WorkQueue& own = *workerQueues[workerIndex];
+        lock_guard<mutex> lock(own.queueMutex);
+        if(!own.tasks.empty())
+        {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            queuedTasks--;
+            return true;
+        }
+    }
+
+    {
+        lock_guard<mutex> lock(sharedQueue.queueMutex);
+        if(!sharedQueue.tasks.empty())
+        {
+            task = std::move(sharedQueue.tasks.front());
+            sharedQueue.tasks.pop_front();
+            queuedTasks--;
+            return true;
+        }
+    }
+
+    // Steal the oldest task of another worker, starting with the next one
+    const int nbQueues = workerQueues.size();
+    for(int i=1; i<=nbQueues; i++)
+    {
+        WorkQueue& victim = *workerQueues[(max(workerIndex, 0) + i) % nbQueues];
+        lock_guard<mutex> lock(victim.queueMutex);
+        if(!victim.tasks.empty())
+        {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            queuedTasks--;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::runTask(Task& task)
+{
+    task.run();
+    // The group may be destroyed as soon as the waiter sees it done, it is only
+    // touched under its mutex, which the waiter takes before returning
+    TaskGroup* group = task.group;
+    lock_guard<mutex> lock(group->doneMutex);
+    if(--group->pending == 0)
+    {
+        group->done.notify_all();
+    }
+}
+
+void ThreadPool::workerLoop(const int workerIndex)
+{
+    currentPool = this;
+    currentWorker = workerIndex;
+    while(true)
+    {
+        Task task;
+        if(popTask(workerIndex, task))
+        {
+            runTask(task);
+            continue;
+        }
+
+        unique_lock<mutex> lock(sleepMutex);
+        workAvailable.wait(lock, [this] { return stopping || queuedTasks > 0; });
+        if(stopping)
+            return;
+    }
+}
+
+void ThreadPool::wait(TaskGroup& group)
+{
+    const int workerIndex = currentPool == this ? currentWorker : -1;
+    while(group.pending > 0)
+    {
+        Task task;
+        if(popTask(workerIndex, task))
+        {
+            runTask(task);
+            continue;
+        }
+        // Nothing left to help with: sleep until the group is done, but check regularly
+        // for tasks spawned by the ones still running
+        unique_lock<mutex> lock(group.doneMutex);
+        group.done.wait_for(lock, chrono::milliseconds(1), [&group] { return group.pending == 0; });
+    }
+    lock_guard<mutex> lock(group.doneMutex);
+}
+
+void ThreadPool::parallelFor(const int count, const function<void(int)>& task)
+{
+    if(count <= 0)
+        return;
+    if(count == 1)
+    {
+        task(0);
+        return;
+    }
+
+    TaskGroup group;
+    for(int i=1; i<count; i++)
+    {
+        submit(group, [&task, i] { task(i); });
+    }
+    task(0);
+    wait(group);
+}
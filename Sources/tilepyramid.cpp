@@ -0,0 +1,270 @@
+#include "Headers/tilepyramid.h"
+#include "Headers/threadpool.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Rows of a tile built by one task
+static const int bandRows = 32;
+
+TilePyramid::TilePyramid(const QImage &image, const qint64 budget)
+    : nbLevels(1)
+    , nbCachedBytes(0)
+    , maxBytes(budget)
+{
+    if(ImageView::channelsOf(image.format()) != 0)
+        sourceImage = image;
+    else
+        sourceImage = image.convertToFormat(ImageView::supportedFormat(image.format(), image.isGrayscale()));
+
+    while(levelSize(nbLevels - 1).width() > tileSize || levelSize(nbLevels - 1).height() > tileSize)
+    {
+        nbLevels++;
+    }
+}
+
+const QImage& TilePyramid::image() const
+{
+    return sourceImage;
+}
+
+int TilePyramid::levelCount() const
+{
+    return nbLevels;
+}
+
+// Rounded up: the last pixels of a level may cover a part of a block only
+QSize TilePyramid::levelSize(const int level) const
+{
+    if(sourceImage.isNull())
+        return QSize(0, 0);
+    return QSize(((sourceImage.width() - 1) >> level) + 1, ((sourceImage.height() - 1) >> level) + 1);
+}
+
+int TilePyramid::levelFor(const double scale) const
+{
+    int level = 0;
+    while(level + 1 < nbLevels && scale * (1 << (level + 1)) <= 1.0)
+    {
+        level++;
+    }
+    return level;
+}
+
+vector<TilePyramid::TileKey> TilePyramid::tilesIn(const int level, const QRect &rect) const
+{
+    vector<TileKey> keys;
+    const QRect levelRect = rect & QRect(QPoint(0, 0), levelSize(level));
+    if(levelRect.isEmpty())
+        return keys;
+    for(int y=levelRect.top()/tileSize; y<=levelRect.bottom()/tileSize; y++)
+    {
+        for(int x=levelRect.left()/tileSize; x<=levelRect.right()/tileSize; x++)
+        {
+            keys.push_back(TileKey{level, x, y});
+        }
+    }
+    return keys;
+}
+
+QRect TilePyramid::tileRect(const TileKey &key) const
+{
+    return QRect(key.x*tileSize, key.y*tileSize, tileSize, tileSize) & QRect(QPoint(0, 0), levelSize(key.level));
+}
+
+QImage TilePyramid::tile(const TileKey &key)
+{
+    if(key.level == 0)
+    {
+        // Tiles start on multiples of tileSize bytes: the rows stay aligned like QImage asks
+        const QRect rect = tileRect(key);
+        if(rect.isEmpty())
+            return QImage();
+        const ImageView source(sourceImage);
+        return QImage(source.row(rect.y()) + rect.x()*source.channels, rect.width(), rect.height(),
+                      source.stride, sourceImage.format());
+    }
+    return cachedTile(key);
+}
+
+QImage TilePyramid::cachedTile(const TileKey &key)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    const auto found = cachedTiles.find(key);
+    if(found == cachedTiles.end())
+        return QImage();
+    recentTiles.splice(recentTiles.begin(), recentTiles, found->second);
+    return found->second->second;
+}
+
+bool TilePyramid::isCached(const TileKey &key) const
+{
+    if(key.level == 0)
+        return true;
+    lock_guard<mutex> lock(cacheMutex);
+    return cachedTiles.count(key) != 0;
+}
+
+/*
+A tile is the mean of the 2 x 2 blocks of the tiles of the level below when they are all
+cached (zooming out step by step), otherwise the mean of the 2^level x 2^level blocks of
+the image itself: no level is built only to build the next one.
+*/
+TilePyramid::Job TilePyramid::prepareJob(const TileKey &key)
+{
+    Job job;
+    job.key = key;
+    const QRect rect = tileRect(key);
+    job.tile = QImage(rect.size(), sourceImage.format());
+    job.destination = MutableImageView(job.tile);
+
+    if(key.level > 1)
+    {
+        const QRect childRect = QRect(rect.topLeft()*2, rect.size()*2) & QRect(QPoint(0, 0), levelSize(key.level - 1));
+        const vector<TileKey> childKeys = tilesIn(key.level - 1, childRect);
+        vector<pair<QRect, QImage>> children;
+        for(const TileKey &childKey : childKeys)
+        {
+            const QImage child = cachedTile(childKey);
+            if(child.isNull())
+                break;
+            children.push_back({tileRect(childKey), child});
+        }
+        if(children.size() == childKeys.size())
+        {
+            job.merged = QImage(childRect.size(), sourceImage.format());
+            const MutableImageView merged(job.merged);
+            for(const pair<QRect, QImage> &child : children)
+            {
+                const ImageView childView(child.second);
+                const QPoint offset = child.first.topLeft() - childRect.topLeft();
+                for(int y=0; y<childView.height; y++)
+                {
+                    memcpy(merged.row(offset.y() + y) + offset.x()*merged.channels, childView.row(y), childView.rowBytes());
+                }
+            }
+            job.source = merged;
+            job.factor = 2;
+            job.origin = QPoint(0, 0);
+            return job;
+        }
+    }
+
+    job.source = ImageView(sourceImage);
+    job.factor = 1 << key.level;
+    job.origin = rect.topLeft() * job.factor;
+    return job;
+}
+
+// The blocks of the last row and column may be cut by the border, their mean is over the pixels inside
+void TilePyramid::reduceRows(const Job &job, const int rowStart, const int rowEnd)
+{
+    const ImageView &source = job.source;
+    const MutableImageView &destination = job.destination;
+    const int channels = source.channels;
+    const int factor = job.factor;
+    vector<quint64> sums((qsizetype)destination.width*channels);
+
+    for(int y=rowStart; y<rowEnd; y++)
+    {
+        fill(sums.begin(), sums.end(), 0);
+        const int sourceTop = job.origin.y() + y*factor;
+        const int sourceBottom = min(sourceTop + factor, source.height);
+        for(int sy=sourceTop; sy<sourceBottom; sy++)
+        {
+            const uchar* sourceRow = source.row(sy);
+            for(int x=0; x<destination.width; x++)
+            {
+                const int sourceLeft = job.origin.x() + x*factor;
+                const int sourceRight = min(sourceLeft + factor, source.width);
+                quint64* sum = &sums[x*channels];
+                for(int sx=sourceLeft; sx<sourceRight; sx++)
+                {
+                    const uchar* pixel = sourceRow + sx*channels;
+                    for(int c=0; c<channels; c++)
+                    {
+                        sum[c] += pixel[c];
+                    }
+                }
+            }
+        }
+
+        uchar* destinationRow = destination.row(y);
+        for(int x=0; x<destination.width; x++)
+        {
+            const int sourceLeft = job.origin.x() + x*factor;
+            const quint64 count = quint64(sourceBottom - sourceTop) * (min(sourceLeft + factor, source.width) - sourceLeft);
+            for(int c=0; c<channels; c++)
+            {
+                destinationRow[x*channels + c] = (sums[x*channels + c] + count/2) / count;
+            }
+        }
+    }
+}
+
+void TilePyramid::build(const vector<TileKey> &keys)
+{
+    vector<Job> jobs;
+    for(const TileKey &key : keys)
+    {
+        if(!isCached(key) && !tileRect(key).isEmpty())
+            jobs.push_back(prepareJob(key));
+    }
+    if(jobs.empty())
+        return;
+
+    // Bands of rows rather than whole tiles, so that all the threads build the single tile of a reduced image
+    vector<pair<int, int>> bands;
+    for(int j=0; j<(int)jobs.size(); j++)
+    {
+        for(int row=0; row<jobs[j].destination.height; row+=bandRows)
+        {
+            bands.push_back({j, row});
+        }
+    }
+    ThreadPool::instance().parallelFor(bands.size(), [&](const int i)
+    {
+        const Job &job = jobs[bands[i].first];
+        reduceRows(job, bands[i].second, min(bands[i].second + bandRows, job.destination.height));
+    });
+
+    for(const Job &job : jobs)
+    {
+        insert(job.key, job.tile);
+    }
+}
+
+// The tile inserted is kept even when it is larger than the budget alone
+void TilePyramid::insert(const TileKey &key, const QImage &tile)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    if(cachedTiles.count(key) != 0)
+        return;
+    recentTiles.push_front({key, tile});
+    cachedTiles[key] = recentTiles.begin();
+    nbCachedBytes += tile.sizeInBytes();
+    while(nbCachedBytes > maxBytes && recentTiles.size() > 1)
+    {
+        nbCachedBytes -= recentTiles.back().second.sizeInBytes();
+        cachedTiles.erase(recentTiles.back().first);
+        recentTiles.pop_back();
+    }
+}
+
+void TilePyramid::setBudget(const qint64 budget)
+{
+    lock_guard<mutex> lock(cacheMutex);
+    maxBytes = budget;
+    while(nbCachedBytes > maxBytes && !recentTiles.empty())
+    {
+        nbCachedBytes -= recentTiles.back().second.sizeInBytes();
+        cachedTiles.erase(recentTiles.back().first);
+        recentTiles.pop_back();
+    }
+}
+
+qint64 TilePyramid::cachedBytes() const
+{
+    lock_guard<mutex> lock(cacheMutex);
+    return nbCachedBytes;
+}
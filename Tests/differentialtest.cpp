@@ -0,0 +1,774 @@
+#include "Headers/filterpipeline.h"
+#include "Headers/imageprocessing.h"
+#include "Headers/integralimage.h"
+#include "Headers/mappedimage.h"
+#include "Headers/resultcache.h"
+#include "Headers/simdkernels.h"
+#include "Headers/stripprocessor.h"
+#include "Tests/referencefilters.h"
+
+#include <QCommandLineOption>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QFile>
+#include <QTemporaryDir>
+#include <QVector>
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+
+/*
+Differential test of the optimized filters against the frozen scalar references of
+ReferenceFilters. Every filter runs on images of every size class (1x1, single rows and
+columns, odd sizes, sizes giving several row bands, random ones), format and row padding,
+with each instruction set supported by the CPU, several thread counts, in place, through a
+ResultCache, and for the streamed paths through FilterPipeline and StripProcessor. The results must match the
+reference within the tolerance of the filter (exact for the integer filters). The filters
+that replaced the first scalar ones are also compared with those (the legacy references),
+within the differences their changes allow, and each change is checked on its own on a
+small image. Mapped image files are checked to give back the images saved to them.
+Exit code 0 when every check passes, 1 otherwise.
+*/
+
+struct TestImage
+{
+    QString name;
+    QImage image;
+    // Pixels of the images with padded rows, which do not own their memory
+    shared_ptr<vector<uchar>> buffer;
+};
+
+struct Filter
+{
+    QString name;
+    function<QImage(const QImage&)> reference;
+    function<void(ImageProcessing&, const QImage&, QImage&)> run;
+    // Largest difference accepted on a byte
+    int tolerance;
+};
+
+class DifferentialTest
+{
+public:
+    DifferentialTest(const quint32 seed, const bool verbose, const QString &filter)
+        : random(seed), verbose(verbose), nameFilter(filter), nbChecks(0), nbFailures(0)
+    {
+    }
+
+    void run(const int nbRandomImages);
+    int checkCount() const { return nbChecks; }
+    int failureCount() const { return nbFailures; }
+
+private:
+    vector<TestImage> testImages(const int nbRandomImages);
+    TestImage makeImage(const int width, const int height, const QImage::Format format, const int pattern, const int padding);
+    vector<Filter> filters();
+    void checkFilter(const Filter &filter, const TestImage &testImage, const QImage &supported);
+    void checkHistograms(const TestImage &testImage, const QImage &supported);
+    void checkPipelines(const TestImage &testImage, const QImage &supported);
+    void checkMappedImages();
+    void checkLargeWindows();
+    void checkLegacy(const TestImage &testImage, const QImage &supported);
+    void checkLegacyDifferences();
+    void expect(const QString &check, const int expected, const int actual);
+    bool compare(const QString &check, const QImage &expected, const QImage &actual, const int tolerance);
+    bool selected(const QString &name) const { return nameFilter.isEmpty() || name.contains(nameFilter); }
+
+    mt19937 random;
+    bool verbose;
+    QString nameFilter;
+    int nbChecks;
+    int nbFailures;
+};
+
+static const char* instructionSetName(const SimdKernels::InstructionSet instructionSet)
+{
+    switch(instructionSet)
+    {
+    case SimdKernels::AVX2:
+        return "avx2";
+    case SimdKernels::SSE2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
+
+static vector<SimdKernels::InstructionSet> instructionSets()
+{
+    vector<SimdKernels::InstructionSet> sets;
+    for(int set = SimdKernels::Scalar; set <= SimdKernels::detectInstructionSet(); set++)
+    {
+        sets.push_back((SimdKernels::InstructionSet)set);
+    }
+    return sets;
+}
+
+/*
+Patterns: 0 noise, 1 constant, 2 black, 3 white, 4 checkerboard, 5 ramps. Padded rows
+are filled with noise, which must never reach the results.
+*/
+TestImage DifferentialTest::makeImage(const int width, const int height, const QImage::Format format, const int pattern, const int padding)
+{
+    QImage image(width, height, format);
+    const int bytesPerPixel = image.depth() / 8;
+    const int constant = random() & 0xff;
+    for(int y=0; y<height; y++)
+    {
+        uchar* line = image.scanLine(y);
+        for(int i=0; i<width*bytesPerPixel; i++)
+        {
+            const int x = i / bytesPerPixel;
+            switch(pattern)
+            {
+            case 0: line[i] = random() & 0xff; break;
+            case 1: line[i] = constant; break;
+            case 2: line[i] = 0; break;
+            case 3: line[i] = 255; break;
+            case 4: line[i] = (x + y) % 2 ? 255 : 0; break;
+            default: line[i] = (x*7 + y*13 + i % bytesPerPixel*50) & 0xff; break;
+            }
+        }
+    }
+
+    TestImage testImage;
+    testImage.name = QStringLiteral("%1x%2 format %3 pattern %4").arg(width).arg(height).arg(format).arg(pattern);
+    if(padding == 0)
+    {
+        testImage.image = image;
+        return testImage;
+    }
+    const qsizetype stride = image.bytesPerLine() + padding;
+    testImage.buffer = make_shared<vector<uchar>>(stride*height);
+    for(uchar &byte : *testImage.buffer)
+    {
+        byte = random() & 0xff;
+    }
+    for(int y=0; y<height; y++)
+    {
+        memcpy(testImage.buffer->data() + y*stride, image.constScanLine(y), width*bytesPerPixel);
+    }
+    testImage.image = QImage(testImage.buffer->data(), width, height, stride, format);
+    testImage.name += QStringLiteral(" stride +%1").arg(padding);
+    return testImage;
+}
+
+vector<TestImage> DifferentialTest::testImages(const int nbRandomImages)
+{
+    const QImage::Format formats[] = {QImage::Format_Grayscale8, QImage::Format_ARGB32, QImage::Format_RGB32,
+                                      QImage::Format_RGBA8888, QImage::Format_RGB888};
+    const int sizes[][2] = {{1, 1}, {1, 7}, {7, 1}, {2, 2}, {3, 5}, {17, 13}, {33, 31}, {100, 3}, {129, 97}};
+
+    vector<TestImage> images;
+    for(const QImage::Format format : formats)
+    {
+        for(const auto &size : sizes)
+        {
+            images.push_back(makeImage(size[0], size[1], format, 0, 0));
+        }
+        for(int pattern=1; pattern<=5; pattern++)
+        {
+            images.push_back(makeImage(19, 11, format, pattern, 0));
+        }
+        images.push_back(makeImage(37, 70, format, 0, 12));
+        // Cut in several bands by 3 threads for every radius tested: the first rows of a band
+        // come from the halo rows loaded above it, which a single band never loads
+        images.push_back(makeImage(23, 300, format, 0, 0));
+        images.push_back(makeImage(5, 3, format, 5, 4));
+    }
+    for(int i=0; i<nbRandomImages; i++)
+    {
+        const QImage::Format format = formats[random() % 5];
+        images.push_back(makeImage(1 + random() % 160, 1 + random() % 120, format, random() % 6, 4*(random() % 3)));
+    }
+    return images;
+}
+
+vector<Filter> DifferentialTest::filters()
+{
+    vector<Filter> list;
+    list.push_back({"grayscale", [](const QImage &s) { return ReferenceFilters::grayscale(s, false); },
+                    [](ImageProcessing &p, const QImage &s, QImage &d) { p.convertToGrayScale(s, d); }, 0});
+    list.push_back({"grayscale keep format", [](const QImage &s) { return ReferenceFilters::grayscale(s, true); },
+                    [](ImageProcessing &p, const QImage &s, QImage &d) { p.convertToGrayScale(s, d, true); }, 0});
+    for(const int radius : {1, 2, 3, 6})
+    {
+        list.push_back({QStringLiteral("mean r%1").arg(radius), [radius](const QImage &s) { return ReferenceFilters::meanBlur(s, radius); },
+                        [radius](ImageProcessing &p, const QImage &s, QImage &d) { p.meanBlur(s, d, radius); }, 0});
+    }
+    const vector<int> gauss3 = {1, 2, 1};
+    const vector<int> gauss5 = {1, 4, 6, 4, 1};
+    list.push_back({"gauss3x3", [gauss3](const QImage &s) { return ReferenceFilters::separableConvolution(s, 1, gauss3, gauss3, 16.0f); },
+                    [](ImageProcessing &p, const QImage &s, QImage &d) { p.gaussianBlur3x3(s, d); }, 0});
+    list.push_back({"gauss5x5", [gauss5](const QImage &s) { return ReferenceFilters::separableConvolution(s, 2, gauss5, gauss5, 246.0f); },
+                    [](ImageProcessing &p, const QImage &s, QImage &d) { p.gaussianBlur5x5(s, d); }, 0});
+    for(const int radius : {1, 2, 4})
+    {
+        list.push_back({QStringLiteral("median r%1").arg(radius), [radius](const QImage &s) { return ReferenceFilters::median(s, radius); },
+                        [radius](ImageProcessing &p, const QImage &s, QImage &d) { p.medianFilter(s, d, radius); }, 0});
+    }
+    // Float statistics: a compiler contracting the operations differently may move a value by one
+    for(const int radius : {1, 4})
+    {
+        list.push_back({QStringLiteral("lcn r%1").arg(radius), [radius](const QImage &s) { return ReferenceFilters::localContrastNormalization(s, radius); },
+                        [radius](ImageProcessing &p, const QImage &s, QImage &d) { p.localContrastNormalization(s, d, radius); }, 1});
+    }
+    list.push_back({"variation", [](const QImage &s) { return ReferenceFilters::variation(s); },
+                    [](ImageProcessing &p, const QImage &s, QImage &d) { p.variationFilter(s, d); }, 1});
+
+    const pair<SimdKernels::GradientMagnitude, const char*> magnitudes[] =
+        {{SimdKernels::MagnitudeL2, "l2"}, {SimdKernels::MagnitudeL1, "l1"}, {SimdKernels::MagnitudeLut, "lut"}};
+    for(const auto &magnitude : magnitudes)
+    {
+        const SimdKernels::GradientMagnitude m = magnitude.first;
+        list.push_back({QStringLiteral("gradient %1").arg(magnitude.second), [m](const QImage &s) { return ReferenceFilters::gradient(s, m); },
+                        [m](ImageProcessing &p, const QImage &s, QImage &d) { p.gradientFilter(s, d, m); }, 0});
+    }
+    list.push_back({"gradient orientation", [](const QImage &s)
+                    {
+                        QImage orientation;
+                        ReferenceFilters::gradient(s, SimdKernels::MagnitudeL2, &orientation);
+                        return orientation;
+                    },
+                    [](ImageProcessing &p, const QImage &s, QImage &d)
+                    {
+                        QImage magnitude;
+                        p.gradientFilter(s, magnitude, SimdKernels::MagnitudeL2, &d);
+                    }, 0});
+    for(const float percentage : {0.5f, 0.95f})
+    {
+        list.push_back({QStringLiteral("gradient threshold %1").arg(percentage),
+                        [percentage](const QImage &s) { return ReferenceFilters::gradientThreshold(s, percentage); },
+                        [percentage](ImageProcessing &p, const QImage &s, QImage &d) { p.gradientThreshold(s, d, percentage); }, 0});
+        list.push_back({QStringLiteral("gradient threshold mask %1").arg(percentage),
+                        [percentage](const QImage &s) { return ReferenceFilters::gradientThresholdMask(s, percentage); },
+                        [percentage](ImageProcessing &p, const QImage &s, QImage &d) { p.gradientThresholdMask(s, d, percentage); }, 0});
+    }
+
+    const vector<int> sobelX = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+    const vector<int> sobelY = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
+    list.push_back({"sobel x", [sobelX](const QImage &s) { return ReferenceFilters::convolution(s, 1, sobelX, 4.0f); },
+                    [](ImageProcessing &p, const QImage &s, QImage &d) { p.horizontalSobelGradientFilter(s, d); }, 0});
+    list.push_back({"sobel y", [sobelY](const QImage &s) { return ReferenceFilters::convolution(s, 1, sobelY, 4.0f); },
+                    [](ImageProcessing &p, const QImage &s, QImage &d) { p.verticalSobelGradientFilter(s, d); }, 0});
+
+    // Random kernels, the 2D ones are not separable (their center row differs)
+    for(const int radius : {1, 2})
+    {
+        const int kernelWidth = 2*radius + 1;
+        vector<int> kernel(kernelWidth*kernelWidth);
+        vector<int> rowKernel(kernelWidth);
+        vector<int> columnKernel(kernelWidth);
+        for(int &h : kernel)
+            h = (int)(random() % 9) - 4;
+        kernel[radius*kernelWidth + radius] = 20;
+        kernel[radius*kernelWidth] = 0;
+        kernel[radius*kernelWidth + 1] = 7;
+        for(int i=0; i<kernelWidth; i++)
+        {
+            rowKernel[i] = (int)(random() % 7) - 3;
+            columnKernel[i] = (int)(random() % 7) - 2;
+        }
+        const float parameter = 1.0f + random() % 30;
+        list.push_back({QStringLiteral("filter r%1").arg(radius),
+                        [=](const QImage &s) { return ReferenceFilters::convolution(s, radius, kernel, parameter); },
+                        [=](ImageProcessing &p, const QImage &s, QImage &d) { p.applyFilter(s, d, radius, kernel.data(), parameter); }, 0});
+        list.push_back({QStringLiteral("separable filter r%1").arg(radius),
+                        [=](const QImage &s) { return ReferenceFilters::separableConvolution(s, radius, rowKernel, columnKernel, parameter); },
+                        [=](ImageProcessing &p, const QImage &s, QImage &d)
+                        {
+                            p.applySeparableFilter(s, d, radius, rowKernel.data(), columnKernel.data(), parameter);
+                        }, 0});
+    }
+    return list;
+}
+
+// Only the pixels are compared, not the padding of the rows
+bool DifferentialTest::compare(const QString &check, const QImage &expected, const QImage &actual, const int tolerance)
+{
+    nbChecks++;
+    QString problem;
+    if(actual.size() != expected.size() || actual.format() != expected.format())
+    {
+        problem = QStringLiteral("%1x%2 format %3 instead of %4x%5 format %6").arg(actual.width()).arg(actual.height()).arg(actual.format())
+                  .arg(expected.width()).arg(expected.height()).arg(expected.format());
+    }
+    else
+    {
+        const int rowBytes = expected.width()*expected.depth()/8;
+        const int bytesPerPixel = expected.depth()/8;
+        int nbDifferences = 0;
+        int largest = 0;
+        for(int y=0; y<expected.height(); y++)
+        {
+            const uchar* e = expected.constScanLine(y);
+            const uchar* a = actual.constScanLine(y);
+            for(int i=0; i<rowBytes; i++)
+            {
+                const int difference = abs(e[i] - a[i]);
+                if(difference <= tolerance)
+                    continue;
+                if(nbDifferences == 0)
+                {
+                    problem = QStringLiteral("first at x %1 y %2 byte %3: expected %4, got %5")
+                              .arg(i / bytesPerPixel).arg(y).arg(i % bytesPerPixel).arg(e[i]).arg(a[i]);
+                }
+                nbDifferences++;
+                largest = max(largest, difference);
+            }
+        }
+        if(nbDifferences > 0)
+            problem = QStringLiteral("%1 bytes differ by up to %2, %3").arg(nbDifferences).arg(largest).arg(problem);
+    }
+
+    if(!problem.isEmpty())
+    {
+        nbFailures++;
+        printf("FAIL %s: %s\n", qPrintable(check), qPrintable(problem));
+    }
+    else if(verbose)
+    {
+        printf("ok   %s\n", qPrintable(check));
+    }
+    return problem.isEmpty();
+}
+
+/*
+Every instruction set and thread count, then in place, with a destination to replace and
+twice with a result cache, the second time from the data it kept.
+*/
+void DifferentialTest::checkFilter(const Filter &filter, const TestImage &testImage, const QImage &supported)
+{
+    const QImage expected = filter.reference(supported);
+    const QString name = filter.name + ", " + testImage.name;
+    ImageProcessing processing;
+
+    for(const SimdKernels::InstructionSet instructionSet : instructionSets())
+    {
+        SimdKernels::setInstructionSet(instructionSet);
+        for(const int threads : {1, 3, 0})
+        {
+            processing.setThreadCount(threads);
+            QImage destination;
+            filter.run(processing, testImage.image, destination);
+            compare(QStringLiteral("%1, %2, %3 threads").arg(name, instructionSetName(instructionSet)).arg(threads), expected, destination, filter.tolerance);
+        }
+    }
+    SimdKernels::setInstructionSet(SimdKernels::detectInstructionSet());
+    processing.setThreadCount(0);
+
+    if(filter.name != "gradient orientation")
+    {
+        QImage image = testImage.image.copy();
+        filter.run(processing, image, image);
+        compare(name + ", in place", expected, image, filter.tolerance);
+    }
+    // A destination of the wrong size and format must be replaced, not written over
+    QImage reused(3, 2, QImage::Format_RGB888);
+    filter.run(processing, testImage.image, reused);
+    compare(name + ", reused destination", expected, reused, filter.tolerance);
+
+    ResultCache cache;
+    processing.setResultCache(&cache);
+    for(int pass=1; pass<=2; pass++)
+    {
+        QImage destination;
+        filter.run(processing, testImage.image, destination);
+        compare(QStringLiteral("%1, result cache, pass %2").arg(name).arg(pass), expected, destination, filter.tolerance);
+    }
+}
+
+void DifferentialTest::checkHistograms(const TestImage &testImage, const QImage &supported)
+{
+    if(!selected("histogram"))
+        return;
+    const ImageHistograms expected = ReferenceFilters::histograms(supported);
+    ImageProcessing processing;
+    // The last two with a result cache, the last one from the cache
+    ResultCache cache;
+    const int threadCounts[] = {1, 3, 0, 0, 0};
+    for(int i=0; i<5; i++)
+    {
+        const int threads = threadCounts[i];
+        processing.setThreadCount(threads);
+        if(i == 3)
+            processing.setResultCache(&cache);
+        ImageHistograms histograms;
+        processing.computeHistograms(testImage.image, histograms);
+        nbChecks++;
+        const QString check = i < 3 ? QStringLiteral("histograms, %1, %2 threads").arg(testImage.name).arg(threads)
+                                    : QStringLiteral("histograms, %1, result cache, pass %2").arg(testImage.name).arg(i - 2);
+        if(memcmp(&expected, &histograms, sizeof(histograms)) != 0)
+        {
+            nbFailures++;
+            printf("FAIL %s\n", qPrintable(check));
+        }
+        else if(verbose)
+        {
+            printf("ok   %s\n", qPrintable(check));
+        }
+    }
+
+    vector<float> histogram(256, 0.0f);
+    vector<float> cumulative(256, 0.0f);
+    processing.computeHistogram(testImage.image, &histogram);
+    processing.cumulativeHistogram(testImage.image, &cumulative);
+    float sum = 0.0f;
+    bool same = true;
+    for(int i=0; i<256; i++)
+    {
+        sum += expected.counts[ImageHistograms::Red][i];
+        same = same && histogram[i] == expected.counts[ImageHistograms::Red][i] && cumulative[i] == sum;
+    }
+    nbChecks++;
+    if(!same)
+    {
+        nbFailures++;
+        printf("FAIL gray and cumulative histograms, %s\n", qPrintable(testImage.name));
+    }
+}
+
+// Strips of the whole image, in memory
+class MemoryStripReader : public StripReader
+{
+public:
+    explicit MemoryStripReader(const QImage &image)
+        : image(image)
+    {
+        imageWidth = image.width();
+        imageHeight = image.height();
+        imageFormat = image.format();
+    }
+
+    bool open(const QString &) override { return true; }
+    bool readRows(const int y, const MutableImageView &rows) override
+    {
+        for(int i=0; i<rows.height; i++)
+        {
+            memcpy(rows.row(i), image.constScanLine(y + i), rows.rowBytes());
+        }
+        return true;
+    }
+
+private:
+    QImage image;
+};
+
+class MemoryStripWriter : public StripWriter
+{
+public:
+    bool open(const QString &, const int width, const int height, const QImage::Format format) override
+    {
+        image = QImage(width, height, format);
+        nextRow = 0;
+        return true;
+    }
+    bool writeRows(const ImageView &rows) override
+    {
+        for(int i=0; i<rows.height; i++)
+        {
+            memcpy(image.scanLine(nextRow + i), rows.row(i), rows.rowBytes());
+        }
+        nextRow += rows.height;
+        return true;
+    }
+    bool close() override { return true; }
+
+    QImage image;
+    int nextRow;
+};
+
+/*
+Fused chains against the references applied one after the other, whole images and in
+strips of a few rows (the strip height follows the memory budget).
+*/
+void DifferentialTest::checkPipelines(const TestImage &testImage, const QImage &supported)
+{
+    if(!selected("pipeline"))
+        return;
+    const vector<int> gauss3 = {1, 2, 1};
+    const vector<int> gauss5 = {1, 4, 6, 4, 1};
+    const vector<int> laplacian = {0, -1, 0, -1, 4, -1, 0, -1, 0};
+
+    vector<pair<FilterPipeline, QImage>> chains;
+    {
+        const QImage magnitude = ReferenceFilters::gradient(
+            ReferenceFilters::separableConvolution(ReferenceFilters::grayscale(supported, false), 1, gauss3, gauss3, 16.0f), SimdKernels::MagnitudeL2);
+        chains.push_back({FilterPipeline().grayscale().gaussianBlur3x3().gradient().percentileThreshold(0.9f),
+                          ReferenceFilters::binarize(magnitude, ReferenceFilters::percentile(magnitude, 0.9f))});
+    }
+    chains.push_back({FilterPipeline().gaussianBlur5x5().meanBlur(2).gradient(SimdKernels::MagnitudeL1),
+                      ReferenceFilters::gradient(ReferenceFilters::meanBlur(
+                          ReferenceFilters::separableConvolution(supported, 2, gauss5, gauss5, 246.0f), 2), SimdKernels::MagnitudeL1)});
+    chains.push_back({FilterPipeline().threshold(100).meanBlur(1),
+                      ReferenceFilters::meanBlur(ReferenceFilters::threshold(supported, 100), 1)});
+    chains.push_back({FilterPipeline().filter(1, laplacian.data(), 1.0f).gradient(SimdKernels::MagnitudeLut).threshold(50),
+                      ReferenceFilters::threshold(ReferenceFilters::gradient(
+                          ReferenceFilters::convolution(supported, 1, laplacian, 1.0f), SimdKernels::MagnitudeLut), 50)});
+
+    for(int i=0; i<(int)chains.size(); i++)
+    {
+        FilterPipeline &pipeline = chains[i].first;
+        const QImage &expected = chains[i].second;
+        const QString name = QStringLiteral("pipeline %1, %2").arg(i).arg(testImage.name);
+        for(const int threads : {1, 3})
+        {
+            pipeline.setThreadCount(threads);
+            QImage destination;
+            pipeline.run(testImage.image, destination);
+            compare(QStringLiteral("%1, %2 threads").arg(name).arg(threads), expected, destination, 0);
+        }
+
+        const qsizetype rowBytes = supported.bytesPerLine() + ImageView::defaultStride(supported.width(), 4);
+        for(const qint64 budget : {qint64(1), qint64(3*rowBytes), qint64(1) << 30})
+        {
+            StripProcessor stripProcessor(pipeline);
+            stripProcessor.setMemoryBudget(budget);
+            MemoryStripReader reader(supported);
+            MemoryStripWriter writer;
+            writer.open(QString(), supported.width(), supported.height(), pipeline.resultFormat(supported.format()));
+            if(!stripProcessor.process(reader, writer))
+            {
+                nbChecks++;
+                nbFailures++;
+                printf("FAIL %s, strips: %s\n", qPrintable(name), qPrintable(stripProcessor.errorString()));
+                continue;
+            }
+            compare(QStringLiteral("%1, strips of %2 rows").arg(name).arg(stripProcessor.stripHeight(supported.width(), supported.format())),
+                    expected, writer.image, 0);
+        }
+    }
+}
+
+/*
+Save and load of the formats with a color table, which the file stores after its header, and
+of a header whose stride would overflow the size of the rows.
+*/
+void DifferentialTest::checkMappedImages()
+{
+    if(!selected("mapped"))
+        return;
+    QTemporaryDir directory;
+    const QString path = directory.filePath(QStringLiteral("image.") + QString::fromLatin1(MappedImage::suffix));
+    for(const QImage::Format format : {QImage::Format_Indexed8, QImage::Format_Grayscale8})
+    {
+        const QImage pixels = makeImage(37, 11, QImage::Format_Grayscale8, 0, 0).image;
+        QImage image(pixels.size(), format);
+        for(int y=0; y<image.height(); y++)
+        {
+            memcpy(image.scanLine(y), pixels.constScanLine(y), image.width());
+        }
+        if(format == QImage::Format_Indexed8)
+        {
+            QVector<QRgb> colors(256);
+            for(QRgb &color : colors)
+            {
+                color = random();
+            }
+            image.setColorTable(colors);
+        }
+        const QString name = QStringLiteral("mapped image, %1").arg(format);
+        QString errorMessage;
+        QImage loaded;
+        if(MappedImage::save(image, path, errorMessage))
+            loaded = MappedImage::load(path, errorMessage);
+        if(loaded.isNull())
+        {
+            nbChecks++;
+            nbFailures++;
+            printf("FAIL %s: %s\n", qPrintable(name), qPrintable(errorMessage));
+            continue;
+        }
+        compare(name, image, loaded, 0);
+        nbChecks++;
+        if(loaded.colorTable() != image.colorTable())
+        {
+            nbFailures++;
+            printf("FAIL %s: color table of %d colors instead of %d\n", qPrintable(name), (int)loaded.colorTable().size(), (int)image.colorTable().size());
+        }
+    }
+
+    // The stride is at offset 24 of the header
+    QFile file(path);
+    const qint64 stride = qint64(1) << 62;
+    nbChecks++;
+    QString errorMessage;
+    if(!file.open(QIODevice::ReadWrite) || !file.seek(24) || file.write((const char*)&stride, sizeof(stride)) != sizeof(stride))
+    {
+        nbFailures++;
+        printf("FAIL mapped image, overflowing stride: cannot write the header\n");
+        return;
+    }
+    file.close();
+    if(!MappedImage::load(path, errorMessage).isNull())
+    {
+        nbFailures++;
+        printf("FAIL mapped image, overflowing stride: loaded\n");
+    }
+    else if(verbose)
+    {
+        printf("ok   mapped image, overflowing stride: %s\n", qPrintable(errorMessage));
+    }
+}
+
+/*
+Windows whose sums, or sums of squares, do not fit in 32 bits, on small images to keep the
+references fast; radii beyond IntegralImage::maxRadius give a null image.
+*/
+void DifferentialTest::checkLargeWindows()
+{
+    const TestImage white = makeImage(3, 2, QImage::Format_Grayscale8, 3, 0);
+    const TestImage noise = makeImage(9, 7, QImage::Format_RGB32, 0, 0);
+    ImageProcessing processing;
+    QImage destination;
+    if(selected("mean"))
+    {
+        processing.meanBlur(white.image, destination, 2100);
+        compare(QStringLiteral("mean r2100, %1").arg(white.name), ReferenceFilters::meanBlur(white.image, 2100), destination, 0);
+        processing.meanBlur(white.image, destination, IntegralImage::maxRadius + 1);
+        compare(QStringLiteral("mean beyond the largest radius, %1").arg(white.name), QImage(), destination, 0);
+    }
+    if(selected("lcn"))
+    {
+        processing.localContrastNormalization(noise.image, destination, 200);
+        compare(QStringLiteral("lcn r200, %1").arg(noise.name), ReferenceFilters::localContrastNormalization(noise.image, 200), destination, 1);
+        processing.localContrastNormalization(noise.image, destination, IntegralImage::maxRadius + 1);
+        compare(QStringLiteral("lcn beyond the largest radius, %1").arg(noise.name), QImage(), destination, 0);
+    }
+}
+
+/*
+Differences allowed with the legacy filters: the sums of the convolutions were truncated
+at every tap, so they may be lower by up to one per tap (in absolute value for signed
+kernels, whose partial sums stay within 255); the float luma was truncated, so it may be
+lower by one. On images with R = G = B the median of each channel is the legacy median of
+the first one, exactly.
+*/
+void DifferentialTest::checkLegacy(const TestImage &testImage, const QImage &supported)
+{
+    if(!selected("legacy") || ImageView::channelsOf(supported.format()) != 4)
+        return;
+    const vector<int> gauss3 = {1, 2, 1, 2, 4, 2, 1, 2, 1};
+    const vector<int> gauss5 = {1, 4, 6, 4, 1, 4, 16, 24, 16, 4, 6, 24, 36, 24, 6, 4, 16, 24, 16, 4, 1, 4, 6, 4, 1};
+    const vector<int> mean = {1, 1, 1, 1, 1, 1, 1, 1, 1};
+    const vector<int> sobelX = {-1, 0, 1, -2, 0, 2, -1, 0, 1};
+    const vector<int> sobelY = {-1, -2, -1, 0, 0, 0, 1, 2, 1};
+    ImageProcessing processing;
+    QImage destination;
+
+    processing.gaussianBlur3x3(testImage.image, destination);
+    compare("legacy gauss3x3, " + testImage.name, ReferenceFilters::legacyConvolution(supported, 1, gauss3, 16.0f), destination, 9);
+    processing.gaussianBlur5x5(testImage.image, destination);
+    compare("legacy gauss5x5, " + testImage.name, ReferenceFilters::legacyConvolution(supported, 2, gauss5, 246.0f), destination, 25);
+    processing.meanBlur(testImage.image, destination, 1);
+    compare("legacy mean r1, " + testImage.name, ReferenceFilters::legacyConvolution(supported, 1, mean, 9.0f), destination, 9);
+    processing.horizontalSobelGradientFilter(testImage.image, destination);
+    compare("legacy sobel x, " + testImage.name, ReferenceFilters::legacyConvolution(supported, 1, sobelX, 4.0f), destination, 9);
+    processing.verticalSobelGradientFilter(testImage.image, destination);
+    compare("legacy sobel y, " + testImage.name, ReferenceFilters::legacyConvolution(supported, 1, sobelY, 4.0f), destination, 9);
+
+    processing.convertToGrayScale(testImage.image, destination, true);
+    compare("legacy grayscale, " + testImage.name, ReferenceFilters::legacyGrayscale(supported), destination, 1);
+    const QImage gray = ReferenceFilters::grayscale(supported, true);
+    processing.medianFilter(gray, destination, 1);
+    compare("legacy median r1 of the grayscale, " + testImage.name, ReferenceFilters::legacyMedian(gray), destination, 0);
+}
+
+void DifferentialTest::expect(const QString &check, const int expected, const int actual)
+{
+    nbChecks++;
+    if(actual != expected)
+    {
+        nbFailures++;
+        printf("FAIL %s: expected %d, got %d\n", qPrintable(check), expected, actual);
+    }
+    else if(verbose)
+    {
+        printf("ok   %s\n", qPrintable(check));
+    }
+}
+
+// Each deliberate change from the legacy filters, with the value before and after it
+void DifferentialTest::checkLegacyDifferences()
+{
+    if(!selected("legacy"))
+        return;
+    ImageProcessing processing;
+    QImage destination;
+    QImage image(3, 3, QImage::Format_RGB32);
+
+    // Sums exact instead of truncated at every tap
+    image.fill(0xff080808);
+    processing.meanBlur(image, destination, 1);
+    expect("legacy change, mean of a uniform 8 image, before", 0, ReferenceFilters::legacyConvolution(image, 1, vector<int>(9, 1), 9.0f).constScanLine(1)[4]);
+    expect("legacy change, mean of a uniform 8 image, now", 8, destination.constScanLine(1)[4]);
+
+    // Saturated to 255 instead of an invalid QColor, black, when |sum| > 255
+    image.fill(0xffffffff);
+    const vector<int> laplacian = {0, 0, 0, 0, -2, 0, 0, 0, 0};
+    processing.applyFilter(image, destination, 1, laplacian.data(), 1.0f);
+    expect("legacy change, |sum| over 255, before", 0, ReferenceFilters::legacyConvolution(image, 1, laplacian, 1.0f).constScanLine(1)[4]);
+    expect("legacy change, |sum| over 255, now", 255, destination.constScanLine(1)[4]);
+
+    // Fixed point luma weights instead of floats: bytes (250, 2, 255) give 104.994 truncated
+    // to 104 before, 105 now, far from the float rounding errors
+    image.fill(0xffff02fa);
+    processing.convertToGrayScale(image, destination, true);
+    expect("legacy change, luma of (250, 2, 255), before", 104, ReferenceFilters::legacyGrayscale(image).constScanLine(1)[4]);
+    expect("legacy change, luma of (250, 2, 255), now", 105, destination.constScanLine(1)[4]);
+
+    // Median of every channel instead of the median of the first one copied to the others
+    image.fill(0xff00640a);
+    reinterpret_cast<quint32*>(image.scanLine(1))[1] = 0xff00c80a;
+    processing.medianFilter(image, destination, 1);
+    expect("legacy change, median of the second channel, before", 10, ReferenceFilters::legacyMedian(image).constScanLine(1)[4 + 1]);
+    expect("legacy change, median of the second channel, now", 100, destination.constScanLine(1)[4 + 1]);
+}
+
+void DifferentialTest::run(const int nbRandomImages)
+{
+    checkMappedImages();
+    checkLargeWindows();
+    checkLegacyDifferences();
+    const vector<Filter> filterList = filters();
+    for(const TestImage &testImage : testImages(nbRandomImages))
+    {
+        // The conversion done by the filters for the formats they do not process directly
+        QImage supported = testImage.image;
+        if(ImageView::channelsOf(supported.format()) == 0)
+            supported = supported.convertToFormat(ImageView::supportedFormat(supported.format(), supported.isGrayscale()));
+
+        for(const Filter &filter : filterList)
+        {
+            if(selected(filter.name))
+                checkFilter(filter, testImage, supported);
+        }
+        checkHistograms(testImage, supported);
+        checkPipelines(testImage, supported);
+        checkLegacy(testImage, supported);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    QCoreApplication::setApplicationName("imageprocessing-test");
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Compare the optimized filters with their reference implementations.");
+    parser.addHelpOption();
+    const QCommandLineOption seedOption("seed", "Seed of the random images and kernels.", "seed", "1");
+    const QCommandLineOption imagesOption("random-images", "Number of images of random size and format, 20 by default.", "count", "20");
+    const QCommandLineOption filterOption({"f", "filter"}, "Only the checks whose filter name contains this word.", "word");
+    const QCommandLineOption verboseOption({"v", "verbose"}, "Print the checks that pass too.");
+    parser.addOptions({seedOption, imagesOption, filterOption, verboseOption});
+    parser.process(a);
+
+    DifferentialTest test(parser.value(seedOption).toUInt(), parser.isSet(verboseOption), parser.value(filterOption));
+    test.run(parser.value(imagesOption).toInt());
+    printf("%d checks, %d failed (instruction sets up to %s)\n", test.checkCount(), test.failureCount(),
+           instructionSetName(SimdKernels::detectInstructionSet()));
+    return test.failureCount() == 0 ? 0 : 1;
+}
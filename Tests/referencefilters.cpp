@@ -0,0 +1,531 @@
+#include "Tests/referencefilters.h"
+
+#include <QColor>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+int ReferenceFilters::channelsOf(const QImage &image)
+{
+    return image.format() == QImage::Format_Grayscale8 ? 1 : 4;
+}
+
+// Pixel (x, y) with the coordinates clamped to the image: borders are replicated
+const uchar* ReferenceFilters::pixel(const QImage &image, const int x, const int y)
+{
+    const int clampedX = min(max(x, 0), image.width()-1);
+    const int clampedY = min(max(y, 0), image.height()-1);
+    return image.constScanLine(clampedY) + channelsOf(image)*clampedX;
+}
+
+// Luma weights 0.299, 0.587, 0.114 in 1.14 fixed point
+static int luma(const uchar* pixel)
+{
+    return (4899*pixel[0] + 9617*pixel[1] + 1868*pixel[2]) >> 14;
+}
+
+QImage ReferenceFilters::grayscale(const QImage &source, const bool keepFormat)
+{
+    if(channelsOf(source) == 1)
+        return source.copy();
+
+    QImage result(source.size(), keepFormat ? source.format() : QImage::Format_Grayscale8);
+    for(int y=0; y<source.height(); y++)
+    {
+        for(int x=0; x<source.width(); x++)
+        {
+            const uchar* p = pixel(source, x, y);
+            if(keepFormat)
+            {
+                uchar* r = result.scanLine(y) + 4*x;
+                r[0] = r[1] = r[2] = luma(p);
+                r[3] = p[3];
+            }
+            else
+            {
+                result.scanLine(y)[x] = luma(p);
+            }
+        }
+    }
+    return result;
+}
+
+QImage ReferenceFilters::convolution(const QImage &source, const int kernelRadius, const vector<int> &kernel, const float kernelParameter)
+{
+    const int channels = channelsOf(source);
+    const int nbColors = channels == 4 ? 3 : 1;
+    const int kernelWidth = 2*kernelRadius + 1;
+    QImage result(source.size(), source.format());
+    for(int y=0; y<source.height(); y++)
+    {
+        for(int x=0; x<source.width(); x++)
+        {
+            uchar* r = result.scanLine(y) + channels*x;
+            for(int c=0; c<nbColors; c++)
+            {
+                int sum = 0;
+                for(int ky=0; ky<kernelWidth; ky++)
+                {
+                    for(int kx=0; kx<kernelWidth; kx++)
+                    {
+                        sum += kernel[kx + ky*kernelWidth] * pixel(source, x + kx - kernelRadius, y + ky - kernelRadius)[c];
+                    }
+                }
+                r[c] = fminf(abs(sum) / kernelParameter, 255.0f);
+            }
+            if(channels == 4)
+                r[3] = 255;
+        }
+    }
+    return result;
+}
+
+QImage ReferenceFilters::separableConvolution(const QImage &source, const int kernelRadius, const vector<int> &rowKernel,
+                                              const vector<int> &columnKernel, const float kernelParameter)
+{
+    const int kernelWidth = 2*kernelRadius + 1;
+    vector<int> kernel(kernelWidth*kernelWidth);
+    for(int ky=0; ky<kernelWidth; ky++)
+    {
+        for(int kx=0; kx<kernelWidth; kx++)
+        {
+            kernel[kx + ky*kernelWidth] = columnKernel[ky] * rowKernel[kx];
+        }
+    }
+    return convolution(source, kernelRadius, kernel, kernelParameter);
+}
+
+QImage ReferenceFilters::meanBlur(const QImage &source, const int kernelRadius)
+{
+    const int radius = max(kernelRadius, 1);
+    const float area = (2*radius+1)*(2*radius+1);
+    const int channels = channelsOf(source);
+    const int nbColors = channels == 4 ? 3 : 1;
+    QImage result(source.size(), source.format());
+    for(int y=0; y<source.height(); y++)
+    {
+        for(int x=0; x<source.width(); x++)
+        {
+            uchar* r = result.scanLine(y) + channels*x;
+            for(int c=0; c<nbColors; c++)
+            {
+                quint64 sum = 0;
+                for(int j=-radius; j<=radius; j++)
+                {
+                    for(int i=-radius; i<=radius; i++)
+                    {
+                        sum += pixel(source, x + i, y + j)[c];
+                    }
+                }
+                r[c] = sum / area;
+            }
+            if(channels == 4)
+                r[3] = 255;
+        }
+    }
+    return result;
+}
+
+QImage ReferenceFilters::median(const QImage &source, const int kernelRadius)
+{
+    const int radius = min(max(kernelRadius, 1), 50);
+    const int channels = channelsOf(source);
+    const int nbColors = channels == 4 ? 3 : 1;
+    QImage result(source.size(), source.format());
+    vector<uchar> window;
+    for(int y=0; y<source.height(); y++)
+    {
+        for(int x=0; x<source.width(); x++)
+        {
+            uchar* r = result.scanLine(y) + channels*x;
+            for(int c=0; c<nbColors; c++)
+            {
+                window.clear();
+                for(int j=-radius; j<=radius; j++)
+                {
+                    for(int i=-radius; i<=radius; i++)
+                    {
+                        window.push_back(pixel(source, x + i, y + j)[c]);
+                    }
+                }
+                sort(window.begin(), window.end());
+                r[c] = window[window.size()/2];
+            }
+            if(channels == 4)
+                r[3] = 255;
+        }
+    }
+    return result;
+}
+
+QImage ReferenceFilters::localContrastNormalization(const QImage &source, const int kernelRadius)
+{
+    const int radius = max(kernelRadius, 1);
+    const double area = (2.0*radius + 1)*(2.0*radius + 1);
+    const int channels = channelsOf(source);
+    const int nbColors = channels == 4 ? 3 : 1;
+    QImage result(source.size(), source.format());
+    for(int y=0; y<source.height(); y++)
+    {
+        for(int x=0; x<source.width(); x++)
+        {
+            uchar* r = result.scanLine(y) + channels*x;
+            for(int c=0; c<nbColors; c++)
+            {
+                qint64 sum = 0;
+                qint64 squareSum = 0;
+                for(int j=-radius; j<=radius; j++)
+                {
+                    for(int i=-radius; i<=radius; i++)
+                    {
+                        const int value = pixel(source, x + i, y + j)[c];
+                        sum += value;
+                        squareSum += value*value;
+                    }
+                }
+                const double m = sum / area;
+                const float mean = m;
+                const float variance = max(squareSum / area - m*m, 0.0);
+                const float normalized = (pixel(source, x, y)[c] - mean) / max(sqrtf(variance), 1.0f);
+                r[c] = min(max(128.0f + 64.0f*normalized, 0.0f), 255.0f);
+            }
+            if(channels == 4)
+                r[3] = 255;
+        }
+    }
+    return result;
+}
+
+/*
+Weighted mean of the first byte over the 5x5 window, the weight of a neighbor being
+1 / |difference| (1 / 5 for an equal value). The float and double steps are the ones of
+ImageProcessing::variationFilter.
+*/
+QImage ReferenceFilters::variation(const QImage &source)
+{
+    const int radius = 2;
+    const int channels = channelsOf(source);
+    QImage result(source.size(), source.format());
+    vector<float> values;
+    for(int y=0; y<source.height(); y++)
+    {
+        for(int x=0; x<source.width(); x++)
+        {
+            const int center = pixel(source, x, y)[0];
+            float totalWeight = 0.0f;
+            values.clear();
+            for(int i=-radius; i<=radius; i++)
+            {
+                for(int j=-radius; j<=radius; j++)
+                {
+                    const int neighbor = pixel(source, x + i, y + j)[0];
+                    float weight = 5.0f;
+                    if(neighbor != center)
+                        weight = abs(center - neighbor);
+                    values.push_back(1.0/weight * neighbor);
+                    totalWeight += 1.0/weight;
+                }
+            }
+            float value = 0;
+            for(const float v : values)
+            {
+                value = value + v / totalWeight;
+            }
+
+            uchar* r = result.scanLine(y) + channels*x;
+            r[0] = value;
+            if(channels == 4)
+            {
+                r[1] = value;
+                r[2] = value;
+                r[3] = 255;
+            }
+        }
+    }
+    return result;
+}
+
+ImageHistograms ReferenceFilters::histograms(const QImage &source)
+{
+    ImageHistograms histograms;
+    memset(&histograms, 0, sizeof(histograms));
+    for(int y=0; y<source.height(); y++)
+    {
+        for(int x=0; x<source.width(); x++)
+        {
+            const uchar* p = pixel(source, x, y);
+            if(channelsOf(source) == 1)
+            {
+                for(int c=ImageHistograms::Red; c<=ImageHistograms::Blue; c++)
+                    histograms.counts[c][p[0]]++;
+                histograms.counts[ImageHistograms::Alpha][255]++;
+                histograms.counts[ImageHistograms::Luma][p[0]]++;
+                continue;
+            }
+            for(int c=0; c<4; c++)
+                histograms.counts[c][p[c]]++;
+            histograms.counts[ImageHistograms::Luma][luma(p)]++;
+        }
+    }
+    return histograms;
+}
+
+QImage ReferenceFilters::gradient(const QImage &source, const SimdKernels::GradientMagnitude magnitude, QImage* orientation)
+{
+    const int channels = channelsOf(source);
+    const int nbColors = channels == 4 ? 3 : 1;
+    QImage result(source.size(), source.format());
+    if(orientation != nullptr)
+        *orientation = QImage(source.size(), QImage::Format_Grayscale8);
+    for(int y=0; y<source.height(); y++)
+    {
+        for(int x=0; x<source.width(); x++)
+        {
+            uchar* r = result.scanLine(y) + channels*x;
+            int sumX = 0;
+            int sumY = 0;
+            for(int c=0; c<nbColors; c++)
+            {
+                auto at = [&](const int i, const int j) { return (int)pixel(source, x + i, y + j)[c]; };
+                const int gradientX = (at(1, -1) - at(-1, -1)) + 2*(at(1, 0) - at(-1, 0)) + (at(1, 1) - at(-1, 1));
+                const int gradientY = (at(-1, 1) + 2*at(0, 1) + at(1, 1)) - (at(-1, -1) + 2*at(0, -1) + at(1, -1));
+                sumX += gradientX;
+                sumY += gradientY;
+                const int square = gradientX*gradientX + gradientY*gradientY;
+                switch(magnitude)
+                {
+                case SimdKernels::MagnitudeL1:
+                    r[c] = min((abs(gradientX) + abs(gradientY)) >> 2, 255);
+                    break;
+                case SimdKernels::MagnitudeLut:
+                    r[c] = min(255, (int)sqrt((double)min(square >> 4, 65535)));
+                    break;
+                default:
+                    r[c] = min((int)(sqrtf((float)square) * 0.25f), 255);
+                    break;
+                }
+            }
+            if(channels == 4)
+                r[3] = 255;
+            if(orientation != nullptr)
+            {
+                const float angle = atan2f(sumY, sumX);
+                orientation->scanLine(y)[x] = (int)lroundf((angle + (float)M_PI) * (256.0f / (2.0f*(float)M_PI))) & 255;
+            }
+        }
+    }
+    return result;
+}
+
+int ReferenceFilters::percentile(const QImage &image, const float percentageOfPixels)
+{
+    qint64 histogram[256] = {};
+    for(int y=0; y<image.height(); y++)
+    {
+        for(int x=0; x<image.width(); x++)
+        {
+            histogram[pixel(image, x, y)[0]]++;
+        }
+    }
+    const qint64 nbPixels = (qint64)image.width()*image.height();
+    qint64 cumulative = 0;
+    int i = 0;
+    while(i < 256 && (float)(cumulative + histogram[i]) / nbPixels < percentageOfPixels)
+    {
+        cumulative += histogram[i];
+        i++;
+    }
+    return i;
+}
+
+QImage ReferenceFilters::binarize(const QImage &source, const int value)
+{
+    const int channels = channelsOf(source);
+    QImage result(source.size(), source.format());
+    for(int y=0; y<source.height(); y++)
+    {
+        for(int x=0; x<source.width(); x++)
+        {
+            const uchar* p = pixel(source, x, y);
+            uchar* r = result.scanLine(y) + channels*x;
+            const uchar binary = p[0] < value ? 0 : 255;
+            r[0] = binary;
+            if(channels == 4)
+            {
+                r[1] = binary;
+                r[2] = binary;
+                r[3] = 255;
+            }
+        }
+    }
+    return result;
+}
+
+QImage ReferenceFilters::threshold(const QImage &source, const int value)
+{
+    const int channels = channelsOf(source);
+    const int nbColors = channels == 4 ? 3 : 1;
+    QImage result(source.size(), source.format());
+    for(int y=0; y<source.height(); y++)
+    {
+        for(int x=0; x<source.width(); x++)
+        {
+            const uchar* p = pixel(source, x, y);
+            uchar* r = result.scanLine(y) + channels*x;
+            for(int c=0; c<nbColors; c++)
+                r[c] = p[c] < value ? 0 : 255;
+            if(channels == 4)
+                r[3] = 255;
+        }
+    }
+    return result;
+}
+
+QImage ReferenceFilters::gradientThreshold(const QImage &source, const float percentageOfPixels)
+{
+    const QImage magnitude = gradient(source, SimdKernels::MagnitudeL2);
+    return binarize(magnitude, percentile(magnitude, percentageOfPixels));
+}
+
+QImage ReferenceFilters::gradientThresholdMask(const QImage &source, const float percentageOfPixels)
+{
+    const QImage magnitude = gradient(source, SimdKernels::MagnitudeL2);
+    QImage firstBytes(source.size(), QImage::Format_Grayscale8);
+    for(int y=0; y<source.height(); y++)
+    {
+        for(int x=0; x<source.width(); x++)
+        {
+            firstBytes.scanLine(y)[x] = pixel(magnitude, x, y)[0];
+        }
+    }
+    return binarize(firstBytes, percentile(firstBytes, percentageOfPixels));
+}
+
+/*
+Legacy filters: the bodies below are those of the first ImageProcessing, on images of
+width*4 bytes rows, only the signatures changed.
+*/
+static QColor legacyApplyConvolution(const uchar *imageData,const int width, const int height,
+                                     const int kernelRadius, const int kernel[], const float kernelParameter,const int kernelWidth,
+                                     const int x,const int y)
+{
+    int r = 0;
+    int g = 0;
+    int b = 0;
+
+    for(int kx=-kernelRadius; kx<=kernelRadius; kx++)
+    {
+        int iKernel = kx + kernelRadius;
+        //index i of the neighboor pixel
+        int i = fmax(fmin(x+kx,width-1),0);
+        for(int ky=-kernelRadius; ky<=kernelRadius; ky++)
+        {
+            int jKernel = ky + kernelRadius;
+            //index j of the neighboor pixel
+            int j = fmax(fmin(y+ky,height-1),0);
+            QColor imageColor =  QColor(imageData[4*i +j* width*4], imageData[4*i +j* width*4 +1],imageData[4*i +j* width*4+2] ,imageData[4*i +j* width*4+3]) ;
+
+            float h = kernel[iKernel+ jKernel*kernelWidth] / kernelParameter;
+            r = fminf( r + imageColor.red()   * h, 255.0f);
+            g = fminf( g + imageColor.green()   * h, 255.0f);
+            b = fminf( b + imageColor.blue()   * h, 255.0f);
+
+        }
+    }
+    return QColor(abs(r),abs(g),abs(b));
+}
+
+QImage ReferenceFilters::legacyConvolution(const QImage &source, const int kernelRadius, const vector<int> &kernel, const float kernelParameter)
+{
+    // Rows of width*4 bytes
+    const QImage packed = source.copy();
+    const uchar* imageData = packed.constBits();
+    const int width = source.width();
+    const int height = source.height();
+
+    const int kernelWidth = 2*kernelRadius +1;
+    QImage imageFiltered(width, height, source.format());
+    uchar* imageFilteredData = imageFiltered.bits();
+
+    for(int x= 0 ; x<width; x++)
+    {
+        for(int y= 0 ; y<height; y++)
+        {
+            QColor color = legacyApplyConvolution(imageData,width,height,kernelRadius,kernel.data(),kernelParameter,kernelWidth,x,y);
+            int index = 4*x + y * width*4 ;
+            imageFilteredData[index] = color.red();
+            imageFilteredData[index +1] = color.green();
+            imageFilteredData[index +2] = color.blue();
+            imageFilteredData[index +3] = color.alpha();
+        }
+    }
+    return imageFiltered;
+}
+
+QImage ReferenceFilters::legacyMedian(const QImage &source)
+{
+    const QImage packed = source.copy();
+    const uchar* imageData = packed.constBits();
+    const int width = source.width();
+    const int height = source.height();
+
+    QImage filteredImage(width,height, source.format());
+    uchar* filteredImageData = filteredImage.bits();
+    int kernelRadius = 1;
+
+    //list of neighborhood values
+    std::vector<int> medianList;
+    medianList.reserve(9);
+    for(int i=0; i<width; i++)
+    {
+        for(int j=0; j<height; j++)
+        {
+            medianList.clear();
+
+            for(int ki=-kernelRadius; ki<=kernelRadius; ki++)
+            {
+                int x = fmax(fmin(i+ki,width-1),0);
+                for(int kj=-kernelRadius; kj<=kernelRadius; kj++)
+                {
+                    int y = fmax(fmin(j+kj,height-1),0);
+                    int index = 4*x+ y*width*4;
+                    medianList.push_back(imageData[index]);
+                }
+            }
+            // Find the median value
+            std::sort(medianList.begin(),medianList.end());
+            int medianValue = medianList[medianList.size()/2 ];
+            int id = 4*i+ j*width*4;
+            filteredImageData[id] = medianValue;
+            filteredImageData[id+1] = medianValue;
+            filteredImageData[id+2] = medianValue;
+            filteredImageData[id+3] = 255.0f;
+        }
+    }
+    return filteredImage;
+}
+
+QImage ReferenceFilters::legacyGrayscale(const QImage &source)
+{
+    const QImage packed = source.copy();
+    const uchar* imageData = packed.constBits();
+    const int width = source.width();
+    const int height = source.height();
+
+    QImage grayScaleImage(width,height,source.format());
+    uchar* grayScaleImageData = grayScaleImage.bits();
+    for(int i= 0;i<height * width * 4; i+=4 )
+    {
+        float greyScaleValue = 0.299f * imageData[i] + 0.587f * imageData[i+1] + 0.114f *imageData[i+2];
+        //Red
+        grayScaleImageData[i] = greyScaleValue;
+        //Green
+        grayScaleImageData[i+1] = greyScaleValue;
+        //Blue
+        grayScaleImageData[i+2] = greyScaleValue;
+        //Alpha
+        grayScaleImageData[i+3] = imageData[i +3];
+    }
+    return grayScaleImage;
+}
@@ -0,0 +1,63 @@
+#ifndef REFERENCEFILTERS_H
+#define REFERENCEFILTERS_H
+
+#include <QImage>
+
+#include "Headers/imageprocessing.h"
+#include "Headers/simdkernels.h"
+
+#include <vector>
+
+using namespace std;
+
+/*
+Scalar versions of the filters, used as references by the differential test.
+They compute every output pixel on its own from clamped source coordinates, with the
+arithmetic of the filters as they behave now written out (fixed point luma, exact
+|sum| / kernelParameter saturated to 255, 246 for the 5x5 gaussian, median of each color
+channel, ...). They are meant to stay slow and obvious: do not optimize them, and only
+change them together with a deliberate change of the behavior of a filter.
+The legacy ones are the first scalar filters of the project, kept verbatim: per tap
+truncated and clamped sums, float luma truncated, median of the first channel only. The
+test compares the filters with them within the differences these changes allow.
+Sources are Format_Grayscale8 or 32 bits images (see ImageView::supportedFormat),
+results have the format of the source unless stated otherwise.
+*/
+class ReferenceFilters
+{
+public:
+    // Format_Grayscale8 result, or the format of the source with R = G = B when keepFormat is set
+    static QImage grayscale(const QImage &source, const bool keepFormat);
+    // kernel has (2r+1)^2 values, row after row
+    static QImage convolution(const QImage &source, const int kernelRadius, const vector<int> &kernel, const float kernelParameter);
+    static QImage separableConvolution(const QImage &source, const int kernelRadius, const vector<int> &rowKernel,
+                                       const vector<int> &columnKernel, const float kernelParameter);
+    static QImage meanBlur(const QImage &source, const int kernelRadius);
+    static QImage median(const QImage &source, const int kernelRadius);
+    static QImage localContrastNormalization(const QImage &source, const int kernelRadius);
+    static QImage variation(const QImage &source);
+    static ImageHistograms histograms(const QImage &source);
+    // orientation, if not null, receives the Format_Grayscale8 orientation
+    static QImage gradient(const QImage &source, const SimdKernels::GradientMagnitude magnitude, QImage* orientation = nullptr);
+    static QImage gradientThreshold(const QImage &source, const float percentageOfPixels);
+    // Format_Grayscale8 result
+    static QImage gradientThresholdMask(const QImage &source, const float percentageOfPixels);
+    // Color bytes < value become 0, the others 255
+    static QImage threshold(const QImage &source, const int value);
+    // First byte of every pixel < value gives 0 for all the color bytes, else 255
+    static QImage binarize(const QImage &source, const int value);
+    // Value reached by percentageOfPixels of the first bytes of the pixels
+    static int percentile(const QImage &image, const float percentageOfPixels);
+
+    // 32 bits sources only, the results keep their format
+    static QImage legacyConvolution(const QImage &source, const int kernelRadius, const vector<int> &kernel, const float kernelParameter);
+    // 3x3 window
+    static QImage legacyMedian(const QImage &source);
+    static QImage legacyGrayscale(const QImage &source);
+
+private:
+    static int channelsOf(const QImage &image);
+    static const uchar* pixel(const QImage &image, const int x, const int y);
+};
+
+#endif // REFERENCEFILTERS_H